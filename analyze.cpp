@@ -0,0 +1,670 @@
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
+#include <map>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <variant>
+
+#include "analyze.hpp"
+#include "encode.hpp"
+#include "parse.hpp"
+#include "lex.hpp"
+
+enum CostClass {
+	// register moves and zero idioms, handled at rename without a port
+	COST_MOVE,
+	COST_ALU,
+	COST_LEA,
+	// lea with base, index and displacement
+	COST_LEA_SLOW,
+	COST_SHIFT,
+	COST_SHIFT_CL,
+	COST_IMUL,
+	// idiv r8/r16/r32
+	COST_DIV32,
+	COST_DIV64,
+	COST_BRANCH,
+	COST_LOAD,
+	COST_STORE_ADDR,
+	COST_STORE_DATA,
+	// only the user side, the kernel isn't modeled
+	COST_SYSCALL,
+	// integer vector ops, shuffles and pmulld
+	COST_VEC_ALU,
+	COST_VEC_SHUFFLE,
+	COST_VEC_IMUL,
+	COST_FP_ADD,
+	// multiplies and fma
+	COST_FP_MUL,
+	// divides and square roots
+	COST_FP_DIV,
+	// movd/movq to a gpr, pmovmskb, ptest
+	COST_VEC_TO_GPR,
+	// locked read-modify-write, including xchg with memory
+	COST_ATOMIC,
+	// lfence and sfence are modelled like mfence
+	COST_FENCE,
+	COST_PAUSE,
+	COST_RDTSC,
+	COST_CLASSES,
+};
+
+struct ClassCost {
+	unsigned uops;
+	// ports any of the uops can go to
+	uint32_t ports;
+	unsigned latency;
+	// cycles the (unpipelined) divider is busy
+	unsigned div_cycles;
+};
+
+struct Model {
+	std::string name;
+	unsigned issue_width;
+	// the last port is the divider
+	std::vector<std::string> ports;
+	ClassCost costs[COST_CLASSES];
+};
+
+// numbers roughly follow uops.info and the Intel/AMD optimization manuals
+const Model MODELS[] = {
+	{
+		"skylake", 4,
+		{ "p0", "p1", "p2", "p3", "p4", "p5", "p6", "p7", "div" },
+		{
+			{ 1, 0x000, 0, 0 },
+			{ 1, 0x063, 1, 0 },
+			{ 1, 0x022, 1, 0 },
+			{ 1, 0x002, 3, 0 },
+			{ 1, 0x041, 1, 0 },
+			{ 3, 0x041, 2, 0 },
+			{ 1, 0x002, 3, 0 },
+			{ 10, 0x063, 26, 6 },
+			{ 57, 0x063, 42, 24 },
+			{ 1, 0x041, 1, 0 },
+			{ 1, 0x00c, 5, 0 },
+			{ 1, 0x08c, 0, 0 },
+			{ 1, 0x010, 0, 0 },
+			{ 1, 0x063, 1, 0 },
+			{ 1, 0x023, 1, 0 },
+			{ 1, 0x020, 1, 0 },
+			{ 2, 0x003, 10, 0 },
+			{ 1, 0x003, 4, 0 },
+			{ 1, 0x003, 4, 0 },
+			{ 1, 0x001, 11, 5 },
+			{ 1, 0x001, 2, 0 },
+			{ 8, 0x063, 18, 0 },
+			{ 3, 0x063, 33, 0 },
+			{ 4, 0x063, 140, 0 },
+			{ 20, 0x063, 25, 0 },
+		},
+	},
+	{
+		"zen3", 6,
+		{ "alu0", "alu1", "alu2", "alu3", "agu0", "agu1", "agu2", "fp0", "fp1", "fp2", "fp3", "div" },
+		{
+			{ 1, 0x00, 0, 0 },
+			{ 1, 0x0f, 1, 0 },
+			{ 1, 0x0f, 1, 0 },
+			{ 1, 0x0f, 2, 0 },
+			{ 1, 0x06, 1, 0 },
+			{ 1, 0x06, 1, 0 },
+			{ 1, 0x02, 3, 0 },
+			{ 2, 0x04, 10, 6 },
+			{ 2, 0x04, 14, 9 },
+			{ 1, 0x09, 1, 0 },
+			{ 1, 0x70, 4, 0 },
+			{ 1, 0x30, 0, 0 },
+			{ 0, 0x00, 0, 0 },
+			{ 1, 0x0f, 1, 0 },
+			{ 1, 0x780, 1, 0 },
+			{ 1, 0x300, 1, 0 },
+			{ 1, 0x080, 3, 0 },
+			{ 1, 0x600, 3, 0 },
+			{ 1, 0x180, 3, 0 },
+			{ 1, 0x100, 10, 4 },
+			{ 1, 0x200, 3, 0 },
+			{ 8, 0x0f, 8, 0 },
+			{ 7, 0x0f, 30, 0 },
+			{ 8, 0x0f, 65, 0 },
+			{ 37, 0x0f, 36, 0 },
+		},
+	},
+};
+
+const std::string analyze::DEFAULT_MODEL = "skylake";
+
+// register numbers used for dependencies: hardware GPR number, the flags, then
+// the hardware number of xmm/ymm registers after that
+const int REG_FLAGS = 16, REG_VEC = 17, REG_COUNT = REG_VEC + 16;
+const int REG_RAX = 0, REG_RCX = 1, REG_RDX = 2, REG_RBX = 3, REG_R11 = 11;
+
+struct InsnCost {
+	std::vector<CostClass> classes;
+	// class whose latency the result comes out after
+	CostClass op;
+	std::vector<int> reads, writes;
+	// registers the address of the load depends on
+	std::vector<int> addr;
+	bool load;
+};
+
+enum OpKind {
+	KIND_REG,
+	KIND_MEM,
+	KIND_IMM,
+};
+
+inline OpKind kind(const parse::Operand &op) {
+	if (op.type == parse::OPTYPE_REG)
+		return KIND_REG;
+	if (op.type == parse::OPTYPE_SIB || op.type == parse::OPTYPE_UNRES_SIB)
+		return KIND_MEM;
+	return KIND_IMM;
+}
+
+inline int reg_num(const parse::Operand &op, uint32_t line_num) {
+	encode::RegInfo info = encode::reg_info(op.reg, line_num);
+	return info.size >= 128 ? REG_VEC + info.code : info.code;
+}
+
+std::vector<int> address_regs(const parse::Operand &op, uint32_t line_num) {
+	std::vector<int> regs;
+	// unresolved ones keep their registers too
+	if (op.type == parse::OPTYPE_SIB || op.type == parse::OPTYPE_UNRES_SIB) {
+		parse::ScaledIndexByte sib = parse::memory(op);
+		if (sib.base.has_value())
+			regs.push_back(encode::reg_info(sib.base.value(), line_num).code);
+		if (sib.index.has_value())
+			regs.push_back(encode::reg_info(sib.index.value(), line_num).code);
+	}
+	return regs;
+}
+
+inline bool is_slow_lea(const parse::Operand &op) {
+	if (op.type == parse::OPTYPE_UNRES_SIB)
+		return true;
+	parse::ScaledIndexByte sib = parse::memory(op);
+	return sib.base.has_value() && sib.index.has_value() && sib.disp.has_value();
+}
+
+// sse and vex versions are modelled the same, except that the vex ones don't
+// read their destination
+InsnCost describe_simd(const parse::Instruction &insn, uint32_t line_num) {
+	InsnCost cost = { {}, COST_VEC_ALU, {}, {}, {}, false };
+	const parse::Operands &ops = insn.operands;
+	bool vex = insn.type >= lex::VMOVDQA;
+	lex::Instruction type = insn.type;
+	if (vex && type < lex::VPBROADCASTB)
+		type = (lex::Instruction) (type - lex::VMOVDQA + lex::MOVDQA);
+
+	// moves and broadcasts: a store, a load or a register copy
+	auto move = [&](CostClass reg_class) {
+		if (kind(ops[0]) == KIND_MEM) {
+			cost.addr = address_regs(ops[0], line_num);
+			cost.classes = { COST_STORE_ADDR, COST_STORE_DATA };
+			cost.reads = cost.addr;
+			cost.reads.push_back(reg_num(ops[1], line_num));
+			cost.op = COST_MOVE;
+			return;
+		}
+		cost.writes.push_back(reg_num(ops[0], line_num));
+		if (kind(ops[1]) == KIND_MEM) {
+			cost.addr = address_regs(ops[1], line_num);
+			cost.classes.push_back(COST_LOAD);
+			cost.load = true;
+			cost.op = COST_MOVE;
+			return;
+		}
+		cost.reads.push_back(reg_num(ops[1], line_num));
+		cost.classes.push_back(reg_class);
+		cost.op = reg_class;
+	};
+
+	switch (type) {
+		case lex::MOVDQA: case lex::MOVDQU: case lex::MOVAPS: case lex::MOVUPS:
+			move(COST_MOVE);
+			return cost;
+		case lex::MOVD: case lex::MOVQ: {
+			bool to_vec = kind(ops[0]) == KIND_REG && reg_num(ops[0], line_num) >= REG_VEC;
+			bool from_vec = kind(ops[1]) == KIND_REG && reg_num(ops[1], line_num) >= REG_VEC;
+			move(to_vec && from_vec ? COST_VEC_ALU : to_vec ? COST_VEC_SHUFFLE : COST_VEC_TO_GPR);
+			return cost;
+		}
+		case lex::VPBROADCASTB: case lex::VPBROADCASTD: case lex::VPBROADCASTQ:
+		case lex::VBROADCASTSS: case lex::VBROADCASTSD:
+			move(COST_VEC_SHUFFLE);
+			// byte broadcasts from memory still need a shuffle
+			if (type == lex::VPBROADCASTB && cost.load)
+				cost.classes.push_back(COST_VEC_SHUFFLE), cost.op = COST_VEC_SHUFFLE;
+			return cost;
+		case lex::VZEROUPPER:
+			cost.classes.push_back(COST_MOVE);
+			cost.op = COST_MOVE;
+			return cost;
+		case lex::PMULLD:
+			cost.op = COST_VEC_IMUL;
+			break;
+		case lex::PSHUFB: case lex::PSHUFD:
+			cost.op = COST_VEC_SHUFFLE;
+			break;
+		case lex::PMOVMSKB: case lex::PTEST:
+			cost.op = COST_VEC_TO_GPR;
+			break;
+		case lex::ADDPS: case lex::ADDPD: case lex::SUBPS: case lex::SUBPD:
+		case lex::ADDSS: case lex::ADDSD: case lex::SUBSS: case lex::SUBSD:
+			cost.op = COST_FP_ADD;
+			break;
+		case lex::MULPS: case lex::MULPD: case lex::MULSS: case lex::MULSD:
+		case lex::VFMADD132PS: case lex::VFMADD213PS: case lex::VFMADD231PS:
+		case lex::VFMADD132PD: case lex::VFMADD213PD: case lex::VFMADD231PD:
+			cost.op = COST_FP_MUL;
+			break;
+		case lex::DIVPS: case lex::DIVPD: case lex::DIVSS: case lex::DIVSD: case lex::SQRTPS:
+			cost.op = COST_FP_DIV;
+			break;
+		default:
+			break;
+	}
+
+	// the last operand can be memory, every register operand is read, and the
+	// destination too for the destructive sse forms and fma
+	bool unary = type == lex::PSHUFD || type == lex::PMOVMSKB || type == lex::SQRTPS;
+	bool fma = type >= lex::VFMADD132PS && type <= lex::VFMADD231PD;
+	for (size_t i = 1; i < ops.size(); i++) {
+		if (kind(ops[i]) == KIND_MEM) {
+			cost.addr = address_regs(ops[i], line_num);
+			cost.classes.push_back(COST_LOAD);
+			cost.load = true;
+		}
+		else if (kind(ops[i]) == KIND_REG)
+			cost.reads.push_back(reg_num(ops[i], line_num));
+	}
+	if (((!vex && !unary) || fma || type == lex::PTEST) && kind(ops[0]) == KIND_REG)
+		cost.reads.push_back(reg_num(ops[0], line_num));
+
+	// xor, andn, sub and compare for greater of a register with itself don't
+	// depend on it
+	bool zero_idiom = type == lex::PXOR || type == lex::XORPS || type == lex::PANDN ||
+		(type >= lex::PSUBB && type <= lex::PSUBQ) || type == lex::PCMPGTB;
+	if (zero_idiom && kind(ops.back()) == KIND_REG && kind(ops[ops.size() - 2]) == KIND_REG &&
+			reg_num(ops.back(), line_num) == reg_num(ops[ops.size() - 2], line_num)) {
+		cost.reads.clear();
+		cost.op = COST_MOVE;
+	}
+
+	cost.classes.push_back(cost.op);
+	if (type == lex::PTEST)
+		cost.classes.push_back(COST_VEC_SHUFFLE), cost.writes.push_back(REG_FLAGS);
+	else
+		cost.writes.push_back(reg_num(ops[0], line_num));
+	return cost;
+}
+
+InsnCost describe(const parse::Instruction &insn, uint32_t line_num) {
+	InsnCost cost = { {}, COST_ALU, {}, {}, {}, false };
+	const parse::Operands &ops = insn.operands;
+
+	// loads and stores for a memory operand, and the register operands read
+	auto use_mem = [&](const parse::Operand &op, bool load, bool store) {
+		cost.addr = address_regs(op, line_num);
+		if (load)
+			cost.classes.push_back(COST_LOAD), cost.load = true;
+		if (store)
+			cost.classes.push_back(COST_STORE_ADDR), cost.classes.push_back(COST_STORE_DATA);
+	};
+	auto read = [&](const parse::Operand &op) {
+		if (kind(op) == KIND_REG)
+			cost.reads.push_back(reg_num(op, line_num));
+	};
+
+	// locked instructions and xchg with memory all cost about the same, the
+	// old value comes back in the register for xchg, xadd and cmpxchg
+	bool implicit_lock = insn.type == lex::XCHG && (kind(ops[0]) == KIND_MEM || kind(ops[1]) == KIND_MEM);
+	if (insn.lock || implicit_lock) {
+		const parse::Operand &mem = kind(ops[0]) == KIND_MEM ? ops[0] : ops[1];
+		use_mem(mem, true, true);
+		cost.classes.push_back(COST_ATOMIC);
+		cost.op = COST_ATOMIC;
+		for (const parse::Operand &op : ops) {
+			read(op);
+			if (kind(op) == KIND_REG && (insn.type == lex::XCHG || insn.type == lex::XADD))
+				cost.writes.push_back(reg_num(op, line_num));
+		}
+		if (insn.type == lex::CMPXCHG || insn.type == lex::CMPXCHG16B)
+			cost.reads.push_back(REG_RAX), cost.writes.push_back(REG_RAX);
+		if (insn.type == lex::CMPXCHG16B)
+			cost.reads.push_back(REG_RDX), cost.writes.push_back(REG_RDX);
+		if (insn.type != lex::XCHG && insn.type != lex::NOT)
+			cost.writes.push_back(REG_FLAGS);
+		return cost;
+	}
+
+	switch (insn.type) {
+		case lex::MOV:
+			if (kind(ops[0]) == KIND_MEM) {
+				use_mem(ops[0], false, true);
+				read(ops[1]);
+				cost.reads.insert(cost.reads.end(), cost.addr.begin(), cost.addr.end());
+				cost.op = COST_MOVE;
+				break;
+			}
+			cost.writes.push_back(reg_num(ops[0], line_num));
+			if (kind(ops[1]) == KIND_MEM)
+				use_mem(ops[1], true, false), cost.op = COST_MOVE;
+			else if (kind(ops[1]) == KIND_REG)
+				read(ops[1]), cost.classes.push_back(COST_MOVE), cost.op = COST_MOVE;
+			else
+				cost.classes.push_back(COST_ALU);
+			break;
+		case lex::LEA:
+			cost.op = is_slow_lea(ops[1]) ? COST_LEA_SLOW : COST_LEA;
+			cost.classes.push_back(cost.op);
+			cost.reads = address_regs(ops[1], line_num);
+			cost.writes.push_back(reg_num(ops[0], line_num));
+			break;
+		// rsp updates of push, pop, call and ret are handled by the stack engine
+		case lex::PUSH:
+			if (kind(ops[0]) == KIND_MEM)
+				use_mem(ops[0], true, false);
+			read(ops[0]);
+			cost.classes.push_back(COST_STORE_ADDR);
+			cost.classes.push_back(COST_STORE_DATA);
+			cost.op = COST_MOVE;
+			break;
+		case lex::POP:
+			cost.classes.push_back(COST_LOAD);
+			cost.load = true;
+			cost.op = COST_MOVE;
+			if (kind(ops[0]) == KIND_MEM)
+				use_mem(ops[0], false, true), cost.addr.clear();
+			else
+				cost.writes.push_back(reg_num(ops[0], line_num));
+			break;
+		case lex::ADD: case lex::SUB: case lex::AND: case lex::OR: case lex::XOR: case lex::CMP: {
+			bool writes_dst = insn.type != lex::CMP;
+			// xor reg, reg and sub reg, reg don't depend on the old value
+			if ((insn.type == lex::XOR || insn.type == lex::SUB) && kind(ops[0]) == KIND_REG &&
+					kind(ops[1]) == KIND_REG && reg_num(ops[0], line_num) == reg_num(ops[1], line_num)) {
+				cost.classes.push_back(COST_MOVE);
+				cost.op = COST_MOVE;
+				cost.writes = { reg_num(ops[0], line_num), REG_FLAGS };
+				break;
+			}
+			if (kind(ops[0]) == KIND_MEM) {
+				use_mem(ops[0], true, writes_dst);
+				cost.classes.push_back(COST_ALU);
+				read(ops[1]);
+				cost.writes.push_back(REG_FLAGS);
+				break;
+			}
+			if (kind(ops[1]) == KIND_MEM)
+				use_mem(ops[1], true, false);
+			cost.classes.push_back(COST_ALU);
+			read(ops[0]);
+			read(ops[1]);
+			if (writes_dst)
+				cost.writes.push_back(reg_num(ops[0], line_num));
+			cost.writes.push_back(REG_FLAGS);
+			break;
+		}
+		case lex::INC: case lex::DEC: case lex::NOT:
+			cost.classes.push_back(COST_ALU);
+			read(ops[0]);
+			if (kind(ops[0]) == KIND_REG)
+				cost.writes.push_back(reg_num(ops[0], line_num));
+			if (insn.type != lex::NOT)
+				cost.writes.push_back(REG_FLAGS);
+			break;
+		case lex::IMUL:
+			if (kind(ops[1]) == KIND_MEM)
+				use_mem(ops[1], true, false);
+			cost.op = COST_IMUL;
+			cost.classes.push_back(COST_IMUL);
+			read(ops[0]);
+			read(ops[1]);
+			cost.writes = { reg_num(ops[0], line_num), REG_FLAGS };
+			break;
+		case lex::IDIV: {
+			if (kind(ops[0]) == KIND_MEM)
+				use_mem(ops[0], true, false);
+			bool wide = kind(ops[0]) == KIND_REG &&
+				ops[0].reg.type == lex::REGTYPE_GPR64;
+			cost.op = wide ? COST_DIV64 : COST_DIV32;
+			cost.classes.push_back(cost.op);
+			read(ops[0]);
+			cost.reads.push_back(REG_RAX);
+			cost.reads.push_back(REG_RDX);
+			cost.writes = { REG_RAX, REG_RDX, REG_FLAGS };
+			break;
+		}
+		case lex::SHL: case lex::SHR:
+			cost.op = kind(ops[1]) == KIND_REG ? COST_SHIFT_CL : COST_SHIFT;
+			cost.classes.push_back(cost.op);
+			read(ops[0]);
+			if (cost.op == COST_SHIFT_CL)
+				cost.reads.push_back(REG_RCX), cost.reads.push_back(REG_FLAGS);
+			if (kind(ops[0]) == KIND_REG)
+				cost.writes.push_back(reg_num(ops[0], line_num));
+			cost.writes.push_back(REG_FLAGS);
+			break;
+		case lex::JMP: case lex::CALL:
+			if (kind(ops[0]) == KIND_MEM)
+				use_mem(ops[0], true, false);
+			read(ops[0]);
+			cost.classes.push_back(COST_BRANCH);
+			if (insn.type == lex::CALL)
+				cost.classes.push_back(COST_STORE_ADDR), cost.classes.push_back(COST_STORE_DATA);
+			cost.op = COST_BRANCH;
+			break;
+		case lex::JE: case lex::JNE: case lex::JG: case lex::JGE: case lex::JL: case lex::JLE:
+		case lex::JA: case lex::JAE: case lex::JB: case lex::JBE:
+			cost.classes.push_back(COST_BRANCH);
+			cost.reads.push_back(REG_FLAGS);
+			cost.op = COST_BRANCH;
+			break;
+		case lex::RET:
+			cost.classes = { COST_LOAD, COST_BRANCH };
+			cost.load = true;
+			cost.op = COST_BRANCH;
+			break;
+		case lex::SYSCALL:
+			cost.classes.push_back(COST_SYSCALL);
+			cost.op = COST_SYSCALL;
+			cost.reads = { REG_RAX };
+			cost.writes = { REG_RAX, REG_RCX, REG_R11 };
+			break;
+		// without lock, xchg with memory is handled above
+		case lex::XCHG: case lex::XADD: case lex::CMPXCHG:
+			cost.classes = { COST_ALU, COST_ALU, COST_ALU };
+			if (kind(ops[0]) == KIND_MEM)
+				use_mem(ops[0], true, true);
+			read(ops[0]);
+			read(ops[1]);
+			if (kind(ops[0]) == KIND_REG)
+				cost.writes.push_back(reg_num(ops[0], line_num));
+			if (insn.type != lex::CMPXCHG)
+				cost.writes.push_back(reg_num(ops[1], line_num));
+			else
+				cost.reads.push_back(REG_RAX), cost.writes.push_back(REG_RAX);
+			if (insn.type != lex::XCHG)
+				cost.writes.push_back(REG_FLAGS);
+			break;
+		case lex::CMPXCHG16B:
+			use_mem(ops[0], true, true);
+			cost.classes.push_back(COST_ATOMIC);
+			cost.op = COST_ATOMIC;
+			cost.reads = { REG_RAX, REG_RDX, REG_RCX, REG_RBX };
+			cost.writes = { REG_RAX, REG_RDX, REG_FLAGS };
+			break;
+		case lex::MFENCE: case lex::LFENCE: case lex::SFENCE:
+			cost.classes.push_back(COST_FENCE);
+			cost.op = COST_FENCE;
+			break;
+		case lex::PAUSE:
+			cost.classes.push_back(COST_PAUSE);
+			cost.op = COST_PAUSE;
+			break;
+		case lex::PREFETCHT0: case lex::PREFETCHT1: case lex::PREFETCHT2: case lex::PREFETCHNTA:
+			use_mem(ops[0], true, false);
+			cost.op = COST_MOVE;
+			break;
+		case lex::MOVNTI: case lex::MOVNTDQ:
+			use_mem(ops[0], false, true);
+			read(ops[1]);
+			cost.reads.insert(cost.reads.end(), cost.addr.begin(), cost.addr.end());
+			cost.op = COST_MOVE;
+			break;
+		case lex::RDTSC: case lex::RDTSCP:
+			cost.classes.push_back(COST_RDTSC);
+			cost.op = COST_RDTSC;
+			cost.writes = { REG_RAX, REG_RDX };
+			if (insn.type == lex::RDTSCP)
+				cost.writes.push_back(REG_RCX);
+			break;
+		default:
+			return describe_simd(insn, line_num);
+	}
+	return cost;
+}
+
+inline bool ends_block(lex::Instruction type) {
+	return encode::is_branch(type) || type == lex::CALL || type == lex::RET || type == lex::SYSCALL;
+}
+
+// everything the current block has seen so far
+struct BlockState {
+	analyze::Block block;
+	// uops on each port mask, divider cycles count under the divider's bit
+	std::map<uint32_t, double> pressure;
+	unsigned ready[REG_COUNT];
+};
+
+void add_insn(BlockState &state, const Model &model, const parse::Instruction &insn, uint32_t line_num) {
+	InsnCost cost = describe(insn, line_num);
+	uint32_t div_port = 1 << (model.ports.size() - 1);
+	for (CostClass cls : cost.classes) {
+		const ClassCost &cc = model.costs[cls];
+		state.block.uops += cc.uops;
+		if (cc.ports != 0)
+			state.pressure[cc.ports] += cc.uops;
+		if (cc.div_cycles != 0)
+			state.pressure[div_port] += cc.div_cycles;
+	}
+
+	unsigned start = 0;
+	for (int reg : cost.reads)
+		start = std::max(start, state.ready[reg]);
+	if (cost.load) {
+		unsigned addr_ready = 0;
+		for (int reg : cost.addr)
+			addr_ready = std::max(addr_ready, state.ready[reg]);
+		start = std::max(start, addr_ready + model.costs[COST_LOAD].latency);
+	}
+	unsigned finish = start + model.costs[cost.op].latency;
+	for (int reg : cost.writes)
+		state.ready[reg] = finish;
+	state.block.latency = std::max(state.block.latency, finish);
+
+	if (state.block.insns == 0)
+		state.block.first_line = line_num;
+	state.block.last_line = line_num;
+	state.block.insns++;
+}
+
+// lower bound from port pressure: for every set of ports, the uops that can only
+// go to ports in that set have to share them
+void finish_block(BlockState &state, const Model &model, std::vector<analyze::Block> &blocks) {
+	if (state.block.insns == 0)
+		return;
+	analyze::Block &block = state.block;
+	block.issue_bound = (double) block.uops / model.issue_width;
+	block.port_bound = 0;
+	uint32_t best = 0;
+	for (uint32_t set = 1; set < (1u << model.ports.size()); set++) {
+		double total = 0;
+		for (const auto &[ports, uops] : state.pressure) {
+			if ((ports & set) == ports)
+				total += uops;
+		}
+		double bound = total / __builtin_popcount(set);
+		if (bound > block.port_bound)
+			block.port_bound = bound, best = set;
+	}
+	for (size_t i = 0; i < model.ports.size(); i++) {
+		if (best & (1 << i))
+			block.bottleneck.push_back(model.ports[i]);
+	}
+	blocks.push_back(block);
+}
+
+std::vector<analyze::Block> analyze::analyze(const parse::Program &program, const std::string &model_name) {
+	const Model *model = nullptr;
+	for (const Model &m : MODELS) {
+		if (m.name == model_name)
+			model = &m;
+	}
+	if (model == nullptr)
+		throw std::runtime_error("unknown microarchitecture model " + model_name);
+
+	std::vector<analyze::Block> blocks;
+	BlockState state = {};
+	std::string label;
+	auto restart = [&]() {
+		finish_block(state, *model, blocks);
+		state = {};
+	};
+
+	for (const parse::Statement &stmt : program.stmts) {
+		if (stmt.type == parse::STMTYPE_LBL) {
+			restart();
+			label = parse::label(program, stmt);
+			continue;
+		}
+		if (stmt.type == parse::STMTYPE_DIR && parse::directive(program, stmt).type == lex::SECTION) {
+			restart();
+			label = "";
+			continue;
+		}
+
+		const parse::Instruction *insn = nullptr;
+		uint64_t count = 1;
+		if (stmt.type == parse::STMTYPE_INSN)
+			insn = &std::get<parse::Instruction>(stmt.val);
+		if (stmt.type == parse::STMTYPE_TIMES) {
+			const parse::Repeat &repeat = parse::repeat(program, stmt);
+			if (repeat.body.type == parse::STMTYPE_INSN && repeat.count.type == parse::DIROPTYPE_IMM) {
+				insn = &std::get<parse::Instruction>(repeat.body.val);
+				count = std::get<uint64_t>(repeat.count.val);
+			}
+		}
+		if (insn == nullptr)
+			continue;
+
+		if (state.block.insns == 0) {
+			state.block.name = label.empty() ? "line " + std::to_string(stmt.line_num) : label;
+			label = "";
+		}
+		for (uint64_t i = 0; i < count; i++)
+			add_insn(state, *model, *insn, stmt.line_num);
+		if (ends_block(insn->type))
+			restart();
+	}
+	restart();
+	return blocks;
+}
+
+void analyze::report(std::ostream &out, const std::vector<analyze::Block> &blocks) {
+	out << std::fixed << std::setprecision(2);
+	for (const analyze::Block &block : blocks) {
+		out << block.name << ": lines " << block.first_line << "-" << block.last_line << ", "
+			<< block.insns << " instructions, " << block.uops << " uops\n";
+		out << "\tissue >= " << block.issue_bound << " cycles, ports >= " << block.port_bound << " cycles (";
+		for (size_t i = 0; i < block.bottleneck.size(); i++)
+			out << (i ? " " : "") << block.bottleneck[i];
+		out << "), latency " << block.latency << " cycles\n";
+	}
+}
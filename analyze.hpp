@@ -0,0 +1,34 @@
+#ifndef ANALYZE_HPP
+#define ANALYZE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "parse.hpp"
+
+namespace analyze {
+	// static estimates for one basic block, assuming everything hits in L1
+	// and the block runs back to back with itself
+	struct Block {
+		std::string name;
+		uint32_t first_line, last_line;
+		size_t insns, uops;
+		// cycles per run of the block: front end and port pressure lower bounds
+		double issue_bound, port_bound;
+		// ports that give port_bound
+		std::vector<std::string> bottleneck;
+		// longest chain of register dependencies in cycles
+		unsigned latency;
+	};
+
+	extern const std::string DEFAULT_MODEL;
+
+	// blocks are split at labels and after jmp, jcc, call, ret and syscall
+	std::vector<Block> analyze(const parse::Program &program, const std::string &model);
+	void report(std::ostream &out, const std::vector<Block> &blocks);
+}
+
+#endif
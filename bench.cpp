@@ -0,0 +1,207 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <linux/perf_event.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+#include "firstpass.hpp"
+#include "linker.hpp"
+#include "bench.hpp"
+
+// batches are made at least this long so that rdtscp itself doesn't show up
+const uint64_t MIN_BATCH_CYCLES = 5000;
+const uint64_t MAX_BATCH = 1 << 16;
+
+struct Counter {
+	const char *name;
+	uint32_t type;
+	uint64_t config;
+};
+const Counter COUNTERS[] = {
+	{ "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ "branch misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+	{ "l1d misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+		(PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+};
+
+typedef void (*Function)();
+
+// a linked image mapped into this process, unmapped again when done
+struct Image {
+	void *mem = MAP_FAILED;
+	size_t size = 0;
+	~Image() {
+		if (mem != MAP_FAILED)
+			munmap(mem, size);
+	}
+};
+
+inline uint64_t align_up(uint64_t val, uint64_t align) {
+	return (val + align - 1) / align * align;
+}
+
+inline uint64_t time_batch(Function fn, uint64_t batch) {
+	unsigned cpu;
+	uint64_t start = __rdtscp(&cpu);
+	// rdtscp waits for what comes before it but not for what comes after
+	_mm_lfence();
+	for (uint64_t i = 0; i < batch; i++)
+		fn();
+	uint64_t end = __rdtscp(&cpu);
+	_mm_lfence();
+	return end - start;
+}
+
+std::vector<uint64_t> time_batches(Function fn, uint64_t batch, uint64_t samples) {
+	std::vector<uint64_t> times(samples);
+	for (uint64_t &time : times)
+		time = time_batch(fn, batch);
+	return times;
+}
+
+// counts of each open counter over calls calls of fn, the first fd leads the group
+std::vector<uint64_t> count(const std::vector<int> &fds, Function fn, uint64_t calls) {
+	ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	for (uint64_t i = 0; i < calls; i++)
+		fn();
+	ioctl(fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+	// number of counters then each value
+	std::vector<uint64_t> values(fds.size() + 1);
+	if (read(fds[0], values.data(), values.size() * sizeof(uint64_t)) != (ssize_t) (values.size() * sizeof(uint64_t)))
+		throw std::runtime_error("cannot read hardware counters");
+	return std::vector<uint64_t>(values.begin() + 1, values.end());
+}
+
+bench::Result bench::run(const linker::Unit &unit, const std::string &func, uint64_t iters) {
+	bench::Result result;
+	result.func = func;
+	for (size_t i = 0; i < unit.symtab.size() && result.func.empty(); i++) {
+		if (unit.symtab[i].segment == firstpass::Code)
+			result.func = unit.symtab[i].symbol;
+	}
+	if (result.func.empty())
+		throw std::runtime_error(unit.file_name + ": no label to call");
+
+	// linked once to find out how much to map, then again where it is mapped
+	linker::Executable exe = linker::link({ unit }, linker::BASE_ADDRESS, "");
+	if (exe.segments.empty())
+		throw std::runtime_error(unit.file_name + ": nothing to run");
+	Image image;
+	const linker::Segment &last = exe.segments.back();
+	image.size = align_up(last.address + last.mem_size - linker::BASE_ADDRESS, linker::PAGE_SIZE);
+	// code assembled for a static executable can use 32 bit absolute addresses
+	image.mem = mmap(nullptr, image.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+	if (image.mem == MAP_FAILED)
+		throw std::runtime_error(std::string("cannot map code: ") + strerror(errno));
+	uint8_t *base = (uint8_t *) image.mem;
+	exe = linker::link({ unit }, (uint64_t) base, "");
+	for (const linker::Section &section : exe.sections)
+		std::copy(section.data.begin(), section.data.end(), (uint8_t *) section.address);
+	for (const linker::Segment &segment : exe.segments) {
+		int prot = segment.type == linker::SEG_TEXT ? PROT_READ | PROT_EXEC :
+			segment.type == linker::SEG_RODATA ? PROT_READ : PROT_READ | PROT_WRITE;
+		if (mprotect((void *) segment.address, align_up(segment.mem_size, linker::PAGE_SIZE), prot))
+			throw std::runtime_error(std::string("cannot map code: ") + strerror(errno));
+	}
+	// nothing needs the page of the headers here, it holds the empty function
+	// the cost of a call is measured with
+	base[0] = 0xc3;
+	if (mprotect(base, linker::PAGE_SIZE, PROT_READ | PROT_EXEC))
+		throw std::runtime_error(std::string("cannot map code: ") + strerror(errno));
+	Function empty = (Function) base, fn = nullptr;
+	for (const linker::Symbol &sym : exe.symbols) {
+		if (sym.code && sym.name == result.func)
+			fn = (Function) sym.address;
+	}
+	if (!fn)
+		throw std::runtime_error(unit.file_name + ": no label " + result.func + " in a code section");
+
+	// moving to another core halfway would mix up two caches and two tscs
+	result.cpu = sched_getcpu();
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (result.cpu >= 0)
+		CPU_SET(result.cpu, &set);
+	if (result.cpu < 0 || sched_setaffinity(0, sizeof(set), &set))
+		throw std::runtime_error(std::string("cannot pin to a core: ") + strerror(errno));
+
+	// warm up, then double the batch until it takes long enough to time
+	fn();
+	for (uint64_t i = 0; i < iters / 10; i++)
+		fn();
+	result.batch = 1;
+	while (result.batch < MAX_BATCH && time_batch(fn, result.batch) < MIN_BATCH_CYCLES)
+		result.batch *= 2;
+	uint64_t samples = std::max<uint64_t>(iters / result.batch, 1);
+	result.calls = samples * result.batch;
+
+	std::vector<uint64_t> times = time_batches(empty, result.batch, samples);
+	std::sort(times.begin(), times.end());
+	result.overhead = (double) times[times.size() / 2] / result.batch;
+	for (uint64_t time : time_batches(fn, result.batch, samples))
+		result.cycles.emplace_back(std::max((double) time / result.batch - result.overhead, 0.0));
+	std::sort(result.cycles.begin(), result.cycles.end());
+
+	// counters that the kernel or the cpu doesn't have are left out
+	std::vector<int> fds;
+	std::vector<const char *> names;
+	for (const Counter &counter : COUNTERS) {
+		perf_event_attr attr = {};
+		attr.size = sizeof(attr);
+		attr.type = counter.type;
+		attr.config = counter.config;
+		attr.disabled = fds.empty();
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP;
+		int fd = syscall(SYS_perf_event_open, &attr, 0, -1, fds.empty() ? -1 : fds[0], 0);
+		if (fd < 0 && fds.empty())
+			result.unavailable = std::string("perf_event_open: ") + strerror(errno);
+		if (fd < 0)
+			continue;
+		fds.push_back(fd);
+		names.push_back(counter.name);
+	}
+	if (!fds.empty()) {
+		std::vector<uint64_t> with = count(fds, fn, result.calls), without = count(fds, empty, result.calls);
+		for (size_t i = 0; i < fds.size(); i++)
+			result.counters.emplace_back(names[i], ((double) with[i] - (double) without[i]) / result.calls);
+		for (int fd : fds)
+			close(fd);
+	}
+	return result;
+}
+
+void bench::report(std::ostream &out, const bench::Result &result) {
+	const std::vector<double> &cycles = result.cycles;
+	auto percentile = [&](unsigned p) {
+		return cycles[std::min(cycles.size() * p / 100, cycles.size() - 1)];
+	};
+	out << std::fixed << std::setprecision(2);
+	out << result.func << ": " << result.calls << " calls in batches of " << result.batch
+		<< " on cpu " << result.cpu << "\n";
+	out << "\trdtscp cycles per call: median " << percentile(50) << ", p90 " << percentile(90)
+		<< ", p99 " << percentile(99) << ", min " << cycles.front() << " (" << result.overhead
+		<< " for the call taken off)\n";
+	if (result.counters.empty()) {
+		out << "\tno hardware counters (" << result.unavailable << ")\n";
+		return;
+	}
+	out << "\tper call:";
+	for (size_t i = 0; i < result.counters.size(); i++)
+		out << (i ? ", " : " ") << result.counters[i].second << " " << result.counters[i].first;
+	out << "\n";
+}
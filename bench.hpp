@@ -0,0 +1,39 @@
+#ifndef BENCH_HPP
+#define BENCH_HPP
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "linker.hpp"
+
+namespace bench {
+	// calls measured when --iters isn't given
+	const uint64_t DEFAULT_ITERS = 100000;
+
+	struct Result {
+		std::string func;
+		int cpu;
+		// calls timed, in batches of batch between two rdtscp
+		uint64_t calls, batch;
+		// rdtscp cycles per call of each batch, sorted, with the cost of calling
+		// an empty function (overhead) taken off
+		std::vector<double> cycles;
+		double overhead;
+		// hardware counters per call, also without the empty call. empty with the
+		// reason in unavailable when perf_event_open isn't allowed
+		std::vector<std::pair<std::string, double>> counters;
+		std::string unavailable;
+	};
+
+	// maps unit into executable memory in this process and calls func (its
+	// first label in a code section if empty) about iters times, pinned to the
+	// current core after warming up. func is called like a C function, so it
+	// has to return with ret and keep rbx, rbp, rsp and r12-r15
+	Result run(const linker::Unit &unit, const std::string &func, uint64_t iters);
+	void report(std::ostream &out, const Result &result);
+}
+
+#endif
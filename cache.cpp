@@ -0,0 +1,234 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <variant>
+
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "parse.hpp"
+#include "cache.hpp"
+
+namespace fs = std::filesystem;
+
+const uint64_t K0 = 0xa0761d6478bd642f, K1 = 0xe7037ed1a0b428db, K2 = 0x8ebc6af09c88c6e3;
+
+inline uint64_t mix(uint64_t a, uint64_t b) {
+	__uint128_t r = (__uint128_t) a * b;
+	return (uint64_t) r ^ (uint64_t) (r >> 64);
+}
+inline uint64_t read64(const uint8_t *p) {
+	uint64_t val;
+	memcpy(&val, p, 8);
+	return val;
+}
+
+uint64_t cache::hash(const void *data, size_t len, uint64_t seed) {
+	const uint8_t *p = (const uint8_t *) data;
+	uint64_t h = seed ^ K0, total = len;
+	for (; len >= 16; p += 16, len -= 16)
+		h = mix(read64(p) ^ K1, read64(p + 8) ^ h);
+	uint8_t tail[16] = {};
+	memcpy(tail, p, len);
+	h = mix(read64(tail) ^ K1, read64(tail + 8) ^ h);
+	return mix(h ^ K2, total ^ K0);
+}
+
+bool cache::hash_file(const std::string &file_name, uint64_t seed, uint64_t &out) {
+	int fd = open(file_name.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return false;
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		out = cache::hash(nullptr, 0, seed);
+		return true;
+	}
+	void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return false;
+	out = cache::hash(data, st.st_size, seed);
+	munmap(data, st.st_size);
+	return true;
+}
+
+std::string cache::directory() {
+	if (const char *dir = getenv("JASM_CACHE_DIR"))
+		return dir;
+	if (const char *dir = getenv("XDG_CACHE_HOME"))
+		return std::string(dir) + "/jasm";
+	if (const char *home = getenv("HOME"))
+		return std::string(home) + "/.cache/jasm";
+	return "";
+}
+
+bool cache::input_key(const std::string &file_name, const std::string &options, uint64_t &key) {
+	// a rebuilt assembler invalidates everything it cached, whichever part of it changed
+	static uint64_t version;
+	static const bool has_version = cache::hash_file("/proc/self/exe", 0, version);
+	if (!has_version)
+		return false;
+	uint64_t h = cache::hash(options.data(), options.size(), version);
+	// error messages and the line table name the file
+	h = cache::hash(file_name.data(), file_name.size(), h);
+	return cache::hash_file(file_name, h, key);
+}
+
+std::vector<std::string> cache::included_files(const parse::Program &program) {
+	std::vector<std::string> files;
+	for (const parse::Directive &dir : program.directives) {
+		if (dir.type == lex::INCBIN)
+			files.emplace_back(std::get<parse::IncludedBinary>(dir.operands[0].val).file_name);
+	}
+	return files;
+}
+
+inline std::string entry_name(const std::string &dir, uint64_t key, const char *ext) {
+	char name[32];
+	snprintf(name, sizeof(name), "/%016lx%s", key, ext);
+	return dir + name;
+}
+
+// reflink if the file system supports it, copy_file_range otherwise
+bool copy_file(const std::string &from, const std::string &to) {
+	int in = open(from.c_str(), O_RDONLY);
+	if (in < 0)
+		return false;
+	struct stat st;
+	int out = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	bool ok = out >= 0 && fstat(in, &st) == 0;
+	if (ok && ioctl(out, FICLONE, in) != 0) {
+		off_t left = st.st_size;
+		while (left > 0) {
+			ssize_t n = copy_file_range(in, nullptr, out, nullptr, left, 0);
+			if (n <= 0) {
+				ok = false;
+				break;
+			}
+			left -= n;
+		}
+	}
+	close(in);
+	if (out >= 0 && close(out) != 0)
+		ok = false;
+	return ok;
+}
+
+bool cache::fetch(const std::string &dir, uint64_t key, const std::string &output_name) {
+	if (dir.empty())
+		return false;
+	// included files and their hashes, one per line
+	std::ifstream deps(entry_name(dir, key, ".deps"));
+	if (!deps)
+		return false;
+	std::string line;
+	while (std::getline(deps, line)) {
+		size_t tab = line.find('\t');
+		uint64_t hash;
+		if (tab == std::string::npos || !cache::hash_file(line.substr(tab + 1), 0, hash) ||
+				strtoull(line.substr(0, tab).c_str(), nullptr, 16) != hash)
+			return false;
+	}
+	std::string object = entry_name(dir, key, ".o");
+	if (!copy_file(object, output_name))
+		return false;
+	// the modification time is what eviction goes by
+	utimensat(AT_FDCWD, object.c_str(), nullptr, 0);
+	return true;
+}
+
+// writes data to a new file with a unique name in dir, the name goes in tmp
+bool write_temp(const std::string &dir, const std::string &data, std::string &tmp) {
+	tmp = dir + "/tmp.XXXXXX";
+	int fd = mkstemp(tmp.data());
+	if (fd < 0)
+		return false;
+	bool ok = fchmod(fd, 0644) == 0;
+	for (size_t done = 0; ok && done < data.size();) {
+		ssize_t n = write(fd, data.data() + done, data.size() - done);
+		ok = n > 0;
+		done += ok ? n : 0;
+	}
+	ok = fsync(fd) == 0 && ok;
+	ok = close(fd) == 0 && ok;
+	if (!ok)
+		unlink(tmp.c_str());
+	return ok;
+}
+
+// oldest entries first until the cache is under max_size
+void evict(const std::string &dir, uint64_t max_size) {
+	struct Entry {
+		fs::path object;
+		fs::file_time_type used;
+		uint64_t size;
+	};
+	std::vector<Entry> entries;
+	uint64_t total = 0;
+	std::error_code ec;
+	for (const fs::directory_entry &file : fs::directory_iterator(dir, ec)) {
+		// temporary files belong to a store that may still be going on
+		if (file.path().extension() != ".o" || file.path().filename().string().rfind("tmp.", 0) == 0)
+			continue;
+		uint64_t size = file.file_size(ec);
+		fs::file_time_type used = file.last_write_time(ec);
+		if (ec)
+			continue;
+		entries.emplace_back(Entry { file.path(), used, size });
+		total += size;
+	}
+	std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.used < b.used; });
+	for (const Entry &entry : entries) {
+		if (total <= max_size)
+			break;
+		fs::path deps = entry.object;
+		fs::remove(entry.object, ec);
+		fs::remove(deps.replace_extension(".deps"), ec);
+		total -= entry.size;
+	}
+}
+
+void cache::store(const std::string &dir, uint64_t key, const std::string &output_name,
+		const std::vector<std::string> &included, uint64_t max_size) {
+	if (dir.empty())
+		return;
+	std::error_code ec;
+	fs::create_directories(dir, ec);
+
+	std::stringstream deps;
+	for (const std::string &file : included) {
+		uint64_t hash;
+		if (!cache::hash_file(file, 0, hash))
+			return;
+		deps << std::hex << hash << '\t' << file << '\n';
+	}
+	// written under a temporary name and renamed into place, so readers either
+	// see a whole entry or none, the object goes last since it's what marks an entry.
+	// the object's temporary name can't clash since the one of the deps is unique
+	std::string tmp;
+	if (!write_temp(dir, deps.str(), tmp))
+		return;
+	if (!copy_file(output_name, tmp + ".o") ||
+			rename(tmp.c_str(), entry_name(dir, key, ".deps").c_str()) != 0 ||
+			rename((tmp + ".o").c_str(), entry_name(dir, key, ".o").c_str()) != 0) {
+		unlink(tmp.c_str());
+		unlink((tmp + ".o").c_str());
+		return;
+	}
+	evict(dir, max_size);
+}
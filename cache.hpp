@@ -0,0 +1,35 @@
+#ifndef CACHE_HPP
+#define CACHE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "parse.hpp"
+
+namespace cache {
+	// fast non-cryptographic 64 bit hash, 16 bytes per round
+	uint64_t hash(const void *data, size_t len, uint64_t seed);
+	// hash of a file's contents through mmap, false if it can't be read
+	bool hash_file(const std::string &file_name, uint64_t seed, uint64_t &out);
+
+	// $JASM_CACHE_DIR, else $XDG_CACHE_HOME/jasm, else ~/.cache/jasm
+	std::string directory();
+
+	// key of an assembly: the source, the options that change the object and the
+	// version of the assembler, files included by the source are checked separately
+	bool input_key(const std::string &file_name, const std::string &options, uint64_t &key);
+	// files the object depends on besides the source (incbin)
+	std::vector<std::string> included_files(const parse::Program &program);
+
+	// copies the object cached under key to output_name (a reflink where the file
+	// system can), false if there is none or one of its included files changed
+	bool fetch(const std::string &dir, uint64_t key, const std::string &output_name);
+	// adds output_name under key, replacing entries atomically, then evicts the least
+	// recently used entries while the cache is over max_size bytes
+	void store(const std::string &dir, uint64_t key, const std::string &output_name,
+		const std::vector<std::string> &included, uint64_t max_size);
+}
+
+#endif
@@ -0,0 +1,43 @@
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "lex.hpp"
+#include "parse.hpp"
+#include "optimize.hpp"
+#include "firstpass.hpp"
+#include "profile.hpp"
+#include "context.hpp"
+
+void context::reset(context::AssemblerContext &ctx) {
+	ctx.diagnostics.clear();
+	ctx.lines = 0;
+	parse::clear(ctx.program);
+	ctx.peephole = { 0, 0 };
+	ctx.reordered = { 0, 0, 0 };
+}
+
+void context::report(context::AssemblerContext &ctx, uint32_t file, const lex::AssembleError &err) {
+	ctx.diagnostics.emplace_back(ctx.files[file] + ":" + std::to_string(err.line_num) +
+		": assemble error: " + err.what());
+}
+
+bool context::assemble(context::AssemblerContext &ctx, uint32_t file) {
+	context::reset(ctx);
+	try {
+		lex::lex(ctx, file);
+		parse::parse(ctx, file);
+		if (ctx.options.optimize)
+			ctx.peephole = optimize::peephole(ctx.program);
+		firstpass::firstpass(ctx);
+		if (!ctx.options.profile.empty()) {
+			ctx.reordered = profile::reorder(ctx.program, ctx.layout, ctx.symtab, ctx.options.profile);
+			firstpass::firstpass(ctx);
+		}
+	}
+	catch (const lex::AssembleError &err) {
+		context::report(ctx, file, err);
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,68 @@
+#ifndef CONTEXT_HPP
+#define CONTEXT_HPP
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "lex.hpp"
+#include "parse.hpp"
+#include "optimize.hpp"
+#include "firstpass.hpp"
+#include "profile.hpp"
+
+namespace context {
+	struct Options {
+		bool optimize = false, analyze = false, debug = false;
+		// for secondpass, 0 for one per core
+		unsigned threads = 0;
+		std::string model;
+		// lay code out by these counts when not empty
+		std::vector<profile::Sample> profile;
+	};
+
+	// everything one assembly reads and writes, so assemblies on different
+	// threads only need their own context. buffers are cleared between runs
+	// rather than freed, a context that is reused keeps their capacity
+	struct AssemblerContext {
+		// statements refer to their source by index
+		std::vector<std::string> files;
+		Options options;
+		// file:line: assemble error: message, for every error of the last run
+		std::vector<std::string> diagnostics;
+
+		std::string source;
+		// lex's tokens of the line it is on, as views into source, and the current one lowercased
+		std::vector<std::string_view> line_tokens;
+		std::string lowered;
+		std::vector<std::vector<lex::Lexeme>> tokens;
+		// how many of tokens the last lex filled, the rest are kept for their capacity
+		size_t lines = 0;
+		parse::Program program;
+		// parse's copy of the operand it works on and where each operand is
+		std::vector<lex::Lexeme> operand;
+		std::vector<parse::TokenRange> operand_ranges;
+		optimize::Report peephole = { 0, 0 };
+		std::vector<firstpass::Symbol> symtab;
+		firstpass::Layout layout;
+		// firstpass's sizes that don't depend on the layout, the statement of
+		// each label by name and the last label of each section
+		std::vector<uint64_t> fixed_size;
+		std::vector<size_t> label_stmt, last_label;
+		profile::Report reordered = { 0, 0, 0 };
+	};
+
+	// clears the output of the last run, keeping the files, options and buffers.
+	// the symbol table and layout are written over by the next firstpass
+	void reset(AssemblerContext &ctx);
+	// adds err as a diagnostic for one of the files
+	void report(AssemblerContext &ctx, uint32_t file, const lex::AssembleError &err);
+
+	// lex, parse, peephole (with options.optimize), firstpass and the profile
+	// guided layout (with options.profile) of one file,
+	// false with the error in diagnostics if one of them fails
+	bool assemble(AssemblerContext &ctx, uint32_t file);
+}
+
+#endif
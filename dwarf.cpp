@@ -0,0 +1,173 @@
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "dwarf.hpp"
+
+// same line program parameters as GAS
+const int LINE_BASE = -5;
+const uint8_t LINE_RANGE = 14, OPCODE_BASE = 13;
+const uint8_t STANDARD_OPCODE_LENGTHS[OPCODE_BASE - 1] = { 0, 1, 1, 1, 1, 0, 0, 0, 1, 0, 0, 1 };
+
+const uint8_t DW_LNS_ADVANCE_PC = 2, DW_LNS_ADVANCE_LINE = 3, DW_LNS_SET_FILE = 4;
+const uint8_t DW_LNE_END_SEQUENCE = 1, DW_LNE_SET_ADDRESS = 2;
+
+const uint8_t DW_TAG_COMPILE_UNIT = 0x11;
+const uint8_t DW_AT_NAME = 0x03, DW_AT_STMT_LIST = 0x10, DW_AT_LOW_PC = 0x11, DW_AT_LANGUAGE = 0x13,
+	DW_AT_COMP_DIR = 0x1b, DW_AT_PRODUCER = 0x25, DW_AT_RANGES = 0x55;
+const uint8_t DW_FORM_ADDR = 0x01, DW_FORM_DATA2 = 0x05, DW_FORM_STRING = 0x08, DW_FORM_SEC_OFFSET = 0x17;
+const uint16_t DW_LANG_MIPS_ASSEMBLER = 0x8001;
+
+inline void put_uleb(std::vector<uint8_t> &out, uint64_t val) {
+	do {
+		uint8_t byte = val & 0x7f;
+		val >>= 7;
+		out.push_back(val ? byte | 0x80 : byte);
+	} while (val);
+}
+inline void put_sleb(std::vector<uint8_t> &out, int64_t val) {
+	while (true) {
+		uint8_t byte = val & 0x7f;
+		val >>= 7;
+		if ((val == 0 && !(byte & 0x40)) || (val == -1 && (byte & 0x40))) {
+			out.push_back(byte);
+			return;
+		}
+		out.push_back(byte | 0x80);
+	}
+}
+inline void put_int(std::vector<uint8_t> &out, uint64_t val, uint32_t size) {
+	for (uint32_t i = 0; i < size; i++)
+		out.push_back((val >> (i * 8)) & 0xff);
+}
+inline void put_string(std::vector<uint8_t> &out, const std::string &str) {
+	out.insert(out.end(), str.begin(), str.end());
+	out.push_back(0);
+}
+inline void patch_int(std::vector<uint8_t> &out, uint64_t offset, uint64_t val, uint32_t size) {
+	for (uint32_t i = 0; i < size; i++)
+		out[offset + i] = (val >> (i * 8)) & 0xff;
+}
+
+void dwarf::add_row(dwarf::LineSequence &seq, uint64_t address, uint32_t file, uint32_t line) {
+	if (seq.program.empty()) {
+		// start of the section, relocated
+		seq.program.insert(seq.program.end(), { 0, 9, DW_LNE_SET_ADDRESS });
+		seq.address_field = seq.program.size();
+		put_int(seq.program, 0, 8);
+		seq.address = 0, seq.file = 0, seq.line = 1;
+	}
+	// a row per line is enough, times and multi line data don't need more
+	else if (file == seq.file && line == seq.line)
+		return;
+
+	if (file != seq.file) {
+		seq.program.push_back(DW_LNS_SET_FILE);
+		put_uleb(seq.program, file + 1);
+	}
+	int64_t line_delta = (int64_t) line - seq.line;
+	uint64_t addr_delta = address - seq.address;
+	if (line_delta < LINE_BASE || line_delta >= LINE_BASE + LINE_RANGE) {
+		seq.program.push_back(DW_LNS_ADVANCE_LINE);
+		put_sleb(seq.program, line_delta);
+		line_delta = 0;
+	}
+	// special opcodes advance the line and address and append a row in one byte
+	uint64_t special = (line_delta - LINE_BASE) + LINE_RANGE * addr_delta + OPCODE_BASE;
+	if (special > UINT8_MAX) {
+		seq.program.push_back(DW_LNS_ADVANCE_PC);
+		put_uleb(seq.program, addr_delta);
+		special = (line_delta - LINE_BASE) + OPCODE_BASE;
+	}
+	seq.program.push_back(special);
+	seq.address = address, seq.file = file, seq.line = line;
+}
+
+void dwarf::end_sequence(dwarf::LineSequence &seq, uint64_t address) {
+	if (seq.program.empty())
+		return;
+	if (address != seq.address) {
+		seq.program.push_back(DW_LNS_ADVANCE_PC);
+		put_uleb(seq.program, address - seq.address);
+		seq.address = address;
+	}
+	seq.program.insert(seq.program.end(), { 0, 1, DW_LNE_END_SEQUENCE });
+}
+
+std::vector<dwarf::DebugSection> dwarf::build(const std::vector<dwarf::LineSequence> &seqs,
+		const std::vector<std::string> &section_names, const std::vector<std::string> &files,
+		const std::string &comp_dir) {
+	dwarf::DebugSection abbrev = { ".debug_abbrev", {}, {} };
+	abbrev.data = {
+		1, DW_TAG_COMPILE_UNIT, 0,
+		DW_AT_STMT_LIST, DW_FORM_SEC_OFFSET,
+		DW_AT_LOW_PC, DW_FORM_ADDR,
+		DW_AT_RANGES, DW_FORM_SEC_OFFSET,
+		DW_AT_NAME, DW_FORM_STRING,
+		DW_AT_COMP_DIR, DW_FORM_STRING,
+		DW_AT_PRODUCER, DW_FORM_STRING,
+		DW_AT_LANGUAGE, DW_FORM_DATA2,
+		0, 0, 0
+	};
+
+	// the compile unit covers every code section, low_pc is 0 so the ranges are addresses
+	dwarf::DebugSection info = { ".debug_info", {}, {} };
+	std::vector<uint8_t> &out = info.data;
+	put_int(out, 0, 4);
+	put_int(out, 4, 2);
+	info.refs.emplace_back(dwarf::SectionRef { out.size(), 4, ".debug_abbrev", 0 });
+	put_int(out, 0, 4);
+	out.push_back(8);
+	put_uleb(out, 1);
+	info.refs.emplace_back(dwarf::SectionRef { out.size(), 4, ".debug_line", 0 });
+	put_int(out, 0, 4);
+	put_int(out, 0, 8);
+	info.refs.emplace_back(dwarf::SectionRef { out.size(), 4, ".debug_ranges", 0 });
+	put_int(out, 0, 4);
+	put_string(out, files.empty() ? "" : files[0]);
+	put_string(out, comp_dir);
+	put_string(out, "jasm");
+	put_int(out, DW_LANG_MIPS_ASSEMBLER, 2);
+	patch_int(out, 0, out.size() - 4, 4);
+
+	dwarf::DebugSection ranges = { ".debug_ranges", {}, {} };
+	for (const dwarf::LineSequence &seq : seqs) {
+		if (seq.program.empty())
+			continue;
+		const std::string &section = section_names[seq.section];
+		ranges.refs.emplace_back(dwarf::SectionRef { ranges.data.size(), 8, section, 0 });
+		put_int(ranges.data, 0, 8);
+		ranges.refs.emplace_back(dwarf::SectionRef { ranges.data.size(), 8, section, seq.address });
+		put_int(ranges.data, 0, 8);
+	}
+	put_int(ranges.data, 0, 16);
+
+	dwarf::DebugSection line = { ".debug_line", {}, {} };
+	std::vector<uint8_t> &prog = line.data;
+	put_int(prog, 0, 4);
+	put_int(prog, 4, 2);
+	put_int(prog, 0, 4);
+	uint64_t header_start = prog.size();
+	// minimum instruction length, max ops per instruction, default is_stmt
+	prog.insert(prog.end(), { 1, 1, 1, (uint8_t) LINE_BASE, LINE_RANGE, OPCODE_BASE });
+	prog.insert(prog.end(), STANDARD_OPCODE_LENGTHS, STANDARD_OPCODE_LENGTHS + OPCODE_BASE - 1);
+	// no include directories, every file is in comp_dir
+	prog.push_back(0);
+	for (const std::string &file : files) {
+		put_string(prog, file);
+		prog.insert(prog.end(), { 0, 0, 0 });
+	}
+	prog.push_back(0);
+	patch_int(prog, header_start - 4, prog.size() - header_start, 4);
+	for (const dwarf::LineSequence &seq : seqs) {
+		if (seq.program.empty())
+			continue;
+		line.refs.emplace_back(dwarf::SectionRef {
+			prog.size() + seq.address_field, 8, section_names[seq.section], 0
+		});
+		prog.insert(prog.end(), seq.program.begin(), seq.program.end());
+	}
+	patch_int(prog, 0, prog.size() - 4, 4);
+
+	return { abbrev, info, ranges, line };
+}
@@ -0,0 +1,48 @@
+#ifndef DWARF_HPP
+#define DWARF_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace dwarf {
+	// DWARF 4 line number program for one code section, rows are appended while
+	// the section is encoded and only stored as deltas from the previous row
+	struct LineSequence {
+		uint32_t section;
+		std::vector<uint8_t> program;
+		// state machine registers after the last row
+		uint64_t address;
+		uint32_t file, line;
+		// offset of the DW_LNE_set_address operand in program
+		uint64_t address_field;
+	};
+	// what add_row takes, for rows that are recorded before they can be added in order
+	struct Row {
+		uint64_t address;
+		uint32_t file, line;
+	};
+	// file is the index into the file list passed to build
+	void add_row(LineSequence &seq, uint64_t address, uint32_t file, uint32_t line);
+	void end_sequence(LineSequence &seq, uint64_t address);
+
+	// field that holds an offset into another section, so it needs a relocation
+	struct SectionRef {
+		uint64_t offset;
+		uint32_t size;
+		std::string section;
+		uint64_t addend;
+	};
+	struct DebugSection {
+		std::string name;
+		std::vector<uint8_t> data;
+		std::vector<SectionRef> refs;
+	};
+
+	// .debug_abbrev, .debug_info, .debug_ranges and .debug_line for a single compile
+	// unit covering every sequence, file names are relative to comp_dir
+	std::vector<DebugSection> build(const std::vector<LineSequence> &seqs, const std::vector<std::string> &section_names,
+		const std::vector<std::string> &files, const std::string &comp_dir);
+}
+
+#endif
@@ -0,0 +1,330 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <elf.h>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "firstpass.hpp"
+#include "secondpass.hpp"
+#include "dwarf.hpp"
+#include "linker.hpp"
+#include "elf.hpp"
+
+const uint32_t RELOC_TYPES[] = {
+	R_X86_64_8, R_X86_64_16, R_X86_64_32, R_X86_64_32S, R_X86_64_64,
+	R_X86_64_PC32, R_X86_64_PLT32,
+};
+
+struct OutSection {
+	std::string name;
+	Elf64_Shdr header;
+	std::vector<uint8_t> data;
+};
+
+inline uint32_t add_string(std::vector<uint8_t> &strtab, const std::string &str) {
+	uint32_t offset = strtab.size();
+	strtab.insert(strtab.end(), str.begin(), str.end());
+	strtab.push_back(0);
+	return offset;
+}
+
+template <typename T>
+inline void append(std::vector<uint8_t> &out, const T &val) {
+	const uint8_t *bytes = (const uint8_t *) &val;
+	out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+inline OutSection new_section(const std::string &name, uint32_t type, uint64_t flags, uint64_t align) {
+	OutSection section = { name, {}, {} };
+	section.header.sh_type = type;
+	section.header.sh_flags = flags;
+	section.header.sh_addralign = align;
+	return section;
+}
+
+void elf::write_object(const std::string &file_name, const firstpass::Layout &layout,
+		const std::vector<firstpass::Symbol> &symtab, const secondpass::Output &out,
+		const std::vector<dwarf::DebugSection> &debug) {
+	std::vector<OutSection> sections;
+	sections.emplace_back(new_section("", SHT_NULL, 0, 0));
+
+	// our sections first, so section i of the layout is number i + 1
+	for (size_t i = 0; i < layout.sections.size(); i++) {
+		const firstpass::Section &section = layout.sections[i];
+		bool bss = section.name == ".bss" || section.name.rfind(".bss.", 0) == 0;
+		uint64_t flags = SHF_ALLOC;
+		if (section.segment == firstpass::Code)
+			flags |= SHF_EXECINSTR;
+		else if (section.name.rfind(".rodata", 0) != 0)
+			flags |= SHF_WRITE;
+		sections.emplace_back(new_section(section.name, bss ? SHT_NOBITS : SHT_PROGBITS, flags, section.align));
+		sections.back().header.sh_size = section.size;
+		if (!bss)
+			sections.back().data = out.contents[i];
+	}
+	std::unordered_map<std::string, uint32_t> section_index;
+	for (const dwarf::DebugSection &section : debug) {
+		section_index[section.name] = sections.size();
+		sections.emplace_back(new_section(section.name, SHT_PROGBITS, 0, 1));
+		sections.back().data = section.data;
+	}
+	for (size_t i = 0; i < layout.sections.size(); i++)
+		section_index[layout.sections[i].name] = i + 1;
+
+	// locals (a symbol for every section, then labels) have to come before globals
+	std::vector<uint8_t> strtab = { 0 };
+	std::vector<Elf64_Sym> syms(1);
+	std::vector<uint32_t> section_sym(sections.size());
+	for (size_t i = 1; i < sections.size(); i++) {
+		section_sym[i] = syms.size();
+		Elf64_Sym sym = {};
+		sym.st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION);
+		sym.st_shndx = i;
+		syms.emplace_back(sym);
+	}
+	auto add_label = [&](const firstpass::Symbol &label, bool global) {
+		Elf64_Sym sym = {};
+		sym.st_name = add_string(strtab, label.symbol);
+		int type = !global ? STT_NOTYPE : label.segment == firstpass::Code ? STT_FUNC : STT_OBJECT;
+		sym.st_info = ELF64_ST_INFO(global ? STB_GLOBAL : STB_LOCAL, type);
+		sym.st_shndx = label.section + 1;
+		sym.st_value = label.offset;
+		sym.st_size = global ? label.size : 0;
+		syms.emplace_back(sym);
+	};
+	auto is_global = [&](const std::string &name) {
+		return std::find(out.globals.begin(), out.globals.end(), name) != out.globals.end();
+	};
+	for (const firstpass::Symbol &label : symtab) {
+		if (!is_global(label.symbol))
+			add_label(label, false);
+	}
+	uint32_t first_global = syms.size();
+	for (const firstpass::Symbol &label : symtab) {
+		if (is_global(label.symbol))
+			add_label(label, true);
+	}
+	uint32_t first_extern = syms.size();
+	for (const std::string &name : out.externs) {
+		Elf64_Sym sym = {};
+		sym.st_name = add_string(strtab, name);
+		sym.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE);
+		sym.st_shndx = SHN_UNDEF;
+		syms.emplace_back(sym);
+	}
+
+	auto add_rela = [&](uint32_t target, const std::vector<Elf64_Rela> &relas) {
+		if (relas.empty())
+			return;
+		OutSection rela = new_section(".rela" + sections[target].name, SHT_RELA, SHF_INFO_LINK, 8);
+		rela.header.sh_info = target;
+		rela.header.sh_entsize = sizeof(Elf64_Rela);
+		for (const Elf64_Rela &entry : relas)
+			append(rela.data, entry);
+		sections.emplace_back(rela);
+	};
+	size_t user_sections = layout.sections.size() + 1;
+	for (size_t i = 0; i < layout.sections.size(); i++) {
+		std::vector<Elf64_Rela> relas;
+		for (const secondpass::Relocation &reloc : out.relocs[i]) {
+			uint32_t sym = reloc.target.base == secondpass::EXTERN ? first_extern + reloc.target.index :
+				section_sym[reloc.target.index + 1];
+			relas.emplace_back(Elf64_Rela {
+				reloc.offset, ELF64_R_INFO(sym, RELOC_TYPES[reloc.type]), (int64_t) reloc.target.val
+			});
+		}
+		add_rela(i + 1, relas);
+	}
+	for (size_t i = 0; i < debug.size(); i++) {
+		std::vector<Elf64_Rela> relas;
+		for (const dwarf::SectionRef &ref : debug[i].refs) {
+			uint32_t sym = section_sym[section_index[ref.section]];
+			relas.emplace_back(Elf64_Rela {
+				ref.offset, ELF64_R_INFO(sym, ref.size == 8 ? R_X86_64_64 : R_X86_64_32), (int64_t) ref.addend
+			});
+		}
+		add_rela(user_sections + i, relas);
+	}
+
+	uint32_t symtab_index = sections.size();
+	OutSection symtab_section = new_section(".symtab", SHT_SYMTAB, 0, 8);
+	symtab_section.header.sh_link = symtab_index + 1;
+	symtab_section.header.sh_info = first_global;
+	symtab_section.header.sh_entsize = sizeof(Elf64_Sym);
+	for (const Elf64_Sym &sym : syms)
+		append(symtab_section.data, sym);
+	sections.emplace_back(symtab_section);
+	sections.emplace_back(new_section(".strtab", SHT_STRTAB, 0, 1));
+	sections.back().data = strtab;
+	sections.emplace_back(new_section(".shstrtab", SHT_STRTAB, 0, 1));
+
+	std::vector<uint8_t> shstrtab = { 0 };
+	for (OutSection &section : sections) {
+		if (section.header.sh_type == SHT_RELA)
+			section.header.sh_link = symtab_index;
+		if (section.header.sh_type != SHT_NULL)
+			section.header.sh_name = add_string(shstrtab, section.name);
+	}
+	sections.back().data = shstrtab;
+
+	// header, section contents, then the section header table
+	std::vector<uint8_t> file;
+	file.resize(sizeof(Elf64_Ehdr));
+	for (OutSection &section : sections) {
+		if (section.header.sh_type == SHT_NULL)
+			continue;
+		uint64_t align = std::max<uint64_t>(section.header.sh_addralign, 1);
+		file.resize((file.size() + align - 1) / align * align);
+		section.header.sh_offset = file.size();
+		if (section.header.sh_type != SHT_NOBITS) {
+			section.header.sh_size = section.data.size();
+			file.insert(file.end(), section.data.begin(), section.data.end());
+		}
+	}
+	file.resize((file.size() + 7) / 8 * 8);
+
+	Elf64_Ehdr ehdr = {};
+	memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+	ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+	ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+	ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+	ehdr.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+	ehdr.e_type = ET_REL;
+	ehdr.e_machine = EM_X86_64;
+	ehdr.e_version = EV_CURRENT;
+	ehdr.e_shoff = file.size();
+	ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+	ehdr.e_shentsize = sizeof(Elf64_Shdr);
+	ehdr.e_shnum = sections.size();
+	ehdr.e_shstrndx = sections.size() - 1;
+	memcpy(file.data(), &ehdr, sizeof(ehdr));
+	for (const OutSection &section : sections)
+		append(file, section.header);
+
+	std::ofstream stream(file_name, std::ios::binary);
+	if (!stream.write((const char *) file.data(), file.size()))
+		throw std::runtime_error("cannot write " + file_name);
+}
+
+void elf::write_executable(const std::string &file_name, const linker::Executable &exe) {
+	std::vector<OutSection> sections;
+	sections.emplace_back(new_section("", SHT_NULL, 0, 0));
+	for (const linker::Section &section : exe.sections) {
+		uint64_t flags = SHF_ALLOC;
+		if (section.segment == linker::SEG_TEXT)
+			flags |= SHF_EXECINSTR;
+		else if (section.segment == linker::SEG_DATA)
+			flags |= SHF_WRITE;
+		sections.emplace_back(new_section(section.name, section.nobits ? SHT_NOBITS : SHT_PROGBITS, flags, section.align));
+		sections.back().header.sh_addr = section.address;
+		sections.back().header.sh_offset = section.address - exe.base;
+		sections.back().header.sh_size = section.size;
+		sections.back().data = section.data;
+	}
+
+	// locals have to come before globals
+	std::vector<uint8_t> strtab = { 0 };
+	std::vector<Elf64_Sym> syms(1);
+	auto add_symbol = [&](const linker::Symbol &symbol) {
+		Elf64_Sym sym = {};
+		sym.st_name = add_string(strtab, symbol.name);
+		int type = !symbol.global ? STT_NOTYPE : symbol.code ? STT_FUNC : STT_OBJECT;
+		sym.st_info = ELF64_ST_INFO(symbol.global ? STB_GLOBAL : STB_LOCAL, type);
+		sym.st_shndx = symbol.section + 1;
+		sym.st_value = symbol.address;
+		sym.st_size = symbol.global ? symbol.size : 0;
+		syms.emplace_back(sym);
+	};
+	for (const linker::Symbol &symbol : exe.symbols) {
+		if (!symbol.global)
+			add_symbol(symbol);
+	}
+	uint32_t first_global = syms.size();
+	for (const linker::Symbol &symbol : exe.symbols) {
+		if (symbol.global)
+			add_symbol(symbol);
+	}
+	uint32_t symtab_index = sections.size();
+	OutSection symtab_section = new_section(".symtab", SHT_SYMTAB, 0, 8);
+	symtab_section.header.sh_link = symtab_index + 1;
+	symtab_section.header.sh_info = first_global;
+	symtab_section.header.sh_entsize = sizeof(Elf64_Sym);
+	for (const Elf64_Sym &sym : syms)
+		append(symtab_section.data, sym);
+	sections.emplace_back(symtab_section);
+	sections.emplace_back(new_section(".strtab", SHT_STRTAB, 0, 1));
+	sections.back().data = strtab;
+	sections.emplace_back(new_section(".shstrtab", SHT_STRTAB, 0, 1));
+	std::vector<uint8_t> shstrtab = { 0 };
+	for (OutSection &section : sections) {
+		if (section.header.sh_type != SHT_NULL)
+			section.header.sh_name = add_string(shstrtab, section.name);
+	}
+	sections.back().data = shstrtab;
+
+	// headers in the first page, the loaded sections where their address says,
+	// then the sections that aren't loaded and the section header table
+	std::vector<uint8_t> file(sizeof(Elf64_Ehdr) + exe.segments.size() * sizeof(Elf64_Phdr));
+	for (const linker::Section &section : exe.sections) {
+		if (section.nobits)
+			continue;
+		uint64_t offset = section.address - exe.base;
+		file.resize(std::max<uint64_t>(file.size(), offset + section.data.size()));
+		std::copy(section.data.begin(), section.data.end(), file.begin() + offset);
+	}
+	for (size_t i = exe.sections.size() + 1; i < sections.size(); i++) {
+		OutSection &section = sections[i];
+		uint64_t align = std::max<uint64_t>(section.header.sh_addralign, 1);
+		file.resize((file.size() + align - 1) / align * align);
+		section.header.sh_offset = file.size();
+		section.header.sh_size = section.data.size();
+		file.insert(file.end(), section.data.begin(), section.data.end());
+	}
+	file.resize((file.size() + 7) / 8 * 8);
+
+	Elf64_Ehdr ehdr = {};
+	memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+	ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+	ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+	ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+	ehdr.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+	ehdr.e_type = ET_EXEC;
+	ehdr.e_machine = EM_X86_64;
+	ehdr.e_version = EV_CURRENT;
+	ehdr.e_entry = exe.entry;
+	ehdr.e_phoff = sizeof(Elf64_Ehdr);
+	ehdr.e_shoff = file.size();
+	ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+	ehdr.e_phentsize = sizeof(Elf64_Phdr);
+	ehdr.e_phnum = exe.segments.size();
+	ehdr.e_shentsize = sizeof(Elf64_Shdr);
+	ehdr.e_shnum = sections.size();
+	ehdr.e_shstrndx = sections.size() - 1;
+	memcpy(file.data(), &ehdr, sizeof(ehdr));
+	for (size_t i = 0; i < exe.segments.size(); i++) {
+		const linker::Segment &segment = exe.segments[i];
+		Elf64_Phdr phdr = {};
+		phdr.p_type = PT_LOAD;
+		phdr.p_flags = segment.type == linker::SEG_TEXT ? PF_R | PF_X : segment.type == linker::SEG_DATA ? PF_R | PF_W : PF_R;
+		phdr.p_offset = segment.address - exe.base;
+		phdr.p_vaddr = phdr.p_paddr = segment.address;
+		phdr.p_filesz = segment.file_size;
+		phdr.p_memsz = segment.mem_size;
+		phdr.p_align = linker::PAGE_SIZE;
+		memcpy(file.data() + sizeof(Elf64_Ehdr) + i * sizeof(Elf64_Phdr), &phdr, sizeof(phdr));
+	}
+	for (const OutSection &section : sections)
+		append(file, section.header);
+
+	std::ofstream stream(file_name, std::ios::binary);
+	if (!stream.write((const char *) file.data(), file.size()))
+		throw std::runtime_error("cannot write " + file_name);
+	stream.close();
+	chmod(file_name.c_str(), 0755);
+}
@@ -0,0 +1,23 @@
+#ifndef ELF_HPP
+#define ELF_HPP
+
+#include <string>
+#include <vector>
+
+#include "firstpass.hpp"
+#include "secondpass.hpp"
+#include "dwarf.hpp"
+#include "linker.hpp"
+
+namespace elf {
+	// ELF64 relocatable object with the sections of the layout and their relocations,
+	// labels are local symbols unless declared global, debug may be empty
+	void write_object(const std::string &file_name, const firstpass::Layout &layout,
+		const std::vector<firstpass::Symbol> &symtab, const secondpass::Output &out,
+		const std::vector<dwarf::DebugSection> &debug);
+	// static ELF64 executable with a PT_LOAD for each segment, the file is made
+	// executable and every linked label goes in .symtab
+	void write_executable(const std::string &file_name, const linker::Executable &exe);
+}
+
+#endif
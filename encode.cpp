@@ -0,0 +1,755 @@
+#include <cstdint>
+#include <optional>
+#include <utility>
+#include <vector>
+#include <variant>
+
+#include "encode.hpp"
+#include "lex.hpp"
+#include "parse.hpp"
+#include "insns.hpp"
+
+// hardware numbering of lex::GPRegs16, GPRegs32 and GPRegs64 (all in the same order)
+const uint8_t GPR_CODES[] = {
+	0, 3, 1, 2,
+	4, 5, 7, 6,
+	8, 9, 10, 11,
+	12, 13, 14, 15,
+};
+// hardware numbering of lex::GPRegs8
+const uint8_t GPR8_CODES[] = {
+	4, 7, 5, 6,
+	0, 3, 1, 2,
+	4, 5, 7, 6,
+	8, 9, 10, 11,
+	12, 13, 14, 15,
+};
+// recommended nops of 1 to 10 bytes, longer ones add 0x66 prefixes to the last one
+const std::vector<uint8_t> NOPS[] = {
+	{},
+	{ 0x90 },
+	{ 0x66, 0x90 },
+	{ 0x0f, 0x1f, 0x00 },
+	{ 0x0f, 0x1f, 0x40, 0x00 },
+	{ 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+	{ 0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+	{ 0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00 },
+	{ 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+	{ 0x66, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+	{ 0x66, 0x2e, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+};
+const uint64_t MAX_NOP = 15;
+
+struct Encoding {
+	bool opsize16, addr32, lock;
+	// f3 or f2 mandatory prefix of sse instructions
+	uint8_t rep_prefix;
+	bool rex_w, rex_r, rex_x, rex_b;
+	bool need_rex, no_rex;
+	// the rex bits go in the vex prefix, along with the mandatory prefix (pp),
+	// opcode map, vector length and the extra register (vvvv)
+	bool vex, vex_l;
+	uint8_t vex_pp, vex_map, vex_vvvv;
+	encode::Bytes opcode;
+	bool has_modrm, has_sib;
+	uint8_t modrm, sib;
+	uint32_t disp_size, imm_size;
+	uint32_t disp;
+	uint64_t imm;
+};
+
+enum OpKind {
+	KIND_REG,
+	KIND_MEM,
+	KIND_IMM,
+};
+struct Op {
+	OpKind kind;
+	encode::RegInfo reg;
+	parse::ScaledIndexByte mem;
+	uint64_t imm;
+	// immediate is a placeholder or the displacement must be 32 bits
+	bool unresolved;
+};
+// up to 3 operands inline, like parse::Operands
+struct Ops {
+	Op ops[3];
+	size_t count = 0;
+
+	size_t size() const { return count; }
+	const Op &operator[](size_t i) const { return ops[i]; }
+};
+
+encode::RegInfo encode::reg_info(const lex::Register &reg, uint32_t line_num) {
+	switch (reg.type) {
+		case lex::REGTYPE_GPR8: {
+			lex::GPRegs8 r = std::get<lex::GPRegs8>(reg.reg);
+			return encode::RegInfo { GPR8_CODES[r], 8, r >= lex::SPL && r <= lex::SIL, r <= lex::DH };
+		}
+		case lex::REGTYPE_GPR16:
+			return encode::RegInfo { GPR_CODES[std::get<lex::GPRegs16>(reg.reg)], 16, false, false };
+		case lex::REGTYPE_GPR32:
+			return encode::RegInfo { GPR_CODES[std::get<lex::GPRegs32>(reg.reg)], 32, false, false };
+		case lex::REGTYPE_GPR64:
+			return encode::RegInfo { GPR_CODES[std::get<lex::GPRegs64>(reg.reg)], 64, false, false };
+		case lex::REGTYPE_XMM:
+			return encode::RegInfo { (uint8_t) std::get<lex::XMMRegs>(reg.reg), 128, false, false };
+		case lex::REGTYPE_YMM:
+			return encode::RegInfo { (uint8_t) std::get<lex::YMMRegs>(reg.reg), 256, false, false };
+		default:
+			lex::assemble_error(line_num, "unsupported register");
+	}
+}
+
+inline int64_t sign_extend(uint64_t val, uint32_t size) {
+	if (size == 64)
+		return (int64_t) val;
+	return ((int64_t) (val << (64 - size))) >> (64 - size);
+}
+// whether val can be written as an immediate of size bits, signed or unsigned
+inline bool fits(uint64_t val, uint32_t size) {
+	if (size == 64)
+		return true;
+	int64_t sval = (int64_t) val;
+	return val <= (UINT64_MAX >> (64 - size)) || (sval < 0 && sval >= -((int64_t) 1 << (size - 1)));
+}
+// whether an operation of size bits can take val as a sign extended imm8
+inline bool fits_simm8(uint64_t val, uint32_t size) {
+	int64_t sval = sign_extend(val, size);
+	return sval >= INT8_MIN && sval <= INT8_MAX;
+}
+
+Op to_op(const parse::Operand &operand, uint32_t line_num) {
+	Op op = { KIND_IMM, {}, {}, 0, false };
+	switch (operand.type) {
+		case parse::OPTYPE_REG:
+			op.kind = KIND_REG;
+			op.reg = encode::reg_info(operand.reg, line_num);
+			break;
+		case parse::OPTYPE_SIB:
+			op.kind = KIND_MEM;
+			op.mem = parse::memory(operand);
+			break;
+		case parse::OPTYPE_IMM:
+			op.imm = operand.val;
+			break;
+		case parse::OPTYPE_SYM:
+		case parse::OPTYPE_UNRES_IMM:
+			op.unresolved = true;
+			break;
+		case parse::OPTYPE_UNRES_SIB:
+			op.kind = KIND_MEM;
+			op.mem = parse::memory(operand);
+			op.unresolved = true;
+			break;
+	}
+	return op;
+}
+
+inline void add_rex_flags(Encoding &enc, encode::RegInfo reg) {
+	enc.need_rex |= reg.need_rex;
+	enc.no_rex |= reg.no_rex;
+}
+inline void set_opsize(Encoding &enc, uint32_t size) {
+	if (size == 16)
+		enc.opsize16 = true;
+	if (size == 64)
+		enc.rex_w = true;
+}
+// register in the reg field of ModRM
+inline void set_reg(Encoding &enc, encode::RegInfo reg) {
+	enc.has_modrm = true;
+	enc.modrm |= (reg.code & 7) << 3;
+	enc.rex_r = reg.code & 8;
+	add_rex_flags(enc, reg);
+}
+// opcode extension (/digit) in the reg field of ModRM
+inline void set_digit(Encoding &enc, uint8_t digit) {
+	enc.has_modrm = true;
+	enc.modrm |= digit << 3;
+}
+// register in the rm field of ModRM
+inline void set_rm_reg(Encoding &enc, encode::RegInfo reg) {
+	enc.has_modrm = true;
+	enc.modrm |= 0xc0 | (reg.code & 7);
+	enc.rex_b = reg.code & 8;
+	add_rex_flags(enc, reg);
+}
+// register added to the last opcode byte (eg. push r64)
+inline void set_opcode_reg(Encoding &enc, encode::RegInfo reg) {
+	enc.opcode.back() += reg.code & 7;
+	enc.rex_b = reg.code & 8;
+	add_rex_flags(enc, reg);
+}
+inline void set_imm(Encoding &enc, uint64_t val, uint32_t size) {
+	enc.imm = val;
+	enc.imm_size = size;
+}
+
+encode::RegInfo address_reg(const lex::Register &reg, uint32_t line_num) {
+	encode::RegInfo info = encode::reg_info(reg, line_num);
+	if (info.size != 32 && info.size != 64)
+		lex::assemble_error(line_num, "invalid address register");
+	return info;
+}
+
+// memory operand in the rm field of ModRM, with SIB byte and displacement if needed
+void set_mem(Encoding &enc, const parse::ScaledIndexByte &sib, bool wide_disp, uint32_t line_num) {
+	std::optional<encode::RegInfo> base, index;
+	if (sib.base.has_value())
+		base = address_reg(sib.base.value(), line_num);
+	if (sib.index.has_value())
+		index = address_reg(sib.index.value(), line_num);
+	if (base.has_value() && index.has_value() && base->size != index->size)
+		lex::assemble_error(line_num, "base and index must be the same size");
+	if ((base.has_value() && base->size == 32) || (index.has_value() && index->size == 32))
+		enc.addr32 = true;
+
+	uint32_t scale = sib.scale.value_or(1);
+	// rsp can't be an index, but [rsp + reg] can be swapped around
+	if (index.has_value() && index->code == 4) {
+		if (scale != 1 || !base.has_value() || base->code == 4)
+			lex::assemble_error(line_num, "invalid index register");
+		std::swap(base, index);
+	}
+	uint8_t ss = scale == 1 ? 0 : scale == 2 ? 1 : scale == 4 ? 2 : 3;
+	int32_t disp = (int32_t) sib.disp.value_or(0);
+
+	enc.has_modrm = true;
+	enc.disp = (uint32_t) disp;
+	enc.rex_x = index.has_value() && (index->code & 8);
+	enc.rex_b = base.has_value() && (base->code & 8);
+
+	// no base: SIB with base 101 and a 32 bit displacement
+	// (rm = 101 without a SIB byte would be rip relative)
+	if (!base.has_value()) {
+		enc.modrm |= 0x04;
+		enc.has_sib = true;
+		enc.sib = (ss << 6) | ((index.has_value() ? index->code & 7 : 4) << 3) | 5;
+		enc.disp_size = 32;
+		return;
+	}
+
+	// rbp and r13 as base always need a displacement
+	if (wide_disp)
+		enc.modrm |= 0x80, enc.disp_size = 32;
+	else if (!sib.disp.has_value() && (base->code & 7) != 5)
+		enc.disp_size = 0;
+	else if (disp >= INT8_MIN && disp <= INT8_MAX)
+		enc.modrm |= 0x40, enc.disp_size = 8;
+	else
+		enc.modrm |= 0x80, enc.disp_size = 32;
+
+	// rsp and r12 as base always need a SIB byte
+	if (index.has_value() || (base->code & 7) == 4) {
+		enc.modrm |= 0x04;
+		enc.has_sib = true;
+		enc.sib = (ss << 6) | ((index.has_value() ? index->code & 7 : 4) << 3) | (base->code & 7);
+	}
+	else
+		enc.modrm |= base->code & 7;
+}
+
+inline void set_rm(Encoding &enc, const Op &op, uint32_t line_num) {
+	if (op.kind == KIND_REG)
+		set_rm_reg(enc, op.reg);
+	else
+		set_mem(enc, op.mem, op.unresolved, line_num);
+}
+
+encode::Bytes to_bytes(const Encoding &enc, uint32_t line_num) {
+	encode::Bytes out;
+	if (enc.addr32)
+		out.push_back(0x67);
+	if (enc.vex) {
+		uint8_t vvvv_l_pp = ((~enc.vex_vvvv & 0xf) << 3) | (enc.vex_l << 2) | enc.vex_pp;
+		// the 2 byte form only has R, and implies the 0f map and W0
+		if (!enc.rex_x && !enc.rex_b && !enc.rex_w && enc.vex_map == 1) {
+			out.push_back(0xc5);
+			out.push_back((!enc.rex_r << 7) | vvvv_l_pp);
+		}
+		else {
+			out.push_back(0xc4);
+			out.push_back((!enc.rex_r << 7) | (!enc.rex_x << 6) | (!enc.rex_b << 5) | enc.vex_map);
+			out.push_back((enc.rex_w << 7) | vvvv_l_pp);
+		}
+	}
+	if (enc.opsize16)
+		out.push_back(0x66);
+	if (enc.rep_prefix)
+		out.push_back(enc.rep_prefix);
+	if (enc.lock)
+		out.push_back(0xf0);
+	if (!enc.vex && (enc.rex_w || enc.rex_r || enc.rex_x || enc.rex_b || enc.need_rex)) {
+		if (enc.no_rex)
+			lex::assemble_error(line_num, "cannot use high byte register with REX prefix");
+		out.push_back(0x40 | (enc.rex_w << 3) | (enc.rex_r << 2) | (enc.rex_x << 1) | enc.rex_b);
+	}
+	for (uint8_t byte : enc.opcode)
+		out.push_back(byte);
+	if (enc.has_modrm)
+		out.push_back(enc.modrm);
+	if (enc.has_sib)
+		out.push_back(enc.sib);
+	for (uint32_t i = 0; i < enc.disp_size; i += 8)
+		out.push_back((enc.disp >> i) & 0xff);
+	for (uint32_t i = 0; i < enc.imm_size; i += 8)
+		out.push_back((enc.imm >> i) & 0xff);
+	return out;
+}
+
+// size of an operation from its register operands
+uint32_t operation_size(const Op &dst, const Op &src, uint32_t line_num) {
+	if (dst.kind == KIND_REG && src.kind == KIND_REG && dst.reg.size != src.reg.size)
+		lex::assemble_error(line_num, "operand sizes do not match");
+	if (dst.kind == KIND_REG)
+		return dst.reg.size;
+	if (src.kind == KIND_REG)
+		return src.reg.size;
+	lex::assemble_error(line_num, "operation size not specified");
+}
+
+void check_imm(const Op &op, uint32_t size, uint32_t line_num) {
+	if (!op.unresolved && !fits(op.imm, size))
+		lex::assemble_error(line_num, "immediate out of range");
+}
+
+// add, or, and, sub, xor, cmp
+void encode_alu(Encoding &enc, uint8_t digit, const Op &dst, const Op &src, uint32_t line_num) {
+	if (dst.kind == KIND_IMM)
+		lex::assemble_error(line_num, "invalid combination of operands");
+	if (dst.kind == KIND_MEM && src.kind == KIND_MEM)
+		lex::assemble_error(line_num, "invalid combination of operands");
+
+	Op none = { KIND_IMM, {}, {}, 0, false };
+	uint32_t size = operation_size(dst, src.kind == KIND_IMM ? none : src, line_num);
+	set_opsize(enc, size);
+	uint8_t wide = size != 8;
+
+	if (src.kind == KIND_REG) {
+		enc.opcode = { (uint8_t) (digit * 8 + wide) };
+		set_reg(enc, src.reg);
+		set_rm(enc, dst, line_num);
+		return;
+	}
+	if (src.kind == KIND_MEM) {
+		enc.opcode = { (uint8_t) (digit * 8 + 2 + wide) };
+		set_reg(enc, dst.reg);
+		set_rm(enc, src, line_num);
+		return;
+	}
+
+	uint32_t imm_size = size == 64 ? 32 : size;
+	if (size == 64 && !src.unresolved && (sign_extend(src.imm, 64) < INT32_MIN || sign_extend(src.imm, 64) > INT32_MAX))
+		lex::assemble_error(line_num, "immediate out of range");
+	check_imm(src, size, line_num);
+
+	if (wide && !src.unresolved && fits_simm8(src.imm, size)) {
+		enc.opcode = { 0x83 };
+		set_digit(enc, digit);
+		set_rm(enc, dst, line_num);
+		set_imm(enc, src.imm, 8);
+		return;
+	}
+	// short form for al, ax, eax, rax
+	if (dst.kind == KIND_REG && dst.reg.code == 0) {
+		enc.opcode = { (uint8_t) (digit * 8 + 4 + wide) };
+		set_imm(enc, src.imm, imm_size);
+		return;
+	}
+	enc.opcode = { (uint8_t) (wide ? 0x81 : 0x80) };
+	set_digit(enc, digit);
+	set_rm(enc, dst, line_num);
+	set_imm(enc, src.imm, imm_size);
+}
+
+// inc, dec, not, idiv
+void encode_unary(Encoding &enc, uint8_t opcode, uint8_t digit, const Op &op, uint32_t line_num) {
+	if (op.kind != KIND_REG)
+		lex::assemble_error(line_num, op.kind == KIND_MEM ? "operation size not specified" : "invalid operand");
+	set_opsize(enc, op.reg.size);
+	enc.opcode = { (uint8_t) (opcode + (op.reg.size != 8)) };
+	set_digit(enc, digit);
+	set_rm(enc, op, line_num);
+}
+
+void encode_mov(Encoding &enc, const Op &dst, const Op &src, uint32_t line_num) {
+	if (dst.kind == KIND_IMM || (dst.kind == KIND_MEM && src.kind == KIND_MEM))
+		lex::assemble_error(line_num, "invalid combination of operands");
+	if (dst.kind == KIND_MEM && src.kind == KIND_IMM)
+		lex::assemble_error(line_num, "operation size not specified");
+
+	if (src.kind == KIND_IMM) {
+		uint32_t size = dst.reg.size;
+		set_opsize(enc, size);
+		if (size == 64 && !src.unresolved && sign_extend(src.imm, 64) >= INT32_MIN &&
+				sign_extend(src.imm, 64) <= INT32_MAX) {
+			enc.opcode = { 0xc7 };
+			set_digit(enc, 0);
+			set_rm(enc, dst, line_num);
+			set_imm(enc, src.imm, 32);
+			return;
+		}
+		check_imm(src, size, line_num);
+		enc.opcode = { (uint8_t) (size == 8 ? 0xb0 : 0xb8) };
+		set_opcode_reg(enc, dst.reg);
+		set_imm(enc, src.imm, size);
+		return;
+	}
+
+	uint32_t size = operation_size(dst, src, line_num);
+	set_opsize(enc, size);
+	uint8_t wide = size != 8;
+	if (src.kind == KIND_REG) {
+		enc.opcode = { (uint8_t) (0x88 + wide) };
+		set_reg(enc, src.reg);
+		set_rm(enc, dst, line_num);
+		return;
+	}
+	enc.opcode = { (uint8_t) (0x8a + wide) };
+	set_reg(enc, dst.reg);
+	set_rm(enc, src, line_num);
+}
+
+void encode_shift(Encoding &enc, uint8_t digit, const Op &dst, const Op &src, uint32_t line_num) {
+	if (dst.kind != KIND_REG)
+		lex::assemble_error(line_num, dst.kind == KIND_MEM ? "operation size not specified" : "invalid operand");
+	set_opsize(enc, dst.reg.size);
+	uint8_t wide = dst.reg.size != 8;
+	set_digit(enc, digit);
+	set_rm(enc, dst, line_num);
+
+	// only cl can be the count register
+	if (src.kind == KIND_REG) {
+		if (src.reg.size != 8 || src.reg.code != 1 || src.reg.need_rex)
+			lex::assemble_error(line_num, "shift count must be cl or an immediate");
+		enc.opcode = { (uint8_t) (0xd2 + wide) };
+		return;
+	}
+	if (src.kind == KIND_MEM)
+		lex::assemble_error(line_num, "shift count must be cl or an immediate");
+	check_imm(src, 8, line_num);
+	if (!src.unresolved && src.imm == 1) {
+		enc.opcode = { (uint8_t) (0xd0 + wide) };
+		return;
+	}
+	enc.opcode = { (uint8_t) (0xc0 + wide) };
+	set_imm(enc, src.imm, 8);
+}
+
+void encode_xchg(Encoding &enc, const Op &a, const Op &b, uint32_t line_num) {
+	if (a.kind == KIND_MEM && b.kind == KIND_MEM)
+		lex::assemble_error(line_num, "invalid combination of operands");
+	uint32_t size = operation_size(a, b, line_num);
+	set_opsize(enc, size);
+
+	// short form when one side is the accumulator, except xchg eax, eax which
+	// isn't a nop (it clears the upper half of rax), and xchg rax, rax is just 90
+	if (a.kind == KIND_REG && b.kind == KIND_REG && size != 8) {
+		const Op *other = a.reg.code == 0 ? &b : b.reg.code == 0 ? &a : nullptr;
+		if (other != nullptr && !(size == 32 && other->reg.code == 0)) {
+			if (other->reg.code == 0)
+				enc.rex_w = false;
+			enc.opcode = { 0x90 };
+			set_opcode_reg(enc, other->reg);
+			return;
+		}
+	}
+	const Op &reg = b.kind == KIND_REG ? b : a, &rm = b.kind == KIND_REG ? a : b;
+	enc.opcode = { (uint8_t) (size == 8 ? 0x86 : 0x87) };
+	set_reg(enc, reg.reg);
+	set_rm(enc, rm, line_num);
+}
+
+inline bool is_vec(const Op &op) {
+	return op.kind == KIND_REG && op.reg.size >= 128;
+}
+// the parser already checked which sizes the instruction takes
+void check_vec(const Op &reg, uint32_t line_num) {
+	if (!is_vec(reg))
+		lex::assemble_error(line_num, "invalid combination of operands");
+}
+// xmm/ymm register the same size as reg, or memory
+void check_vec_rm(const Op &reg, const Op &rm, uint32_t line_num) {
+	if (rm.kind == KIND_MEM)
+		return;
+	check_vec(rm, line_num);
+	if (rm.reg.size != reg.reg.size)
+		lex::assemble_error(line_num, "operand sizes do not match");
+}
+
+// legacy encodings put the mandatory prefix and opcode map in front of the opcode,
+// avx puts them in the vex prefix
+void set_opcode(Encoding &enc, bool vex, uint8_t prefix, uint8_t map, uint8_t opcode) {
+	if (vex) {
+		enc.vex = true;
+		enc.vex_pp = prefix == 0x66 ? 1 : prefix == 0xf3 ? 2 : prefix == 0xf2 ? 3 : 0;
+		enc.vex_map = map;
+		enc.opcode = { opcode };
+		return;
+	}
+	if (prefix == 0x66)
+		enc.opsize16 = true;
+	else if (prefix != 0)
+		enc.rep_prefix = prefix;
+	enc.opcode = {};
+	if (map != 0)
+		enc.opcode.push_back(0x0f);
+	if (map == 2)
+		enc.opcode.push_back(0x38);
+	if (map == 3)
+		enc.opcode.push_back(0x3a);
+	enc.opcode.push_back(opcode);
+}
+
+// movd/movq between xmm and r/m32 or r/m64, movq between xmm and xmm/m64 has
+// its own opcodes
+void encode_movd(Encoding &enc, const insns::Spec &spec, bool vex, const Ops &ops, uint32_t line_num) {
+	bool store = !is_vec(ops[0]);
+	const Op &xmm = store ? ops[1] : ops[0], &other = store ? ops[0] : ops[1];
+	check_vec(xmm, line_num);
+	bool is_movq = spec.w;
+
+	if (is_movq && (other.kind == KIND_MEM || is_vec(other))) {
+		check_vec_rm(xmm, other, line_num);
+		set_opcode(enc, vex, store ? 0x66 : 0xf3, spec.map, store ? 0xd6 : 0x7e);
+	}
+	else {
+		if (other.kind == KIND_IMM || is_vec(other))
+			lex::assemble_error(line_num, "invalid combination of operands");
+		// movd with a 64 bit register is movq
+		if (other.kind == KIND_REG && other.reg.size != 64 && (is_movq || other.reg.size != 32))
+			lex::assemble_error(line_num, "invalid operand size");
+		set_opcode(enc, vex, spec.prefix, spec.map, store ? spec.extra : spec.opcode);
+		enc.rex_w = is_movq || (other.kind == KIND_REG && other.reg.size == 64);
+	}
+	set_reg(enc, xmm.reg);
+	set_rm(enc, other, line_num);
+}
+
+void encode_simd(Encoding &enc, const insns::Spec &spec, bool vex, const Ops &ops, uint32_t line_num) {
+	if (spec.simd == insns::SIMD_MOVD) {
+		encode_movd(enc, spec, vex, ops, line_num);
+		return;
+	}
+	set_opcode(enc, vex, spec.prefix, spec.map, spec.opcode);
+	enc.rex_w = spec.w;
+
+	switch (spec.simd) {
+		case insns::SIMD_RM:
+		case insns::SIMD_RM_IMM8:
+		case insns::SIMD_UNARY: {
+			// only the vex form of SIMD_RM has a second source, in the middle
+			bool has_vvvv = vex && spec.simd == insns::SIMD_RM;
+			const Op &dst = ops[0], &src = ops[has_vvvv ? 2 : 1];
+			check_vec(dst, line_num);
+			check_vec_rm(dst, src, line_num);
+			if (has_vvvv) {
+				check_vec(ops[1], line_num);
+				if (ops[1].reg.size != dst.reg.size)
+					lex::assemble_error(line_num, "operand sizes do not match");
+				enc.vex_vvvv = ops[1].reg.code;
+			}
+			enc.vex_l = dst.reg.size == 256;
+			set_reg(enc, dst.reg);
+			set_rm(enc, src, line_num);
+			if (spec.simd == insns::SIMD_RM_IMM8) {
+				if (ops[2].kind != KIND_IMM)
+					lex::assemble_error(line_num, "invalid combination of operands");
+				check_imm(ops[2], 8, line_num);
+				set_imm(enc, ops[2].imm, 8);
+			}
+			break;
+		}
+		case insns::SIMD_MOVE: {
+			// register to register moves can use either opcode, the vex prefix is a
+			// byte shorter when only the reg field needs the extra register bit
+			bool swap = vex && is_vec(ops[1]) && ops[1].reg.code >= 8 && ops[0].reg.code < 8;
+			bool store = ops[0].kind == KIND_MEM || swap;
+			const Op &reg = store ? ops[1] : ops[0], &rm = store ? ops[0] : ops[1];
+			check_vec(reg, line_num);
+			check_vec_rm(reg, rm, line_num);
+			if (store)
+				enc.opcode.back() = spec.extra;
+			enc.vex_l = reg.reg.size == 256;
+			set_reg(enc, reg.reg);
+			set_rm(enc, rm, line_num);
+			break;
+		}
+		case insns::SIMD_MOVMSK:
+			if (ops[0].kind != KIND_REG || is_vec(ops[0]) || ops[1].kind != KIND_REG)
+				lex::assemble_error(line_num, "invalid combination of operands");
+			if (ops[0].reg.size != 32 && ops[0].reg.size != 64)
+				lex::assemble_error(line_num, "invalid operand size");
+			check_vec(ops[1], line_num);
+			enc.vex_l = ops[1].reg.size == 256;
+			set_reg(enc, ops[0].reg);
+			set_rm(enc, ops[1], line_num);
+			break;
+		case insns::SIMD_BROADCAST:
+			// the source is always an xmm register or memory
+			check_vec(ops[0], line_num);
+			if (ops[1].kind != KIND_MEM && (!is_vec(ops[1]) || ops[1].reg.size != 128))
+				lex::assemble_error(line_num, "invalid combination of operands");
+			enc.vex_l = ops[0].reg.size == 256;
+			set_reg(enc, ops[0].reg);
+			set_rm(enc, ops[1], line_num);
+			break;
+		default:
+			break;
+	}
+}
+
+// bytes of the instruction, and where the placeholders of its unresolved operands
+// ended up: the displacement and immediate always come last
+encode::Bytes finish(const Encoding &enc, const parse::Instruction &insn, const Ops &ops,
+		uint32_t line_num, std::vector<encode::Fixup> *fixups) {
+	encode::Bytes out = to_bytes(enc, line_num);
+	if (fixups == nullptr)
+		return out;
+	uint32_t imm_offset = out.size() - enc.imm_size / 8;
+	uint32_t disp_offset = imm_offset - enc.disp_size / 8;
+	bool rel = insn.type == lex::CALL || encode::is_branch(insn.type);
+	for (size_t i = 0; i < ops.size(); i++) {
+		if (ops[i].kind == KIND_MEM && ops[i].unresolved)
+			fixups->emplace_back(encode::Fixup { i, disp_offset, 4, false, !enc.addr32 });
+		else if (ops[i].kind == KIND_IMM && (ops[i].unresolved || rel))
+			fixups->emplace_back(encode::Fixup { i, imm_offset, enc.imm_size / 8, rel,
+				enc.imm_size == 32 && (enc.rex_w || insn.type == lex::PUSH) });
+	}
+	return out;
+}
+
+encode::Bytes encode::encode(const parse::Instruction &insn, uint32_t line_num, std::vector<encode::Fixup> *fixups) {
+	Ops ops;
+	for (const parse::Operand &operand : insn.operands)
+		ops.ops[ops.count++] = to_op(operand, line_num);
+
+	const insns::Spec &spec = insns::spec(insn.type);
+	Encoding enc = {};
+	enc.lock = insn.lock;
+	switch (spec.encoder) {
+		case insns::ENC_SSE:
+		case insns::ENC_VEX:
+			encode_simd(enc, spec, spec.encoder == insns::ENC_VEX, ops, line_num);
+			break;
+		case insns::ENC_MOV:
+			encode_mov(enc, ops[0], ops[1], line_num);
+			break;
+		case insns::ENC_LEA:
+			set_opsize(enc, ops[0].reg.size);
+			enc.opcode = { spec.opcode };
+			set_reg(enc, ops[0].reg);
+			set_rm(enc, ops[1], line_num);
+			break;
+		case insns::ENC_PUSH_POP: {
+			bool is_push = insn.type == lex::PUSH;
+			if (ops[0].kind == KIND_REG) {
+				set_opsize(enc, ops[0].reg.size == 16 ? 16 : 32);
+				enc.opcode = { (uint8_t) (is_push ? 0x50 : 0x58) };
+				set_opcode_reg(enc, ops[0].reg);
+			}
+			else if (ops[0].kind == KIND_MEM) {
+				enc.opcode = { (uint8_t) (is_push ? 0xff : 0x8f) };
+				set_digit(enc, is_push ? 6 : 0);
+				set_rm(enc, ops[0], line_num);
+			}
+			else if (!ops[0].unresolved && fits_simm8(ops[0].imm, 64)) {
+				enc.opcode = { 0x6a };
+				set_imm(enc, ops[0].imm, 8);
+			}
+			else {
+				if (!ops[0].unresolved && (sign_extend(ops[0].imm, 64) < INT32_MIN ||
+						sign_extend(ops[0].imm, 64) > INT32_MAX))
+					lex::assemble_error(line_num, "immediate out of range");
+				enc.opcode = { 0x68 };
+				set_imm(enc, ops[0].imm, 32);
+			}
+			break;
+		}
+		case insns::ENC_ALU:
+			encode_alu(enc, spec.extra, ops[0], ops[1], line_num);
+			break;
+		case insns::ENC_UNARY:
+			encode_unary(enc, spec.opcode, spec.extra, ops[0], line_num);
+			break;
+		case insns::ENC_IMUL:
+			set_opsize(enc, ops[0].reg.size);
+			set_reg(enc, ops[0].reg);
+			if (ops[1].kind == KIND_IMM) {
+				// imul reg, imm is imul reg, reg, imm
+				check_imm(ops[1], ops[0].reg.size == 64 ? 32 : ops[0].reg.size, line_num);
+				bool imm8 = !ops[1].unresolved && fits_simm8(ops[1].imm, ops[0].reg.size);
+				enc.opcode = { (uint8_t) (imm8 ? 0x6b : 0x69) };
+				set_rm(enc, ops[0], line_num);
+				set_imm(enc, ops[1].imm, imm8 ? 8 : ops[0].reg.size == 16 ? 16 : 32);
+				break;
+			}
+			operation_size(ops[0], ops[1], line_num);
+			enc.opcode = { 0x0f, 0xaf };
+			set_rm(enc, ops[1], line_num);
+			break;
+		case insns::ENC_SHIFT:
+			encode_shift(enc, spec.extra, ops[0], ops[1], line_num);
+			break;
+		case insns::ENC_JMP:
+			if (ops[0].kind == KIND_IMM) {
+				enc.opcode = { spec.opcode };
+				set_imm(enc, 0, 32);
+				break;
+			}
+			enc.opcode = { 0xff };
+			set_digit(enc, spec.extra);
+			set_rm(enc, ops[0], line_num);
+			break;
+		case insns::ENC_JCC:
+			set_opcode(enc, false, spec.prefix, spec.map, spec.opcode + spec.extra);
+			set_imm(enc, 0, 32);
+			break;
+		case insns::ENC_XCHG:
+			encode_xchg(enc, ops[0], ops[1], line_num);
+			break;
+		case insns::ENC_RM_REG: {
+			// cmpxchg and xadd have an 8 bit form one below, movnti doesn't
+			uint32_t size = operation_size(ops[0], ops[1], line_num);
+			set_opsize(enc, size);
+			set_opcode(enc, false, spec.prefix, spec.map, spec.opcode + (insn.type != lex::MOVNTI && size != 8));
+			set_reg(enc, ops[1].reg);
+			set_rm(enc, ops[0], line_num);
+			break;
+		}
+		case insns::ENC_MEM:
+			enc.rex_w = spec.w;
+			set_opcode(enc, false, spec.prefix, spec.map, spec.opcode);
+			set_digit(enc, spec.extra);
+			set_rm(enc, ops[0], line_num);
+			break;
+		case insns::ENC_FIXED:
+			set_opcode(enc, false, spec.prefix, spec.map, spec.opcode);
+			if (spec.extra != 0)
+				enc.opcode.push_back(spec.extra);
+			break;
+	}
+	return finish(enc, insn, ops, line_num, fixups);
+}
+
+bool encode::is_branch(lex::Instruction type) {
+	return type == lex::JMP || insns::spec(type).encoder == insns::ENC_JCC;
+}
+
+encode::Bytes encode::encode_short_branch(lex::Instruction type, int8_t rel) {
+	if (type == lex::JMP)
+		return { 0xeb, (uint8_t) rel };
+	return { (uint8_t) (0x70 + insns::spec(type).extra), (uint8_t) rel };
+}
+
+void encode::nop_padding(std::vector<uint8_t> &out, uint64_t len) {
+	while (len > 0) {
+		uint64_t n = len < MAX_NOP ? len : MAX_NOP;
+		if (n > 10)
+			out.insert(out.end(), n - 10, 0x66);
+		const std::vector<uint8_t> &nop = NOPS[n > 10 ? 10 : n];
+		out.insert(out.end(), nop.begin(), nop.end());
+		len -= n;
+	}
+}
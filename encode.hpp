@@ -0,0 +1,69 @@
+#ifndef ENCODE_HPP
+#define ENCODE_HPP
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <vector>
+
+#include "lex.hpp"
+#include "parse.hpp"
+
+namespace encode {
+	// hardware register number (0-15) and the REX requirements of a GPR
+	struct RegInfo {
+		uint8_t code;
+		uint32_t size;
+		// spl, bpl, sil, dil need a REX prefix, ah, bh, ch, dh can't have one
+		bool need_rex, no_rex;
+	};
+	RegInfo reg_info(const lex::Register &reg, uint32_t line_num);
+
+	// longest an x86 instruction can be
+	const size_t MAX_INSN_SIZE = 15;
+	// bytes of one instruction stored inline, so encoding never allocates
+	struct Bytes {
+		uint8_t bytes[MAX_INSN_SIZE] = {};
+		uint8_t count = 0;
+
+		Bytes() = default;
+		Bytes(std::initializer_list<uint8_t> list) {
+			for (uint8_t byte : list)
+				push_back(byte);
+		}
+		size_t size() const { return count; }
+		uint8_t &back() { return bytes[count - 1]; }
+		void push_back(uint8_t byte) {
+			assert(count < MAX_INSN_SIZE);
+			bytes[count++] = byte;
+		}
+		const uint8_t *begin() const { return bytes; }
+		const uint8_t *end() const { return bytes + count; }
+	};
+
+	// field of an encoded instruction that holds an unresolved operand, or the
+	// rel32 of a jmp, jcc or call
+	struct Fixup {
+		size_t operand;
+		uint32_t offset, size;
+		// relative to the end of the instruction
+		bool pc_relative;
+		// sign extended by the cpu (imm32 of 64 bit operations, disp32 with 64 bit addressing)
+		bool is_signed;
+	};
+
+	// operands that are still unresolved (symbols, expressions) are encoded as
+	// zero using the widest form they could need, so the size of an instruction
+	// never changes once its symbols are resolved
+	Bytes encode(const parse::Instruction &insn, uint32_t line_num, std::vector<Fixup> *fixups = nullptr);
+
+	// jmp and jcc can use a rel8 when the target label is close enough
+	bool is_branch(lex::Instruction type);
+	Bytes encode_short_branch(lex::Instruction type, int8_t rel);
+
+	// fewest multi-byte nops (0f 1f forms, up to 15 bytes each) covering len bytes
+	void nop_padding(std::vector<uint8_t> &out, uint64_t len);
+}
+
+#endif
@@ -1,11 +1,217 @@
+#include <cstdint>
+#include <string>
 #include <vector>
+#include <variant>
+
 #include "lex.hpp"
+#include "parse.hpp"
+#include "encode.hpp"
 #include "firstpass.hpp"
+#include "context.hpp"
+
+const std::string DEFAULT_SECTION = ".text";
+
+uint64_t firstpass::data_unit(lex::Directive type) {
+	switch (type) {
+		case lex::DB: case lex::RESB: return 1;
+		case lex::DW: case lex::RESW: return 2;
+		case lex::DD: case lex::RESD: return 4;
+		case lex::DQ: case lex::RESQ: return 8;
+		default: return 0;
+	}
+}
+
+// operand of resb/resw/resd/resq and the count of times
+uint64_t constant_count(const parse::DirOperand &operand, uint32_t line_num) {
+	if (operand.type != parse::DIROPTYPE_IMM)
+		lex::assemble_error(line_num, "count must be constant");
+	return std::get<uint64_t>(operand.val);
+}
+
+uint64_t firstpass::statement_size(const parse::Program &program, const parse::Statement &stmt,
+		uint64_t offset, bool short_branch) {
+	if (stmt.type == parse::STMTYPE_INSN) {
+		const parse::Instruction &insn = std::get<parse::Instruction>(stmt.val);
+		if (short_branch)
+			return encode::encode_short_branch(insn.type, 0).size();
+		return encode::encode(insn, stmt.line_num).size();
+	}
+	if (stmt.type == parse::STMTYPE_TIMES) {
+		const parse::Repeat &repeat = parse::repeat(program, stmt);
+		return constant_count(repeat.count, stmt.line_num) * firstpass::statement_size(program, repeat.body, offset, false);
+	}
+	if (stmt.type != parse::STMTYPE_DIR)
+		return 0;
+
+	const parse::Directive &dir = parse::directive(program, stmt);
+	switch (dir.type) {
+		case lex::DB: case lex::DW: case lex::DD: case lex::DQ: {
+			uint64_t size = 0;
+			for (const parse::DirOperand &operand : dir.operands) {
+				if (operand.type == parse::DIROPTYPE_STR_LIT)
+					size += std::get<std::string>(operand.val).size();
+				else
+					size += firstpass::data_unit(dir.type);
+			}
+			return size;
+		}
+		case lex::RESB: case lex::RESW: case lex::RESD: case lex::RESQ:
+			return constant_count(dir.operands[0], stmt.line_num) * firstpass::data_unit(dir.type);
+		case lex::INCBIN:
+			return std::get<parse::IncludedBinary>(dir.operands[0].val).length;
+		case lex::ALIGN: {
+			uint64_t boundary = std::get<uint64_t>(dir.operands[0].val);
+			return (boundary - offset % boundary) % boundary;
+		}
+		default:
+			return 0;
+	}
+}
+
+inline bool is_align(const parse::Program &program, const parse::Statement &stmt) {
+	return stmt.type == parse::STMTYPE_DIR && parse::directive(program, stmt).type == lex::ALIGN;
+}
+
+// anything but equ, global and extern belongs to a section
+inline bool takes_space(const parse::Program &program, const parse::Statement &stmt) {
+	if (stmt.type == parse::STMTYPE_ASSIGN)
+		return false;
+	if (stmt.type != parse::STMTYPE_DIR)
+		return true;
+	lex::Directive type = parse::directive(program, stmt).type;
+	return type != lex::GLOBAL && type != lex::EXTERN;
+}
 
-void firstpass::firstpass(std::vector<firstpass::Symbol> &symtab, const std::vector<lex::Lexeme> &tokens) {
-	// for (int i = 0; i < tokens.size(); i++) {
-	// 	lex::Lexeme lexeme = tokens[i];
-	// 	
-	// }	
+// name of the label a jmp/jcc goes to, UINT32_MAX if it isn't a plain label
+inline uint32_t branch_target(const parse::Statement &stmt) {
+	if (stmt.type != parse::STMTYPE_INSN)
+		return UINT32_MAX;
+	const parse::Instruction &insn = std::get<parse::Instruction>(stmt.val);
+	if (!encode::is_branch(insn.type) || insn.operands[0].type != parse::OPTYPE_SYM)
+		return UINT32_MAX;
+	return insn.operands[0].val;
 }
 
+void firstpass::firstpass(context::AssemblerContext &ctx) {
+	const parse::Program &program = ctx.program;
+	const std::vector<parse::Statement> &stmts = program.stmts;
+	std::vector<firstpass::Symbol> &symtab = ctx.symtab;
+	firstpass::Layout &layout = ctx.layout;
+	size_t n = stmts.size();
+	layout.section.assign(n, 0);
+	layout.offset.assign(n, 0);
+	layout.size.assign(n, 0);
+	layout.short_branch.assign(n, false);
+
+	// assign sections in order of first use, anything before the first
+	// section directive goes in .text. the sections and labels of the last run
+	// are written over and the rest dropped at the end, so their names keep their memory
+	size_t n_sections = 0;
+	// statement of each label by name index
+	std::vector<size_t> &labels = ctx.label_stmt;
+	labels.assign(program.names.size(), SIZE_MAX);
+	uint32_t cur = UINT32_MAX;
+	auto use_section = [&](const std::string &name) {
+		for (uint32_t i = 0; i < n_sections; i++) {
+			if (layout.sections[i].name == name)
+				return i;
+		}
+		if (n_sections == layout.sections.size())
+			layout.sections.emplace_back();
+		firstpass::Section &section = layout.sections[n_sections];
+		section.name = name;
+		section.segment = name.rfind(".text", 0) == 0 ? firstpass::Code : firstpass::Data;
+		section.size = 0;
+		section.align = 1;
+		return (uint32_t) n_sections++;
+	};
+
+	// sizes that don't depend on where the statement ends up
+	std::vector<uint64_t> &fixed_size = ctx.fixed_size;
+	fixed_size.assign(n, 0);
+	for (size_t i = 0; i < n; i++) {
+		const parse::Statement &stmt = stmts[i];
+		if (stmt.type == parse::STMTYPE_DIR && parse::directive(program, stmt).type == lex::SECTION) {
+			cur = use_section(std::get<std::string>(parse::directive(program, stmt).operands[0].val));
+			layout.section[i] = cur;
+			continue;
+		}
+		if (cur == UINT32_MAX && takes_space(program, stmt))
+			cur = use_section(DEFAULT_SECTION);
+		layout.section[i] = cur;
+
+		if (stmt.type == parse::STMTYPE_LBL) {
+			uint32_t label = std::get<uint32_t>(stmt.val);
+			if (labels[label] != SIZE_MAX)
+				lex::assemble_error(stmt.line_num, "symbol " + program.names[label] + " redefined");
+			labels[label] = i;
+		}
+		if (is_align(program, stmt)) {
+			uint64_t boundary = std::get<uint64_t>(parse::directive(program, stmt).operands[0].val);
+			if (boundary > layout.sections[cur].align)
+				layout.sections[cur].align = boundary;
+			continue;
+		}
+		fixed_size[i] = firstpass::statement_size(program, stmt, 0, false);
+	}
+	layout.sections.resize(n_sections);
+
+	// branch relaxation: start every branch to a label in the same section as
+	// short and only ever make them long, so this always terminates
+	for (size_t i = 0; i < n; i++) {
+		uint32_t target = branch_target(stmts[i]);
+		layout.short_branch[i] = target != UINT32_MAX && labels[target] != SIZE_MAX &&
+			layout.section[labels[target]] == layout.section[i];
+	}
+	bool changed = true;
+	while (changed) {
+		for (firstpass::Section &section : layout.sections)
+			section.size = 0;
+		for (size_t i = 0; i < n; i++) {
+			if (layout.section[i] == UINT32_MAX)
+				continue;
+			firstpass::Section &section = layout.sections[layout.section[i]];
+			layout.offset[i] = section.size;
+			if (is_align(program, stmts[i]) || layout.short_branch[i])
+				layout.size[i] = firstpass::statement_size(program, stmts[i], section.size, layout.short_branch[i]);
+			else
+				layout.size[i] = fixed_size[i];
+			section.size += layout.size[i];
+		}
+
+		changed = false;
+		for (size_t i = 0; i < n; i++) {
+			if (!layout.short_branch[i])
+				continue;
+			int64_t rel = layout.offset[labels[branch_target(stmts[i])]] - (layout.offset[i] + layout.size[i]);
+			if (rel < INT8_MIN || rel > INT8_MAX)
+				layout.short_branch[i] = false, changed = true;
+		}
+	}
+
+	// labels, each one is as big as everything up to the next label
+	std::vector<size_t> &last_label = ctx.last_label;
+	last_label.assign(layout.sections.size(), SIZE_MAX);
+	size_t n_symbols = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (stmts[i].type != parse::STMTYPE_LBL)
+			continue;
+		uint32_t section = layout.section[i];
+		if (last_label[section] != SIZE_MAX)
+			symtab[last_label[section]].size = layout.offset[i] - symtab[last_label[section]].offset;
+		last_label[section] = n_symbols;
+		if (n_symbols == symtab.size())
+			symtab.emplace_back();
+		firstpass::Symbol &sym = symtab[n_symbols++];
+		sym.symbol = parse::label(program, stmts[i]);
+		sym.offset = layout.offset[i];
+		sym.segment = layout.sections[section].segment;
+		sym.size = 0;
+		sym.section = section;
+	}
+	symtab.resize(n_symbols);
+	for (size_t section = 0; section < layout.sections.size(); section++) {
+		if (last_label[section] != SIZE_MAX)
+			symtab[last_label[section]].size = layout.sections[section].size - symtab[last_label[section]].offset;
+	}
+}
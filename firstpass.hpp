@@ -5,20 +5,49 @@
 #include <cstdint>
 #include <vector>
 #include "lex.hpp"
+#include "parse.hpp"
+
+namespace context {
+	struct AssemblerContext;
+}
 
 namespace firstpass {
 	enum Segment {
 		Code, Data
 	};
 
+	struct Section {
+		std::string name;
+		// code is padded with nops, data with zeroes
+		Segment segment;
+		uint64_t size;
+		// largest align in the section
+		uint64_t align;
+	};
+
 	struct Symbol {
 		std::string symbol;
 		uint64_t offset;
 		Segment segment;
+		// bytes up to the next label in the section
 		unsigned size;
+		uint32_t section;
+	};
+
+	// where every statement ends up, indexed like the statements
+	struct Layout {
+		std::vector<Section> sections;
+		std::vector<uint32_t> section;
+		std::vector<uint64_t> offset, size;
+		// jmp/jcc to a label in the same section within rel8 range
+		std::vector<bool> short_branch;
 	};
 
-	void firstpass(std::vector<Symbol> &symtab, const std::vector<lex::Lexeme> &tokens);
+	uint64_t data_unit(lex::Directive type);
+	uint64_t statement_size(const parse::Program &program, const parse::Statement &stmt,
+		uint64_t offset, bool short_branch);
+	// lays out ctx.program into ctx.layout, and its labels into ctx.symtab
+	void firstpass(context::AssemblerContext &ctx);
 }
 
 #endif
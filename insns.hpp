@@ -0,0 +1,277 @@
+#ifndef INSNS_HPP
+#define INSNS_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+#include "lex.hpp"
+
+// everything the lexer, parser, encoder and peephole optimizer know about an
+// instruction, one row per lex::Instruction in enum order
+namespace insns {
+	// what an operand can be, an operand matches an instruction when its form
+	// shares a bit with the forms the instruction takes in that position
+	const uint16_t FORM_R8 = 1 << 0, FORM_R16 = 1 << 1, FORM_R32 = 1 << 2, FORM_R64 = 1 << 3;
+	const uint16_t FORM_XMM = 1 << 4, FORM_YMM = 1 << 5, FORM_M = 1 << 6;
+	// immediates are checked against the smallest size that holds them, unresolved ones
+	// match every size and the encoder checks them once they're known
+	const uint16_t FORM_IMM8 = 1 << 7, FORM_IMM32 = 1 << 8, FORM_IMM64 = 1 << 9;
+	// branch target
+	const uint16_t FORM_REL = 1 << 10;
+
+	const uint16_t FORM_GPR = FORM_R8 | FORM_R16 | FORM_R32 | FORM_R64, FORM_RM = FORM_GPR | FORM_M;
+	const uint16_t FORM_WIDE = FORM_R16 | FORM_R32 | FORM_R64;
+	const uint16_t FORM_IMM = FORM_IMM8 | FORM_IMM32, FORM_ANY_IMM = FORM_IMM | FORM_IMM64;
+	const uint16_t FORM_VEC = FORM_XMM | FORM_YMM, FORM_VEC_M = FORM_VEC | FORM_M;
+
+	enum FlagUse {
+		// flags are left alone (or only partially written, like inc and dec)
+		FLAGS_NONE,
+		// every flag a later instruction could read is overwritten
+		FLAGS_KILL,
+		// flags are read, or control leaves the straight line code so they might be
+		FLAGS_USE,
+	};
+
+	// which part of the encoder lays the instruction out
+	enum Encoder {
+		ENC_MOV, ENC_LEA, ENC_PUSH_POP, ENC_IMUL, ENC_XCHG,
+		// add, or, and, sub, xor, cmp: /digit in extra
+		ENC_ALU,
+		// opcode (8 bit form) /digit
+		ENC_UNARY,
+		// /digit, count in cl or an imm8
+		ENC_SHIFT,
+		// opcode is the rel32 form, /digit the indirect one
+		ENC_JMP,
+		// condition code in extra
+		ENC_JCC,
+		// opcode r/m, reg (cmpxchg, xadd, movnti)
+		ENC_RM_REG,
+		// opcode /digit with a memory operand
+		ENC_MEM,
+		// no operands, extra is the byte after the opcode if there is one
+		ENC_FIXED,
+		ENC_SSE, ENC_VEX,
+	};
+
+	enum SimdForm {
+		// xmm, xmm/m, the vex form takes a second source in vvvv: xmm, xmm, xmm/m
+		SIMD_RM,
+		// xmm, xmm/m, imm8 (pshufd), no vvvv
+		SIMD_RM_IMM8,
+		// xmm, xmm/m without vvvv in either form
+		SIMD_UNARY,
+		// loads use opcode, stores use the one in extra
+		SIMD_MOVE,
+		// movd and movq between xmm and a gpr or memory
+		SIMD_MOVD,
+		// r32/r64, xmm
+		SIMD_MOVMSK,
+		// xmm/ymm, xmm/m
+		SIMD_BROADCAST,
+		SIMD_NONE,
+	};
+
+	struct Spec {
+		lex::Instruction type;
+		const char *mnemonic;
+		uint8_t operands;
+		uint16_t forms[3];
+		// lock is allowed, as long as the first operand is memory
+		bool lockable;
+		FlagUse flags;
+		Encoder encoder;
+		// mandatory prefix (0, 0x66, 0xf3 or 0xf2) and opcode map (0: one byte, 1: 0f, 2: 0f 38, 3: 0f 3a)
+		uint8_t prefix, map, opcode;
+		// /digit, condition code, store opcode or trailing byte, depending on the encoder
+		uint8_t extra = 0;
+		SimdForm simd = SIMD_NONE;
+		// rex.w, or vex.w
+		bool w = false;
+	};
+
+	constexpr Spec SPECS[] = {
+		{ lex::MOV, "mov", 2, { FORM_RM, FORM_RM | FORM_ANY_IMM }, false, FLAGS_NONE, ENC_MOV, 0, 0, 0 },
+		{ lex::LEA, "lea", 2, { FORM_WIDE, FORM_M }, false, FLAGS_NONE, ENC_LEA, 0, 0, 0x8d },
+		{ lex::PUSH, "push", 1, { FORM_R16 | FORM_R64 | FORM_M | FORM_IMM }, false, FLAGS_NONE, ENC_PUSH_POP, 0, 0, 0 },
+		{ lex::POP, "pop", 1, { FORM_R16 | FORM_R64 | FORM_M }, false, FLAGS_NONE, ENC_PUSH_POP, 0, 0, 0 },
+		{ lex::ADD, "add", 2, { FORM_RM, FORM_RM | FORM_IMM }, true, FLAGS_KILL, ENC_ALU, 0, 0, 0, 0 },
+		{ lex::SUB, "sub", 2, { FORM_RM, FORM_RM | FORM_IMM }, true, FLAGS_KILL, ENC_ALU, 0, 0, 0, 5 },
+		{ lex::INC, "inc", 1, { FORM_RM }, true, FLAGS_NONE, ENC_UNARY, 0, 0, 0xfe, 0 },
+		{ lex::DEC, "dec", 1, { FORM_RM }, true, FLAGS_NONE, ENC_UNARY, 0, 0, 0xfe, 1 },
+		{ lex::IMUL, "imul", 2, { FORM_WIDE, FORM_RM | FORM_IMM }, false, FLAGS_KILL, ENC_IMUL, 0, 0, 0 },
+		{ lex::IDIV, "idiv", 1, { FORM_RM }, false, FLAGS_KILL, ENC_UNARY, 0, 0, 0xf6, 7 },
+		{ lex::AND, "and", 2, { FORM_RM, FORM_RM | FORM_IMM }, true, FLAGS_KILL, ENC_ALU, 0, 0, 0, 4 },
+		{ lex::OR, "or", 2, { FORM_RM, FORM_RM | FORM_IMM }, true, FLAGS_KILL, ENC_ALU, 0, 0, 0, 1 },
+		{ lex::XOR, "xor", 2, { FORM_RM, FORM_RM | FORM_IMM }, true, FLAGS_KILL, ENC_ALU, 0, 0, 0, 6 },
+		{ lex::NOT, "not", 1, { FORM_RM }, true, FLAGS_NONE, ENC_UNARY, 0, 0, 0xf6, 2 },
+		{ lex::SHL, "shl", 2, { FORM_RM, FORM_R8 | FORM_IMM8 }, false, FLAGS_NONE, ENC_SHIFT, 0, 0, 0, 4 },
+		{ lex::SHR, "shr", 2, { FORM_RM, FORM_R8 | FORM_IMM8 }, false, FLAGS_NONE, ENC_SHIFT, 0, 0, 0, 5 },
+		{ lex::JMP, "jmp", 1, { FORM_R64 | FORM_M | FORM_REL }, false, FLAGS_USE, ENC_JMP, 0, 0, 0xe9, 4 },
+		{ lex::JE, "je", 1, { FORM_REL }, false, FLAGS_USE, ENC_JCC, 0, 1, 0x80, 0x4 },
+		{ lex::JNE, "jne", 1, { FORM_REL }, false, FLAGS_USE, ENC_JCC, 0, 1, 0x80, 0x5 },
+		{ lex::JG, "jg", 1, { FORM_REL }, false, FLAGS_USE, ENC_JCC, 0, 1, 0x80, 0xf },
+		{ lex::JGE, "jge", 1, { FORM_REL }, false, FLAGS_USE, ENC_JCC, 0, 1, 0x80, 0xd },
+		{ lex::JL, "jl", 1, { FORM_REL }, false, FLAGS_USE, ENC_JCC, 0, 1, 0x80, 0xc },
+		{ lex::JLE, "jle", 1, { FORM_REL }, false, FLAGS_USE, ENC_JCC, 0, 1, 0x80, 0xe },
+		{ lex::JA, "ja", 1, { FORM_REL }, false, FLAGS_USE, ENC_JCC, 0, 1, 0x80, 0x7 },
+		{ lex::JAE, "jae", 1, { FORM_REL }, false, FLAGS_USE, ENC_JCC, 0, 1, 0x80, 0x3 },
+		{ lex::JB, "jb", 1, { FORM_REL }, false, FLAGS_USE, ENC_JCC, 0, 1, 0x80, 0x2 },
+		{ lex::JBE, "jbe", 1, { FORM_REL }, false, FLAGS_USE, ENC_JCC, 0, 1, 0x80, 0x6 },
+		{ lex::CMP, "cmp", 2, { FORM_RM, FORM_RM | FORM_IMM }, false, FLAGS_KILL, ENC_ALU, 0, 0, 0, 7 },
+		{ lex::CALL, "call", 1, { FORM_R64 | FORM_M | FORM_REL }, false, FLAGS_USE, ENC_JMP, 0, 0, 0xe8, 2 },
+		{ lex::RET, "ret", 0, {}, false, FLAGS_USE, ENC_FIXED, 0, 0, 0xc3 },
+		{ lex::SYSCALL, "syscall", 0, {}, false, FLAGS_USE, ENC_FIXED, 0, 1, 0x05 },
+
+		// cmpxchg16b only writes zf, rex.w is part of its opcode
+		{ lex::XCHG, "xchg", 2, { FORM_RM, FORM_RM }, true, FLAGS_NONE, ENC_XCHG, 0, 0, 0 },
+		{ lex::CMPXCHG, "cmpxchg", 2, { FORM_RM, FORM_GPR }, true, FLAGS_KILL, ENC_RM_REG, 0, 1, 0xb0 },
+		{ lex::CMPXCHG16B, "cmpxchg16b", 1, { FORM_M }, true, FLAGS_NONE, ENC_MEM, 0, 1, 0xc7, 1, SIMD_NONE, true },
+		{ lex::XADD, "xadd", 2, { FORM_RM, FORM_GPR }, true, FLAGS_KILL, ENC_RM_REG, 0, 1, 0xc0 },
+		{ lex::MFENCE, "mfence", 0, {}, false, FLAGS_NONE, ENC_FIXED, 0, 1, 0xae, 0xf0 },
+		{ lex::LFENCE, "lfence", 0, {}, false, FLAGS_NONE, ENC_FIXED, 0, 1, 0xae, 0xe8 },
+		{ lex::SFENCE, "sfence", 0, {}, false, FLAGS_NONE, ENC_FIXED, 0, 1, 0xae, 0xf8 },
+		{ lex::PAUSE, "pause", 0, {}, false, FLAGS_NONE, ENC_FIXED, 0xf3, 0, 0x90 },
+		// /1, /2, /3 for t0-t2 and /0 for nta
+		{ lex::PREFETCHT0, "prefetcht0", 1, { FORM_M }, false, FLAGS_NONE, ENC_MEM, 0, 1, 0x18, 1 },
+		{ lex::PREFETCHT1, "prefetcht1", 1, { FORM_M }, false, FLAGS_NONE, ENC_MEM, 0, 1, 0x18, 2 },
+		{ lex::PREFETCHT2, "prefetcht2", 1, { FORM_M }, false, FLAGS_NONE, ENC_MEM, 0, 1, 0x18, 3 },
+		{ lex::PREFETCHNTA, "prefetchnta", 1, { FORM_M }, false, FLAGS_NONE, ENC_MEM, 0, 1, 0x18, 0 },
+		{ lex::MOVNTI, "movnti", 2, { FORM_M, FORM_R32 | FORM_R64 }, false, FLAGS_NONE, ENC_RM_REG, 0, 1, 0xc3 },
+		{ lex::MOVNTDQ, "movntdq", 2, { FORM_M, FORM_XMM }, false, FLAGS_NONE, ENC_SSE, 0x66, 1, 0xe7, 0xe7, SIMD_MOVE },
+		{ lex::RDTSC, "rdtsc", 0, {}, false, FLAGS_NONE, ENC_FIXED, 0, 1, 0x31 },
+		{ lex::RDTSCP, "rdtscp", 0, {}, false, FLAGS_NONE, ENC_FIXED, 0, 1, 0x01, 0xf9 },
+
+		// vector instructions don't touch the flags, except ptest
+		{ lex::MOVDQA, "movdqa", 2, { FORM_XMM | FORM_M, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0x66, 1, 0x6f, 0x7f, SIMD_MOVE },
+		{ lex::MOVDQU, "movdqu", 2, { FORM_XMM | FORM_M, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0xf3, 1, 0x6f, 0x7f, SIMD_MOVE },
+		{ lex::MOVAPS, "movaps", 2, { FORM_XMM | FORM_M, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0x00, 1, 0x28, 0x29, SIMD_MOVE },
+		{ lex::MOVUPS, "movups", 2, { FORM_XMM | FORM_M, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0x00, 1, 0x10, 0x11, SIMD_MOVE },
+		{ lex::MOVD, "movd", 2, { FORM_XMM | FORM_R32 | FORM_R64 | FORM_M, FORM_XMM | FORM_R32 | FORM_R64 | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0x66, 1, 0x6e, 0x7e, SIMD_MOVD },
+		{ lex::MOVQ, "movq", 2, { FORM_XMM | FORM_R64 | FORM_M, FORM_XMM | FORM_R64 | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0x66, 1, 0x6e, 0x7e, SIMD_MOVD, true },
+		{ lex::PADDB, "paddb", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0x66, 1, 0xfc, 0, SIMD_RM },
+		{ lex::PADDW, "paddw", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0x66, 1, 0xfd, 0, SIMD_RM },
+		{ lex::PADDD, "paddd", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0x66, 1, 0xfe, 0, SIMD_RM },
+		{ lex::PADDQ, "paddq", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0x66, 1, 0xd4, 0, SIMD_RM },
+		{ lex::PSUBB, "psubb", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0x66, 1, 0xf8, 0, SIMD_RM },
+		{ lex::PSUBW, "psubw", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0x66, 1, 0xf9, 0, SIMD_RM },
+		{ lex::PSUBD, "psubd", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0x66, 1, 0xfa, 0, SIMD_RM },
+		{ lex::PSUBQ, "psubq", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0x66, 1, 0xfb, 0, SIMD_RM },
+		{ lex::PAND, "pand", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0x66, 1, 0xdb, 0, SIMD_RM },
+		{ lex::PANDN, "pandn", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0x66, 1, 0xdf, 0, SIMD_RM },
+		{ lex::POR, "por", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0x66, 1, 0xeb, 0, SIMD_RM },
+		{ lex::PXOR, "pxor", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0x66, 1, 0xef, 0, SIMD_RM },
+		{ lex::PCMPEQB, "pcmpeqb", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0x66, 1, 0x74, 0, SIMD_RM },
+		{ lex::PCMPEQW, "pcmpeqw", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0x66, 1, 0x75, 0, SIMD_RM },
+		{ lex::PCMPEQD, "pcmpeqd", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0x66, 1, 0x76, 0, SIMD_RM },
+		{ lex::PCMPGTB, "pcmpgtb", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0x66, 1, 0x64, 0, SIMD_RM },
+		{ lex::PMINUB, "pminub", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0x66, 1, 0xda, 0, SIMD_RM },
+		{ lex::PMAXUB, "pmaxub", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0x66, 1, 0xde, 0, SIMD_RM },
+		{ lex::PMULLD, "pmulld", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0x66, 2, 0x40, 0, SIMD_RM },
+		{ lex::PSHUFB, "pshufb", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0x66, 2, 0x00, 0, SIMD_RM },
+		{ lex::PSHUFD, "pshufd", 3, { FORM_XMM, FORM_XMM | FORM_M, FORM_IMM8 }, false, FLAGS_NONE, ENC_SSE, 0x66, 1, 0x70, 0, SIMD_RM_IMM8 },
+		{ lex::PMOVMSKB, "pmovmskb", 2, { FORM_R32 | FORM_R64, FORM_XMM }, false, FLAGS_NONE, ENC_SSE, 0x66, 1, 0xd7, 0, SIMD_MOVMSK },
+		{ lex::PTEST, "ptest", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_KILL, ENC_SSE, 0x66, 2, 0x17, 0, SIMD_UNARY },
+		{ lex::ADDPS, "addps", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0x00, 1, 0x58, 0, SIMD_RM },
+		{ lex::ADDPD, "addpd", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0x66, 1, 0x58, 0, SIMD_RM },
+		{ lex::SUBPS, "subps", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0x00, 1, 0x5c, 0, SIMD_RM },
+		{ lex::SUBPD, "subpd", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0x66, 1, 0x5c, 0, SIMD_RM },
+		{ lex::MULPS, "mulps", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0x00, 1, 0x59, 0, SIMD_RM },
+		{ lex::MULPD, "mulpd", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0x66, 1, 0x59, 0, SIMD_RM },
+		{ lex::DIVPS, "divps", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0x00, 1, 0x5e, 0, SIMD_RM },
+		{ lex::DIVPD, "divpd", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0x66, 1, 0x5e, 0, SIMD_RM },
+		{ lex::SQRTPS, "sqrtps", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0x00, 1, 0x51, 0, SIMD_UNARY },
+		{ lex::ADDSS, "addss", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0xf3, 1, 0x58, 0, SIMD_RM },
+		{ lex::ADDSD, "addsd", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0xf2, 1, 0x58, 0, SIMD_RM },
+		{ lex::SUBSS, "subss", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0xf3, 1, 0x5c, 0, SIMD_RM },
+		{ lex::SUBSD, "subsd", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0xf2, 1, 0x5c, 0, SIMD_RM },
+		{ lex::MULSS, "mulss", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0xf3, 1, 0x59, 0, SIMD_RM },
+		{ lex::MULSD, "mulsd", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0xf2, 1, 0x59, 0, SIMD_RM },
+		{ lex::DIVSS, "divss", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0xf3, 1, 0x5e, 0, SIMD_RM },
+		{ lex::DIVSD, "divsd", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0xf2, 1, 0x5e, 0, SIMD_RM },
+		{ lex::ANDPS, "andps", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0x00, 1, 0x54, 0, SIMD_RM },
+		{ lex::XORPS, "xorps", 2, { FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_SSE, 0x00, 1, 0x57, 0, SIMD_RM },
+
+		// the vex forms can take ymm registers, except the scalar ones and movd/movq
+		{ lex::VMOVDQA, "vmovdqa", 2, { FORM_VEC_M, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 1, 0x6f, 0x7f, SIMD_MOVE },
+		{ lex::VMOVDQU, "vmovdqu", 2, { FORM_VEC_M, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0xf3, 1, 0x6f, 0x7f, SIMD_MOVE },
+		{ lex::VMOVAPS, "vmovaps", 2, { FORM_VEC_M, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x00, 1, 0x28, 0x29, SIMD_MOVE },
+		{ lex::VMOVUPS, "vmovups", 2, { FORM_VEC_M, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x00, 1, 0x10, 0x11, SIMD_MOVE },
+		{ lex::VMOVD, "vmovd", 2, { FORM_XMM | FORM_R32 | FORM_R64 | FORM_M, FORM_XMM | FORM_R32 | FORM_R64 | FORM_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 1, 0x6e, 0x7e, SIMD_MOVD },
+		{ lex::VMOVQ, "vmovq", 2, { FORM_XMM | FORM_R64 | FORM_M, FORM_XMM | FORM_R64 | FORM_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 1, 0x6e, 0x7e, SIMD_MOVD, true },
+		{ lex::VPADDB, "vpaddb", 3, { FORM_VEC, FORM_VEC, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 1, 0xfc, 0, SIMD_RM },
+		{ lex::VPADDW, "vpaddw", 3, { FORM_VEC, FORM_VEC, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 1, 0xfd, 0, SIMD_RM },
+		{ lex::VPADDD, "vpaddd", 3, { FORM_VEC, FORM_VEC, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 1, 0xfe, 0, SIMD_RM },
+		{ lex::VPADDQ, "vpaddq", 3, { FORM_VEC, FORM_VEC, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 1, 0xd4, 0, SIMD_RM },
+		{ lex::VPSUBB, "vpsubb", 3, { FORM_VEC, FORM_VEC, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 1, 0xf8, 0, SIMD_RM },
+		{ lex::VPSUBW, "vpsubw", 3, { FORM_VEC, FORM_VEC, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 1, 0xf9, 0, SIMD_RM },
+		{ lex::VPSUBD, "vpsubd", 3, { FORM_VEC, FORM_VEC, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 1, 0xfa, 0, SIMD_RM },
+		{ lex::VPSUBQ, "vpsubq", 3, { FORM_VEC, FORM_VEC, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 1, 0xfb, 0, SIMD_RM },
+		{ lex::VPAND, "vpand", 3, { FORM_VEC, FORM_VEC, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 1, 0xdb, 0, SIMD_RM },
+		{ lex::VPANDN, "vpandn", 3, { FORM_VEC, FORM_VEC, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 1, 0xdf, 0, SIMD_RM },
+		{ lex::VPOR, "vpor", 3, { FORM_VEC, FORM_VEC, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 1, 0xeb, 0, SIMD_RM },
+		{ lex::VPXOR, "vpxor", 3, { FORM_VEC, FORM_VEC, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 1, 0xef, 0, SIMD_RM },
+		{ lex::VPCMPEQB, "vpcmpeqb", 3, { FORM_VEC, FORM_VEC, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 1, 0x74, 0, SIMD_RM },
+		{ lex::VPCMPEQW, "vpcmpeqw", 3, { FORM_VEC, FORM_VEC, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 1, 0x75, 0, SIMD_RM },
+		{ lex::VPCMPEQD, "vpcmpeqd", 3, { FORM_VEC, FORM_VEC, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 1, 0x76, 0, SIMD_RM },
+		{ lex::VPCMPGTB, "vpcmpgtb", 3, { FORM_VEC, FORM_VEC, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 1, 0x64, 0, SIMD_RM },
+		{ lex::VPMINUB, "vpminub", 3, { FORM_VEC, FORM_VEC, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 1, 0xda, 0, SIMD_RM },
+		{ lex::VPMAXUB, "vpmaxub", 3, { FORM_VEC, FORM_VEC, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 1, 0xde, 0, SIMD_RM },
+		{ lex::VPMULLD, "vpmulld", 3, { FORM_VEC, FORM_VEC, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 2, 0x40, 0, SIMD_RM },
+		{ lex::VPSHUFB, "vpshufb", 3, { FORM_VEC, FORM_VEC, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 2, 0x00, 0, SIMD_RM },
+		{ lex::VPSHUFD, "vpshufd", 3, { FORM_VEC, FORM_VEC_M, FORM_IMM8 }, false, FLAGS_NONE, ENC_VEX, 0x66, 1, 0x70, 0, SIMD_RM_IMM8 },
+		{ lex::VPMOVMSKB, "vpmovmskb", 2, { FORM_R32 | FORM_R64, FORM_VEC }, false, FLAGS_NONE, ENC_VEX, 0x66, 1, 0xd7, 0, SIMD_MOVMSK },
+		{ lex::VPTEST, "vptest", 2, { FORM_VEC, FORM_VEC_M }, false, FLAGS_KILL, ENC_VEX, 0x66, 2, 0x17, 0, SIMD_UNARY },
+		{ lex::VADDPS, "vaddps", 3, { FORM_VEC, FORM_VEC, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x00, 1, 0x58, 0, SIMD_RM },
+		{ lex::VADDPD, "vaddpd", 3, { FORM_VEC, FORM_VEC, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 1, 0x58, 0, SIMD_RM },
+		{ lex::VSUBPS, "vsubps", 3, { FORM_VEC, FORM_VEC, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x00, 1, 0x5c, 0, SIMD_RM },
+		{ lex::VSUBPD, "vsubpd", 3, { FORM_VEC, FORM_VEC, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 1, 0x5c, 0, SIMD_RM },
+		{ lex::VMULPS, "vmulps", 3, { FORM_VEC, FORM_VEC, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x00, 1, 0x59, 0, SIMD_RM },
+		{ lex::VMULPD, "vmulpd", 3, { FORM_VEC, FORM_VEC, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 1, 0x59, 0, SIMD_RM },
+		{ lex::VDIVPS, "vdivps", 3, { FORM_VEC, FORM_VEC, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x00, 1, 0x5e, 0, SIMD_RM },
+		{ lex::VDIVPD, "vdivpd", 3, { FORM_VEC, FORM_VEC, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 1, 0x5e, 0, SIMD_RM },
+		{ lex::VSQRTPS, "vsqrtps", 2, { FORM_VEC, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x00, 1, 0x51, 0, SIMD_UNARY },
+		{ lex::VADDSS, "vaddss", 3, { FORM_XMM, FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_VEX, 0xf3, 1, 0x58, 0, SIMD_RM },
+		{ lex::VADDSD, "vaddsd", 3, { FORM_XMM, FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_VEX, 0xf2, 1, 0x58, 0, SIMD_RM },
+		{ lex::VSUBSS, "vsubss", 3, { FORM_XMM, FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_VEX, 0xf3, 1, 0x5c, 0, SIMD_RM },
+		{ lex::VSUBSD, "vsubsd", 3, { FORM_XMM, FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_VEX, 0xf2, 1, 0x5c, 0, SIMD_RM },
+		{ lex::VMULSS, "vmulss", 3, { FORM_XMM, FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_VEX, 0xf3, 1, 0x59, 0, SIMD_RM },
+		{ lex::VMULSD, "vmulsd", 3, { FORM_XMM, FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_VEX, 0xf2, 1, 0x59, 0, SIMD_RM },
+		{ lex::VDIVSS, "vdivss", 3, { FORM_XMM, FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_VEX, 0xf3, 1, 0x5e, 0, SIMD_RM },
+		{ lex::VDIVSD, "vdivsd", 3, { FORM_XMM, FORM_XMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_VEX, 0xf2, 1, 0x5e, 0, SIMD_RM },
+		{ lex::VANDPS, "vandps", 3, { FORM_VEC, FORM_VEC, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x00, 1, 0x54, 0, SIMD_RM },
+		{ lex::VXORPS, "vxorps", 3, { FORM_VEC, FORM_VEC, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x00, 1, 0x57, 0, SIMD_RM },
+
+		// the source of a broadcast is always an xmm register or memory
+		{ lex::VPBROADCASTB, "vpbroadcastb", 2, { FORM_VEC, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 2, 0x78, 0, SIMD_BROADCAST },
+		{ lex::VPBROADCASTD, "vpbroadcastd", 2, { FORM_VEC, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 2, 0x58, 0, SIMD_BROADCAST },
+		{ lex::VPBROADCASTQ, "vpbroadcastq", 2, { FORM_VEC, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 2, 0x59, 0, SIMD_BROADCAST },
+		{ lex::VBROADCASTSS, "vbroadcastss", 2, { FORM_VEC, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 2, 0x18, 0, SIMD_BROADCAST },
+		{ lex::VBROADCASTSD, "vbroadcastsd", 2, { FORM_YMM, FORM_XMM | FORM_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 2, 0x19, 0, SIMD_BROADCAST },
+		{ lex::VFMADD132PS, "vfmadd132ps", 3, { FORM_VEC, FORM_VEC, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 2, 0x98, 0, SIMD_RM },
+		{ lex::VFMADD213PS, "vfmadd213ps", 3, { FORM_VEC, FORM_VEC, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 2, 0xa8, 0, SIMD_RM },
+		{ lex::VFMADD231PS, "vfmadd231ps", 3, { FORM_VEC, FORM_VEC, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 2, 0xb8, 0, SIMD_RM },
+		{ lex::VFMADD132PD, "vfmadd132pd", 3, { FORM_VEC, FORM_VEC, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 2, 0x98, 0, SIMD_RM, true },
+		{ lex::VFMADD213PD, "vfmadd213pd", 3, { FORM_VEC, FORM_VEC, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 2, 0xa8, 0, SIMD_RM, true },
+		{ lex::VFMADD231PD, "vfmadd231pd", 3, { FORM_VEC, FORM_VEC, FORM_VEC_M }, false, FLAGS_NONE, ENC_VEX, 0x66, 2, 0xb8, 0, SIMD_RM, true },
+		{ lex::VZEROUPPER, "vzeroupper", 0, {}, false, FLAGS_NONE, ENC_VEX, 0x00, 1, 0x77, 0, SIMD_NONE },
+	};
+
+	// rows are looked up by lex::Instruction, so they have to stay in enum order
+	constexpr bool in_enum_order() {
+		for (size_t i = 0; i < sizeof(SPECS) / sizeof(SPECS[0]); i++) {
+			if (SPECS[i].type != (lex::Instruction) i)
+				return false;
+		}
+		return true;
+	}
+	static_assert(sizeof(SPECS) / sizeof(SPECS[0]) == lex::INSN_COUNT, "every instruction needs a spec");
+	static_assert(in_enum_order(), "specs must be in lex::Instruction order");
+
+	inline const Spec &spec(lex::Instruction type) {
+		return SPECS[type];
+	}
+}
+
+#endif
@@ -1,18 +1,30 @@
+#include <cerrno>
 #include <cstdint>
 #include <stdexcept>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <variant>
-#include <fstream>
 #include <algorithm>
 #include <unordered_set>
+#include <array>
+#include <cstring>
+#include <iterator>
 #include <unordered_map>
-#include <regex>
 #include <climits>
 #include <iostream>
-#include <sstream>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 
 #include "lex.hpp"
+#include "insns.hpp"
+#include "context.hpp"
 
 const std::unordered_map<std::string, lex::Directive> DIRECTIVES = {
 	{ "db", lex::DB },
@@ -26,41 +38,18 @@ const std::unordered_map<std::string, lex::Directive> DIRECTIVES = {
 	{ "global", lex::GLOBAL },
 	{ "extern", lex::EXTERN },
 	{ "section", lex::SECTION },
+	{ "incbin", lex::INCBIN },
+	{ "times", lex::TIMES },
+	{ "align", lex::ALIGN },
 };
 
-const std::unordered_map<std::string, lex::Instruction> INSNS = {
-	{ "mov", lex::MOV },
-	{ "lea", lex::LEA },
-	{ "push", lex::PUSH },
-	{ "pop", lex::POP },
-	{ "add", lex::ADD },
-	{ "sub", lex::SUB },
-	{ "inc", lex::INC },
-	{ "dec", lex::DEC },
-	{ "imul", lex::IMUL },
-	{ "idiv", lex::IDIV },
-	{ "and", lex::AND },
-	{  "or", lex::OR  },
-	{ "xor", lex::XOR },
-	{ "not", lex::NOT },
-	{ "shl", lex::SHL },
-	{ "shr", lex::SHR },
-	{ "jmp", lex::JMP },
-	{  "je", lex::JE  },
-	{ "jne", lex::JNE },
-	{  "jg", lex::JG  },
-	{ "jge", lex::JGE },
-	{  "jl", lex::JL  },
-	{ "jle", lex::JLE },
-	{  "ja", lex::JA  },
-	{ "jae", lex::JAE },
-	{  "jb", lex::JB  },
-	{ "jbe", lex::JBE },
-	{ "cmp", lex::CMP },
-	{ "call", lex::CALL },
-	{ "ret", lex::RET },
-	{ "syscall", lex::SYSCALL },
-};
+// mnemonics come from the instruction specs
+const std::unordered_map<std::string, lex::Instruction> INSNS = [] {
+	std::unordered_map<std::string, lex::Instruction> names;
+	for (const insns::Spec &spec : insns::SPECS)
+		names.emplace(spec.mnemonic, spec.type);
+	return names;
+}();
 
 const std::unordered_map<std::string, lex::Register> REGS = {
 	{ "al",  lex::Register { lex::REGTYPE_GPR8,  lex::AL  } },
@@ -158,161 +147,426 @@ const std::unordered_map<std::string, lex::Register> REGS = {
 	{ "es", lex::Register { lex::REGTYPE_SEG, lex::ES } },
 	{ "fs", lex::Register { lex::REGTYPE_SEG, lex::FS } },
 	{ "gs", lex::Register { lex::REGTYPE_SEG, lex::GS } },
-};
 
-std::string lex::file_name;
+	{ "xmm0", lex::Register { lex::REGTYPE_XMM, lex::XMM0 } },
+	{ "xmm1", lex::Register { lex::REGTYPE_XMM, lex::XMM1 } },
+	{ "xmm2", lex::Register { lex::REGTYPE_XMM, lex::XMM2 } },
+	{ "xmm3", lex::Register { lex::REGTYPE_XMM, lex::XMM3 } },
+	{ "xmm4", lex::Register { lex::REGTYPE_XMM, lex::XMM4 } },
+	{ "xmm5", lex::Register { lex::REGTYPE_XMM, lex::XMM5 } },
+	{ "xmm6", lex::Register { lex::REGTYPE_XMM, lex::XMM6 } },
+	{ "xmm7", lex::Register { lex::REGTYPE_XMM, lex::XMM7 } },
+	{ "xmm8", lex::Register { lex::REGTYPE_XMM, lex::XMM8 } },
+	{ "xmm9", lex::Register { lex::REGTYPE_XMM, lex::XMM9 } },
+	{ "xmm10", lex::Register { lex::REGTYPE_XMM, lex::XMM10 } },
+	{ "xmm11", lex::Register { lex::REGTYPE_XMM, lex::XMM11 } },
+	{ "xmm12", lex::Register { lex::REGTYPE_XMM, lex::XMM12 } },
+	{ "xmm13", lex::Register { lex::REGTYPE_XMM, lex::XMM13 } },
+	{ "xmm14", lex::Register { lex::REGTYPE_XMM, lex::XMM14 } },
+	{ "xmm15", lex::Register { lex::REGTYPE_XMM, lex::XMM15 } },
 
-const std::unordered_set<char> DELIMS = {
-	' ', ',', '*', '+', '-', '/', '[', ']', ':', '$'
+	{ "ymm0", lex::Register { lex::REGTYPE_YMM, lex::YMM0 } },
+	{ "ymm1", lex::Register { lex::REGTYPE_YMM, lex::YMM1 } },
+	{ "ymm2", lex::Register { lex::REGTYPE_YMM, lex::YMM2 } },
+	{ "ymm3", lex::Register { lex::REGTYPE_YMM, lex::YMM3 } },
+	{ "ymm4", lex::Register { lex::REGTYPE_YMM, lex::YMM4 } },
+	{ "ymm5", lex::Register { lex::REGTYPE_YMM, lex::YMM5 } },
+	{ "ymm6", lex::Register { lex::REGTYPE_YMM, lex::YMM6 } },
+	{ "ymm7", lex::Register { lex::REGTYPE_YMM, lex::YMM7 } },
+	{ "ymm8", lex::Register { lex::REGTYPE_YMM, lex::YMM8 } },
+	{ "ymm9", lex::Register { lex::REGTYPE_YMM, lex::YMM9 } },
+	{ "ymm10", lex::Register { lex::REGTYPE_YMM, lex::YMM10 } },
+	{ "ymm11", lex::Register { lex::REGTYPE_YMM, lex::YMM11 } },
+	{ "ymm12", lex::Register { lex::REGTYPE_YMM, lex::YMM12 } },
+	{ "ymm13", lex::Register { lex::REGTYPE_YMM, lex::YMM13 } },
+	{ "ymm14", lex::Register { lex::REGTYPE_YMM, lex::YMM14 } },
+	{ "ymm15", lex::Register { lex::REGTYPE_YMM, lex::YMM15 } },
 };
 
-// no need to match uppercase because split_line lowercases string
-const std::regex HEX_REGEX = std::regex("0x[0-9a-f]+");
-const std::regex DEC_REGEX = std::regex("-?[0-9]+");
-
-inline lex::Immediate64 make_imm(uint32_t bits, std::variant<int64_t, uint64_t> val) {
-	uint64_t uval;
-	if (val.index() == 0)
-		uval = (uint64_t) (-std::get<int64_t>(val));
-	else
-		uval = std::get<uint64_t>(val);
-	return lex::Immediate64 { bits, uval };
+// digit value of every byte in hex, 0xff if it isn't a hex digit
+constexpr std::array<uint8_t, 256> make_digit_values() {
+	std::array<uint8_t, 256> values {};
+	for (uint32_t c = 0; c < 256; c++)
+		values[c] = 0xff;
+	for (uint32_t c = '0'; c <= '9'; c++)
+		values[c] = c - '0';
+	for (uint32_t c = 'a'; c <= 'f'; c++)
+		values[c] = c - 'a' + 10, values[c - 'a' + 'A'] = c - 'a' + 10;
+	return values;
+}
+constexpr std::array<uint8_t, 256> DIGIT_VALUES = make_digit_values();
+
+// 8 decimal digits at once, first digit in the low byte
+inline bool swar_eight_digits(const char *s, uint32_t &out) {
+	uint64_t v;
+	memcpy(&v, s, 8);
+	// every byte is 0x30-0x39: high nibble 3, and adding 6 doesn't carry into it
+	if (((v & 0xf0f0f0f0f0f0f0f0) | (((v + 0x0606060606060606) & 0xf0f0f0f0f0f0f0f0) >> 4)) != 0x3333333333333333)
+		return false;
+	// pairs, then quads, then all 8 with one multiply each
+	v = (v & 0x0f0f0f0f0f0f0f0f) * 2561 >> 8;
+	v = (v & 0x00ff00ff00ff00ff) * 6553601 >> 16;
+	out = (uint32_t) ((v & 0x0000ffff0000ffff) * 42949672960001 >> 32);
+	return true;
+}
+
+inline lex::NumberStatus parse_decimal(const char *s, size_t len, uint64_t &val) {
+	val = 0;
+	size_t i = 0;
+	uint32_t chunk;
+	for (; i + 8 <= len && swar_eight_digits(s + i, chunk); i += 8) {
+		if (__builtin_mul_overflow(val, 100000000, &val) || __builtin_add_overflow(val, chunk, &val))
+			return lex::NUM_OVERFLOW;
+	}
+	for (; i < len; i++) {
+		uint8_t digit = (uint8_t) s[i] - '0';
+		if (digit > 9)
+			return lex::NUM_INVALID;
+		if (__builtin_mul_overflow(val, 10, &val) || __builtin_add_overflow(val, digit, &val))
+			return lex::NUM_OVERFLOW;
+	}
+	return lex::NUM_OK;
+}
+
+// bases 2, 8 and 16, each digit is shift bits
+inline lex::NumberStatus parse_power_of_two(const char *s, size_t len, uint32_t shift, uint64_t &val) {
+	val = 0;
+	for (size_t i = 0; i < len; i++) {
+		uint8_t digit = DIGIT_VALUES[(uint8_t) s[i]];
+		if (digit >> shift)
+			return lex::NUM_INVALID;
+		if (val >> (64 - shift))
+			return lex::NUM_OVERFLOW;
+		val = val << shift | digit;
+	}
+	return lex::NUM_OK;
+}
+
+lex::NumberStatus lex::parse_number(const char *s, size_t len, uint64_t &val) {
+	if (len == 0 || s[0] < '0' || s[0] > '9')
+		return lex::NUM_INVALID;
+	// 0x 0h hex, 0b 0y binary, 0o 0q octal. something like 0bh is hex, so
+	// try the suffix forms when the prefix doesn't work out
+	if (len > 2 && s[0] == '0') {
+		lex::NumberStatus status = lex::NUM_INVALID;
+		switch (s[1] | 0x20) {
+			case 'x': case 'h': status = parse_power_of_two(s + 2, len - 2, 4, val); break;
+			case 'b': case 'y': status = parse_power_of_two(s + 2, len - 2, 1, val); break;
+			case 'o': case 'q': status = parse_power_of_two(s + 2, len - 2, 3, val); break;
+		}
+		if (status != lex::NUM_INVALID)
+			return status;
+	}
+	// h hex, b y binary, o q octal, d decimal suffixes
+	if (len > 1) {
+		switch (s[len - 1] | 0x20) {
+			case 'h': return parse_power_of_two(s, len - 1, 4, val);
+			case 'b': case 'y': return parse_power_of_two(s, len - 1, 1, val);
+			case 'o': case 'q': return parse_power_of_two(s, len - 1, 3, val);
+			case 'd': return parse_decimal(s, len - 1, val);
+		}
+	}
+	return parse_decimal(s, len, val);
+}
+
+// smallest immediate holding val, or -val if negative
+inline uint32_t literal_size(uint64_t val, bool negative) {
+	if (negative)
+		return val <= 0x80 ? 8 : val <= 0x8000 ? 16 : val <= 0x80000000 ? 32 : 64;
+	return val <= UINT8_MAX ? 8 : val <= UINT16_MAX ? 16 : val <= UINT32_MAX ? 32 : 64;
 }
 
 __attribute__((noreturn))
 void lex::assemble_error(uint32_t line_num, std::string msg) {
-	std::stringstream ss;
-	ss << lex::file_name << ":" << line_num << ": assemble error: " << msg;
-	throw std::runtime_error(ss.str());
+	throw lex::AssembleError(line_num, msg);
 }
 
-std::string to_lower(std::string str) {
+void to_lower(std::string &str) {
 	std::transform(str.begin(), str.end(), str.begin(), [](char c) {
 		return (c >= 'A' && c <= 'Z') ? c - ('A' - 'a') : c;
 	});
-	return str;
 }
 
-std::vector<std::string> split_line(std::string line, uint32_t line_num) {
-	bool is_string_lit = false;
-	std::vector<std::string> ret;
-	std::string cur = "";
-	for (uint32_t i = 0; i < line.length(); i++) {	
-		char letter = line[i];
-		if (!is_string_lit && DELIMS.count(letter)) {
-			if (cur.length() > 0)
-				ret.push_back(cur);
-			std::string delim(1, letter);
-			ret.push_back(delim);
-			cur = "";
+// what the lexer does with each byte, anything else is part of a token
+enum CharClass : uint8_t {
+	CLASS_TOKEN, CLASS_SPACE, CLASS_DELIM, CLASS_QUOTE,
+	CLASS_COMMENT, CLASS_NEWLINE, CLASS_END,
+};
+
+constexpr std::array<CharClass, 256> make_char_classes() {
+	std::array<CharClass, 256> classes {};
+	for (char c : { ' ', '\t', '\r' })
+		classes[(uint8_t) c] = CLASS_SPACE;
+	for (char c : { ',', '*', '+', '-', '/', '[', ']', ':', '$' })
+		classes[(uint8_t) c] = CLASS_DELIM;
+	classes['"'] = CLASS_QUOTE;
+	classes[';'] = CLASS_COMMENT;
+	classes['\n'] = CLASS_NEWLINE;
+	// the source buffer is padded with zeroes
+	classes['\0'] = CLASS_END;
+	return classes;
+}
+constexpr std::array<CharClass, 256> CHAR_CLASSES = make_char_classes();
+
+// bit i is set if byte i of a 32 byte block is not a token byte, or is a
+// space, tab or carriage return
+struct BlockMasks {
+	uint32_t special, space;
+};
+typedef BlockMasks (*Classifier)(const char *block);
+
+BlockMasks classify_scalar(const char *block) {
+	BlockMasks masks { 0, 0 };
+	for (uint32_t i = 0; i < 32; i++) {
+		CharClass c = CHAR_CLASSES[(uint8_t) block[i]];
+		masks.special |= (uint32_t) (c != CLASS_TOKEN) << i;
+		masks.space |= (uint32_t) (c == CLASS_SPACE) << i;
+	}
+	return masks;
+}
+
+#ifdef __x86_64__
+// sse2 has no byte shuffle, so compare against every special byte
+__attribute__((target("sse2")))
+uint32_t special_sse2(__m128i v, uint32_t &space) {
+	__m128i sp = _mm_or_si128(_mm_or_si128(
+		_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+		_mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+		_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+	__m128i special = sp;
+	for (char c : { ',', '*', '+', '-', '/', '[', ']', ':', '$', '"', ';', '\n', '\0' })
+		special = _mm_or_si128(special, _mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+	space = _mm_movemask_epi8(sp);
+	return _mm_movemask_epi8(special);
+}
+
+__attribute__((target("sse2")))
+BlockMasks classify_sse2(const char *block) {
+	uint32_t space_lo, space_hi;
+	uint32_t lo = special_sse2(_mm_loadu_si128((const __m128i *) block), space_lo);
+	uint32_t hi = special_sse2(_mm_loadu_si128((const __m128i *) (block + 16)), space_hi);
+	return BlockMasks { lo | hi << 16, space_lo | space_hi << 16 };
+}
+
+// every special byte is in one of the rows 0x0_, 0x2_, 0x3_, 0x5_, so give each
+// row a bit and set that bit for the row's special columns. a byte is special
+// if its row and column lookups share a bit
+__attribute__((target("avx2")))
+BlockMasks classify_avx2(const char *block) {
+	const __m256i column_bits = _mm256_setr_epi8(
+		3, 0, 2, 0, 2, 0, 0, 0, 0, 1, 7, 14, 2, 11, 0, 2,
+		3, 0, 2, 0, 2, 0, 0, 0, 0, 1, 7, 14, 2, 11, 0, 2);
+	const __m256i row_bits = _mm256_setr_epi8(
+		1, 0, 2, 4, 0, 8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+		1, 0, 2, 4, 0, 8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i nibble = _mm256_set1_epi8(0x0f);
+
+	__m256i v = _mm256_loadu_si256((const __m256i *) block);
+	__m256i column = _mm256_shuffle_epi8(column_bits, _mm256_and_si256(v, nibble));
+	__m256i row = _mm256_shuffle_epi8(row_bits, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+	__m256i token = _mm256_cmpeq_epi8(_mm256_and_si256(column, row), _mm256_setzero_si256());
+	__m256i sp = _mm256_or_si256(_mm256_or_si256(
+		_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+		_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+		_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+	return BlockMasks { ~(uint32_t) _mm256_movemask_epi8(token), (uint32_t) _mm256_movemask_epi8(sp) };
+}
+#endif
+
+Classifier pick_classifier() {
+#ifdef __x86_64__
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return classify_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return classify_sse2;
+#endif
+	return classify_scalar;
+}
+const Classifier classify = pick_classifier();
+
+// splits the line starting at p into tokens and moves p to the start of the
+// next line. whitespace and comments are dropped, delimiters are their own
+// tokens and string literals keep their quotes. reads up to 32 bytes past the
+// end, which must be zeroes. the tokens go in ret as views into the source
+void split_line(const char *&p, const char *end, uint32_t line_num, std::vector<std::string_view> &ret) {
+	ret.clear();
+	const char *token = p;
+	// masks of the block p is in, bits below p are shifted out rather than
+	// the block being classified again
+	const char *block = p;
+	BlockMasks masks = classify(block);
+	auto offset = [&]() {
+		if (p >= block + 32)
+			masks = classify(block = p);
+		return p - block;
+	};
+	while (true) {
+		unsigned shift = offset();
+		uint32_t special = masks.special >> shift;
+		if (special == 0) {
+			p = block + 32;
 			continue;
 		}
-		if (letter == '"')
-			is_string_lit = !is_string_lit;
-		cur += letter;
+		p += __builtin_ctz(special);
+		if (p > token)
+			ret.emplace_back(token, p - token);
+
+		switch (CHAR_CLASSES[(uint8_t) *p]) {
+			case CLASS_SPACE:
+				// past the end of the block counts as not space
+				do {
+					shift = offset();
+					p += __builtin_ctzll(~((uint64_t) masks.space >> shift));
+				} while (p == block + 32);
+				break;
+			case CLASS_DELIM:
+				ret.emplace_back(p, 1);
+				p++;
+				break;
+			case CLASS_QUOTE: {
+				const char *line_end = (const char *) memchr(p, '\n', end - p);
+				if (line_end == nullptr)
+					line_end = end;
+				const char *close = (const char *) memchr(p + 1, '"', line_end - p - 1);
+				if (close == nullptr)
+					lex::assemble_error(line_num, "unclosed string literal");
+				ret.emplace_back(p, close + 1 - p);
+				p = close + 1;
+				break;
+			}
+			case CLASS_COMMENT:
+				p = (const char *) memchr(p, '\n', end - p);
+				p = p == nullptr ? end : p + 1;
+				return;
+			case CLASS_NEWLINE:
+				p++;
+				return;
+			case CLASS_END:
+				// stray nul bytes in the source are skipped like whitespace
+				if (p >= end)
+					return;
+				p++;
+				break;
+			default:
+				break;
+		}
+		token = p;
 	}
-	if (is_string_lit)
-		lex::assemble_error(line_num, "unclosed string literal");
-	if (cur.length() > 0)
-		ret.push_back(cur);
-	return ret;
 }
 
-std::vector<std::vector<lex::Lexeme>> lex::lex(std::string file_name) {
-	lex::file_name = file_name;
-	
-	std::ifstream file(file_name);
-	std::string line;
-
-	std::vector<std::vector<lex::Lexeme>> tokens;
-	for (unsigned line_num = 1; std::getline(file, line); line_num++) {
-		uint32_t line_start, line_end;
-		for (line_start = 0; line[line_start] == ' ' || line[line_start] == '\t'; line_start++);
-		for (line_end = line_start; line[line_end] != ';' && line_end < line.length(); line_end++);
+void lex::lex(context::AssemblerContext &ctx, uint32_t file_index) {
+	// read straight into the kept source, an ifstream would allocate its buffer
+	std::string &source = ctx.source;
+	source.clear();
+	int fd = open(ctx.files[file_index].c_str(), O_RDONLY);
+	struct stat st;
+	if (fd >= 0 && fstat(fd, &st) == 0) {
+		source.resize(st.st_size);
+		size_t done = 0;
+		ssize_t n = 1;
+		while (done < source.size() && (n = read(fd, source.data() + done, source.size() - done)) > 0)
+			done += n;
+		source.resize(done);
+		if (n < 0) {
+			close(fd);
+			throw std::runtime_error("cannot read " + ctx.files[file_index] + ": " + strerror(errno));
+		}
+	}
+	if (fd >= 0)
+		close(fd);
+	// split_line looks at whole 32 byte blocks
+	const size_t source_size = source.size();
+	source.append(64, '\0');
+	const char *p = source.data(), *end = source.data() + source_size;
 
-		line = line.substr(line_start, line_end - line_start);
-		std::vector<std::string> line_tokens_str = split_line(line, line_num);
-		std::vector<lex::Lexeme> ltokens;
+	// lines left over from the last run are reused, and so are their lexemes,
+	// which are written over rather than cleared so their strings keep their memory
+	std::vector<std::vector<lex::Lexeme>> &tokens = ctx.tokens;
+	std::vector<std::string_view> &line_tokens = ctx.line_tokens;
+	std::string &tk_lower = ctx.lowered;
+	ctx.lines = 0;
+	for (unsigned line_num = 1; p < end; line_num++) {
+		split_line(p, end, line_num, line_tokens);
+		if (ctx.lines == tokens.size())
+			tokens.emplace_back();
+		std::vector<lex::Lexeme> &ltokens = tokens[ctx.lines];
+		size_t len = 0;
+		auto add = [&](lex::LexemeType type) -> lex::Lexeme & {
+			if (len == ltokens.size())
+				ltokens.emplace_back();
+			lex::Lexeme &lexeme = ltokens[len++];
+			lexeme.type = type;
+			lexeme.line_num = line_num;
+			return lexeme;
+		};
 
-		for (const std::string &token : line_tokens_str) {
-			std::string tk_lower = to_lower(token);
+		for (std::string_view token : line_tokens) {
+			tk_lower.assign(token);
+			to_lower(tk_lower);
+			uint64_t num;
+			// keywords never start with a digit, so literals skip the lookups
+			lex::NumberStatus status = lex::parse_number(tk_lower.data(), tk_lower.size(), num);
+			if (status == lex::NUM_OVERFLOW)
+				lex::assemble_error(line_num, "integer literal " + std::string(token) + " out of range");
 			if (tk_lower == ",")
-				ltokens.emplace_back(lex::Lexeme { LEXTYPE_COMMA, line_num, std::monostate{} });
+				add(LEXTYPE_COMMA).data = std::monostate {};
 			else if (tk_lower == "*")
-				ltokens.emplace_back(lex::Lexeme { LEXTYPE_ASTERISK, line_num, std::monostate{} });
+				add(LEXTYPE_ASTERISK).data = std::monostate {};
 			else if (tk_lower == "+")
-				ltokens.emplace_back(lex::Lexeme { LEXTYPE_ADD_SIGN, line_num, std::monostate{} });
+				add(LEXTYPE_ADD_SIGN).data = std::monostate {};
 			else if (tk_lower == "-")
-				ltokens.emplace_back(lex::Lexeme { LEXTYPE_MINUS_SIGN, line_num, std::monostate{} });
+				add(LEXTYPE_MINUS_SIGN).data = std::monostate {};
 			else if (tk_lower == "/")
-				ltokens.emplace_back(lex::Lexeme { LEXTYPE_SLASH, line_num, std::monostate{} });
+				add(LEXTYPE_SLASH).data = std::monostate {};
 			else if (tk_lower == "[")
-				ltokens.emplace_back(lex::Lexeme { LEXTYPE_OPEN_BRACKET, line_num, std::monostate{} });
+				add(LEXTYPE_OPEN_BRACKET).data = std::monostate {};
 			else if (tk_lower == "]")
-				ltokens.emplace_back(lex::Lexeme { LEXTYPE_CLOSE_BRACKET, line_num, std::monostate{} });
+				add(LEXTYPE_CLOSE_BRACKET).data = std::monostate {};
 			else if (tk_lower == ":")
-				ltokens.emplace_back(lex::Lexeme { LEXTYPE_COLON, line_num, std::monostate{} });
+				add(LEXTYPE_COLON).data = std::monostate {};
 			else if (tk_lower == "$")
-				ltokens.emplace_back(lex::Lexeme { LEXTYPE_DOLLAR, line_num, std::monostate{} });
+				add(LEXTYPE_DOLLAR).data = std::monostate {};
+			else if (status == lex::NUM_OK) {
+				// a minus that can't be subtraction belongs to the literal
+				bool negative = len >= 1 && ltokens[len - 1].type == LEXTYPE_MINUS_SIGN &&
+					(len == 1 || (ltokens[len - 2].type != LEXTYPE_IMM &&
+					ltokens[len - 2].type != LEXTYPE_REG &&
+					ltokens[len - 2].type != LEXTYPE_SYMBOL));
+				if (negative) {
+					if (num > (uint64_t) INT64_MAX + 1)
+						lex::assemble_error(line_num, "integer literal -" + std::string(token) + " out of range");
+					len--;
+				}
+				add(LEXTYPE_IMM).data = lex::Immediate64 { literal_size(num, negative), negative ? 0 - num : num };
+			}
 			else if (tk_lower == "equ")
-				ltokens.emplace_back(lex::Lexeme { LEXTYPE_EQU, line_num, std::monostate {} });
+				add(LEXTYPE_EQU).data = std::monostate {};
+			else if (tk_lower == "lock")
+				add(LEXTYPE_LOCK).data = std::monostate {};
 			else if (INSNS.count(tk_lower))
-				ltokens.emplace_back(lex::Lexeme { LEXTYPE_INSN, line_num, INSNS.find(tk_lower)->second });
+				add(LEXTYPE_INSN).data = INSNS.find(tk_lower)->second;
 			else if (DIRECTIVES.count(tk_lower))
-				ltokens.emplace_back(lex::Lexeme { LEXTYPE_DIRECTIVE, line_num, DIRECTIVES.find(tk_lower)->second });
+				add(LEXTYPE_DIRECTIVE).data = DIRECTIVES.find(tk_lower)->second;
 			else if (REGS.count(tk_lower))
-				ltokens.emplace_back(lex::Lexeme { LEXTYPE_REG, line_num, REGS.find(tk_lower)->second });
-			else {
-				bool is_dec = std::regex_match(tk_lower, DEC_REGEX);
-				bool is_hex = std::regex_match(tk_lower, HEX_REGEX);
-				if (is_dec || is_hex) {
-					size_t len;
-					if ((len = ltokens.size()) >= 1 && ltokens[len - 1].type == LEXTYPE_MINUS_SIGN &&
-							(len == 1 || (ltokens[len - 2].type != LEXTYPE_IMM &&
-							ltokens[len - 2].type != LEXTYPE_REG &&
-							ltokens[len - 2].type != LEXTYPE_SYMBOL))) {
-
-						ltokens.pop_back();
-						int64_t num = std::stoll(tk_lower, nullptr, is_hex ? 16 : 10);
-						if (num >= INT8_MIN && num <= INT8_MAX) 
-							ltokens.emplace_back(lex::Lexeme { LEXTYPE_IMM, line_num, make_imm(8, -num) });
-						else if (num >= INT16_MIN && num <= INT16_MAX)
-							ltokens.emplace_back(lex::Lexeme { LEXTYPE_IMM, line_num, make_imm(16, -num) });
-						else if (num >= INT32_MIN && num <= INT32_MAX)
-							ltokens.emplace_back(lex::Lexeme { LEXTYPE_IMM, line_num, make_imm(32, -num) });
-						else if (num >= INT64_MIN && num <= INT64_MAX)
-							ltokens.emplace_back(lex::Lexeme { LEXTYPE_IMM, line_num, make_imm(64, -num) });
-					}
-					else {
-						uint64_t num = std::stoull(tk_lower, nullptr, is_hex ? 16 : 10);
-						if (num <= UINT8_MAX)
-							ltokens.emplace_back(lex::Lexeme { LEXTYPE_IMM, line_num, make_imm(8, num) });
-						else if (num <= UINT16_MAX)
-							ltokens.emplace_back(lex::Lexeme { LEXTYPE_IMM, line_num, make_imm(16, num) });
-						else if (num <= UINT32_MAX)
-							ltokens.emplace_back(lex::Lexeme { LEXTYPE_IMM, line_num, make_imm(32, num) });
-						else if (num <= UINT64_MAX) 
-							ltokens.emplace_back(lex::Lexeme { LEXTYPE_IMM, line_num, make_imm(64, num) });
-					}
-				}
-				else if (tk_lower.length() >= 2 && tk_lower[0] == '"' && tk_lower[tk_lower.length() - 1] == '"') {
-					std::string lit = token.substr(1, token.size() - 2);
-					ltokens.emplace_back(lex::Lexeme { LEXTYPE_STR_LIT, line_num, lit });
-				}
-				else if (tk_lower != " ")
-					ltokens.emplace_back(lex::Lexeme { LEXTYPE_SYMBOL, line_num, tk_lower });
-			}
+				add(LEXTYPE_REG).data = REGS.find(tk_lower)->second;
+			else if (tk_lower.length() >= 2 && tk_lower[0] == '"' && tk_lower[tk_lower.length() - 1] == '"')
+				lex::reuse<std::string>(add(LEXTYPE_STR_LIT).data).assign(token.substr(1, token.size() - 2));
+			else
+				lex::reuse<std::string>(add(LEXTYPE_SYMBOL).data) = tk_lower;
+		}
+		// an empty line leaves its slot, and the lexemes in it, to the next one
+		if (len) {
+			ltokens.resize(len);
+			ctx.lines++;
 		}
-		if (ltokens.size())
-			tokens.emplace_back(ltokens);
 	}
 
-	file.close();
-
-	for (std::vector<lex::Lexeme> &ltokens : tokens) {
+	for (size_t line = 0; line < ctx.lines; line++) {
+		const std::vector<lex::Lexeme> &ltokens = tokens[line];
 		uint32_t bracket_count = 0;
 		for (size_t i = 0; i < ltokens.size(); i++) {
-			lex::Lexeme lexeme = ltokens[i];   
+			const lex::Lexeme &lexeme = ltokens[i];
 			if (lexeme.type == LEXTYPE_OPEN_BRACKET)
 				bracket_count++;
 			if (lexeme.type == LEXTYPE_CLOSE_BRACKET)
@@ -336,7 +590,5 @@ std::vector<std::vector<lex::Lexeme>> lex::lex(std::string file_name) {
 		if (bracket_count)
 			lex::assemble_error(ltokens[0].line_num, "bracket error");
 	}
-
-	return tokens;
 }
 
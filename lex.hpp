@@ -2,19 +2,23 @@
 #define LEX_HPP
 
 #include <climits>
+#include <stdexcept>
 #include <string>
 #include <vector>
 #include <cstdint>
 #include <variant>
 #include <unordered_set>
 
-namespace lex {
-	extern std::string file_name;
+namespace context {
+	struct AssemblerContext;
+}
 
+namespace lex {
 	enum Directive {
 		DB, DW, DD, DQ,
 		RESB, RESW, RESD, RESQ,
-		GLOBAL, EXTERN, SECTION
+		GLOBAL, EXTERN, SECTION,
+		INCBIN, TIMES, ALIGN
 	};
 	enum Instruction {
 		MOV, LEA, PUSH, POP,
@@ -23,50 +27,99 @@ namespace lex {
 		JMP, JE, JNE, JG, JGE, JL, JLE,
 		JA, JAE, JB, JBE,
 		CMP, CALL, RET, SYSCALL,
+
+		// atomics, fences, cache control and timing
+		XCHG, CMPXCHG, CMPXCHG16B, XADD,
+		MFENCE, LFENCE, SFENCE, PAUSE,
+		PREFETCHT0, PREFETCHT1, PREFETCHT2, PREFETCHNTA,
+		MOVNTI, MOVNTDQ, RDTSC, RDTSCP,
+
+		// sse, sse2, ssse3, sse4.1
+		MOVDQA, MOVDQU, MOVAPS, MOVUPS, MOVD, MOVQ,
+		PADDB, PADDW, PADDD, PADDQ, PSUBB, PSUBW, PSUBD, PSUBQ,
+		PAND, PANDN, POR, PXOR,
+		PCMPEQB, PCMPEQW, PCMPEQD, PCMPGTB,
+		PMINUB, PMAXUB, PMULLD, PSHUFB, PSHUFD,
+		PMOVMSKB, PTEST,
+		ADDPS, ADDPD, SUBPS, SUBPD, MULPS, MULPD, DIVPS, DIVPD, SQRTPS,
+		ADDSS, ADDSD, SUBSS, SUBSD, MULSS, MULSD, DIVSS, DIVSD,
+		ANDPS, XORPS,
+
+		// vex encoded versions of the above, in the same order
+		VMOVDQA, VMOVDQU, VMOVAPS, VMOVUPS, VMOVD, VMOVQ,
+		VPADDB, VPADDW, VPADDD, VPADDQ, VPSUBB, VPSUBW, VPSUBD, VPSUBQ,
+		VPAND, VPANDN, VPOR, VPXOR,
+		VPCMPEQB, VPCMPEQW, VPCMPEQD, VPCMPGTB,
+		VPMINUB, VPMAXUB, VPMULLD, VPSHUFB, VPSHUFD,
+		VPMOVMSKB, VPTEST,
+		VADDPS, VADDPD, VSUBPS, VSUBPD, VMULPS, VMULPD, VDIVPS, VDIVPD, VSQRTPS,
+		VADDSS, VADDSD, VSUBSS, VSUBSD, VMULSS, VMULSD, VDIVSS, VDIVSD,
+		VANDPS, VXORPS,
+
+		// avx, avx2 and fma only
+		VPBROADCASTB, VPBROADCASTD, VPBROADCASTQ, VBROADCASTSS, VBROADCASTSD,
+		VFMADD132PS, VFMADD213PS, VFMADD231PS,
+		VFMADD132PD, VFMADD213PD, VFMADD231PD,
+		VZEROUPPER,
+
+		// number of instructions, each has a row in insns::SPECS
+		INSN_COUNT,
 	};
 
-	enum RegisterType {
+	enum RegisterType : uint8_t {
 		REGTYPE_GPR8,
 		REGTYPE_GPR16,
 		REGTYPE_GPR32,
 		REGTYPE_GPR64,
 		REGTYPE_CONTROL,
 		REGTYPE_SEG,
+		REGTYPE_XMM,
+		REGTYPE_YMM,
 	};
-	enum GPRegs8 {
+	enum GPRegs8 : uint8_t {
 		AH, BH, CH, DH,
 		AL, BL, CL, DL,
 		SPL, BPL, DIL, SIL,
 		R8B, R9B, R10B, R11B,
 		R12B, R13B, R14B, R15B,
 	};
-	enum GPRegs16 {
+	enum GPRegs16 : uint8_t {
 		AX, BX, CX, DX,
 		SP, BP, DI, SI,
 		R8W, R9W, R10W, R11W,
 		R12W, R13W, R14W, R15W,
 	};
-	enum GPRegs32 {
+	enum GPRegs32 : uint8_t {
 		EAX, EBX, ECX, EDX,
 		ESP, EBP, EDI, ESI,
 		R8D, R9D, R10D, R11D,
 		R12D, R13D, R14D, R15D,
 	};
-	enum GPRegs64 {
+	enum GPRegs64 : uint8_t {
 		RAX, RBX, RCX, RDX,
 		RSP, RBP, RDI, RSI,
 		R8, R9, R10, R11,
 		R12, R13, R14, R15,
 	};
-	enum ControlRegs {
+	enum ControlRegs : uint8_t {
 		CR0, CR2, CR3, CR4
 	};
-	enum SegmentRegs {
+	enum SegmentRegs : uint8_t {
 		SS, CS, DS, ES, FS, GS
 	};
+	// xmm and ymm registers are in hardware order
+	enum XMMRegs : uint8_t {
+		XMM0, XMM1, XMM2, XMM3, XMM4, XMM5, XMM6, XMM7,
+		XMM8, XMM9, XMM10, XMM11, XMM12, XMM13, XMM14, XMM15,
+	};
+	enum YMMRegs : uint8_t {
+		YMM0, YMM1, YMM2, YMM3, YMM4, YMM5, YMM6, YMM7,
+		YMM8, YMM9, YMM10, YMM11, YMM12, YMM13, YMM14, YMM15,
+	};
+	// registers fit in 3 bytes, they're stored inline in every operand
 	struct Register {
 		RegisterType type;
-		std::variant<GPRegs8, GPRegs16, GPRegs32, GPRegs64, ControlRegs, SegmentRegs> reg;
+		std::variant<GPRegs8, GPRegs16, GPRegs32, GPRegs64, ControlRegs, SegmentRegs, XMMRegs, YMMRegs> reg;
 	};
 
 	// max size 64 and 32
@@ -98,6 +151,7 @@ namespace lex {
 		LEXTYPE_STR_LIT,
 		LEXTYPE_NEWLINE,
 		LEXTYPE_EQU,
+		LEXTYPE_LOCK,
 	};
 
 	struct Lexeme {
@@ -106,8 +160,30 @@ namespace lex {
 		std::variant<std::string, Immediate64, Register, Directive, Instruction, std::monostate> data;
 	};
 
-	void assemble_error(uint32_t line_num, std::string msg);
-	std::vector<std::vector<Lexeme>> lex(std::string file_name);
+	// the T held by var, made first if it holds something else. writing into it
+	// reuses whatever memory the last value had
+	template <typename T, typename Variant>
+	inline T &reuse(Variant &var) {
+		if (!std::holds_alternative<T>(var))
+			var.template emplace<T>();
+		return std::get<T>(var);
+	}
+
+	enum NumberStatus {
+		NUM_OK, NUM_INVALID, NUM_OVERFLOW
+	};
+	// integer literal in decimal, hex (0x, 0h, h), binary (0b, 0y, b, y) or
+	// octal (0o, 0q, o, q), doesn't allocate or throw
+	NumberStatus parse_number(const char *s, size_t len, uint64_t &val);
+
+	// what assemble_error throws, only the context knows which file it came from
+	struct AssembleError : std::runtime_error {
+		uint32_t line_num;
+		AssembleError(uint32_t line_num, const std::string &msg) : std::runtime_error(msg), line_num(line_num) {}
+	};
+	__attribute__((noreturn)) void assemble_error(uint32_t line_num, std::string msg);
+	// tokens of every non-empty line of ctx.files[file], into ctx.tokens
+	void lex(context::AssemblerContext &ctx, uint32_t file);
 }
 
 #endif
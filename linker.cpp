@@ -0,0 +1,159 @@
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "firstpass.hpp"
+#include "secondpass.hpp"
+#include "linker.hpp"
+
+inline uint64_t align_up(uint64_t val, uint64_t align) {
+	return (val + align - 1) / align * align;
+}
+
+inline linker::SegmentType segment_type(const firstpass::Section &section) {
+	if (section.segment == firstpass::Code)
+		return linker::SEG_TEXT;
+	if (section.name.rfind(".rodata", 0) == 0)
+		return linker::SEG_RODATA;
+	return linker::SEG_DATA;
+}
+
+// same test as elf::write_object
+inline bool is_bss(const std::string &name) {
+	return name == ".bss" || name.rfind(".bss.", 0) == 0;
+}
+
+// whether the relocated value fits the field, like ld checks it
+bool fits(secondpass::RelocType type, int64_t val) {
+	switch (type) {
+		case secondpass::RELOC_8: return val >= INT8_MIN && val <= UINT8_MAX;
+		case secondpass::RELOC_16: return val >= INT16_MIN && val <= UINT16_MAX;
+		case secondpass::RELOC_32: return val >= 0 && val <= UINT32_MAX;
+		case secondpass::RELOC_64: return true;
+		default: return val >= INT32_MIN && val <= INT32_MAX;
+	}
+}
+
+inline uint32_t reloc_size(secondpass::RelocType type) {
+	switch (type) {
+		case secondpass::RELOC_8: return 1;
+		case secondpass::RELOC_16: return 2;
+		case secondpass::RELOC_64: return 8;
+		default: return 4;
+	}
+}
+
+linker::Executable linker::link(const std::vector<linker::Unit> &units, uint64_t base, const std::string &entry) {
+	linker::Executable exe;
+	exe.base = base;
+	exe.entry = 0;
+
+	// sections in order of first use, and where each unit's part of them starts
+	std::unordered_map<std::string, uint32_t> section_index;
+	std::vector<std::vector<uint32_t>> placed(units.size());
+	std::vector<std::vector<uint64_t>> unit_offset(units.size());
+	for (size_t u = 0; u < units.size(); u++) {
+		const linker::Unit &unit = units[u];
+		for (size_t i = 0; i < unit.sections.size(); i++) {
+			const firstpass::Section &from = unit.sections[i];
+			if (!section_index.count(from.name)) {
+				section_index[from.name] = exe.sections.size();
+				exe.sections.emplace_back(linker::Section {
+					from.name, segment_type(from), is_bss(from.name), 0, 0, 1, {}
+				});
+			}
+			linker::Section &section = exe.sections[section_index[from.name]];
+			if (section.segment != segment_type(from))
+				throw std::runtime_error(unit.file_name + ": section " + from.name + " is code in one file and data in another");
+			uint64_t offset = align_up(section.size, from.align);
+			placed[u].push_back(section_index[from.name]);
+			unit_offset[u].push_back(offset);
+			section.align = std::max(section.align, from.align);
+			section.size = offset + from.size;
+			if (!section.nobits) {
+				// code is padded with nops, data with zeroes
+				section.data.resize(offset, section.segment == linker::SEG_TEXT ? 0x90 : 0);
+				section.data.insert(section.data.end(), unit.out.contents[i].begin(), unit.out.contents[i].end());
+			}
+		}
+	}
+
+	// the headers get the first page to themselves, then a page aligned segment
+	// for each kind of section that is used
+	std::vector<uint32_t> order(exe.sections.size());
+	for (size_t i = 0; i < order.size(); i++)
+		order[i] = i;
+	std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+		const linker::Section &x = exe.sections[a], &y = exe.sections[b];
+		return x.segment != y.segment ? x.segment < y.segment : !x.nobits && y.nobits;
+	});
+	uint64_t address = base + linker::PAGE_SIZE;
+	for (uint32_t i : order) {
+		linker::Section &section = exe.sections[i];
+		if (exe.segments.empty() || exe.segments.back().type != section.segment) {
+			address = align_up(address, linker::PAGE_SIZE);
+			exe.segments.emplace_back(linker::Segment { section.segment, address, 0, 0 });
+		}
+		linker::Segment &segment = exe.segments.back();
+		section.address = address = align_up(address, section.align);
+		address += section.size;
+		segment.mem_size = address - segment.address;
+		if (!section.nobits)
+			segment.file_size = segment.mem_size;
+	}
+
+	auto section_address = [&](size_t u, uint32_t i) {
+		return exe.sections[placed[u][i]].address + unit_offset[u][i];
+	};
+	std::unordered_map<std::string, uint64_t> globals;
+	for (size_t u = 0; u < units.size(); u++) {
+		const linker::Unit &unit = units[u];
+		for (const firstpass::Symbol &sym : unit.symtab) {
+			bool global = std::find(unit.out.globals.begin(), unit.out.globals.end(), sym.symbol) != unit.out.globals.end();
+			uint64_t sym_address = section_address(u, sym.section) + sym.offset;
+			if (global && globals.count(sym.symbol))
+				throw std::runtime_error(unit.file_name + ": symbol " + sym.symbol + " is already defined by another file");
+			if (global)
+				globals[sym.symbol] = sym_address;
+			exe.symbols.emplace_back(linker::Symbol {
+				sym.symbol, sym_address, sym.size, placed[u][sym.section], global, sym.segment == firstpass::Code
+			});
+		}
+	}
+	if (!entry.empty() && !globals.count(entry))
+		throw std::runtime_error("no global " + entry + " to use as the entry point");
+	if (!entry.empty())
+		exe.entry = globals[entry];
+
+	for (size_t u = 0; u < units.size(); u++) {
+		const linker::Unit &unit = units[u];
+		for (size_t i = 0; i < unit.out.relocs.size(); i++) {
+			linker::Section &section = exe.sections[placed[u][i]];
+			for (const secondpass::Relocation &reloc : unit.out.relocs[i]) {
+				uint64_t target;
+				if (reloc.target.base == secondpass::EXTERN) {
+					const std::string &name = unit.out.externs[reloc.target.index];
+					if (!globals.count(name))
+						throw std::runtime_error(unit.file_name + ": undefined reference to " + name);
+					target = globals[name];
+				}
+				else
+					target = section_address(u, reloc.target.index);
+				uint64_t field = unit_offset[u][i] + reloc.offset;
+				int64_t val = target + reloc.target.val;
+				if (reloc.type == secondpass::RELOC_PC32 || reloc.type == secondpass::RELOC_PLT32)
+					val -= section.address + field;
+				if (section.nobits)
+					throw std::runtime_error(unit.file_name + ": relocation in " + section.name + ", which has no contents");
+				if (!fits(reloc.type, val))
+					throw std::runtime_error(unit.file_name + ": relocation in " + section.name + " out of range");
+				for (uint32_t b = 0; b < reloc_size(reloc.type); b++)
+					section.data[field + b] = (uint64_t) val >> (b * 8);
+			}
+		}
+	}
+	return exe;
+}
@@ -0,0 +1,65 @@
+#ifndef LINKER_HPP
+#define LINKER_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "firstpass.hpp"
+#include "secondpass.hpp"
+
+namespace linker {
+	// where the first segment is mapped, the same as ld's default
+	const uint64_t BASE_ADDRESS = 0x400000;
+	const uint64_t PAGE_SIZE = 0x1000;
+
+	// one assembled source
+	struct Unit {
+		std::string file_name;
+		std::vector<firstpass::Section> sections;
+		std::vector<firstpass::Symbol> symtab;
+		secondpass::Output out;
+	};
+
+	enum SegmentType {
+		// code, then read only data, then everything else with .bss last
+		SEG_TEXT, SEG_RODATA, SEG_DATA,
+	};
+	// sections of the same name from every unit, one after another
+	struct Section {
+		std::string name;
+		SegmentType segment;
+		bool nobits;
+		uint64_t address, size, align;
+		std::vector<uint8_t> data;
+	};
+	// one PT_LOAD, the file offset of everything is its address - base
+	struct Segment {
+		SegmentType type;
+		uint64_t address, file_size, mem_size;
+	};
+	struct Symbol {
+		std::string name;
+		uint64_t address, size;
+		// index into Executable::sections
+		uint32_t section;
+		bool global, code;
+	};
+	struct Executable {
+		// where the headers go, the sections start a page after it
+		uint64_t base;
+		uint64_t entry;
+		std::vector<Section> sections;
+		std::vector<Segment> segments;
+		// locals and globals of every unit, for debuggers and profilers
+		std::vector<Symbol> symbols;
+	};
+
+	// merges the sections of every unit, resolves extern symbols against the globals
+	// of the others and applies every relocation for an image mapped at base (page
+	// aligned). entry has to be one of the globals, unless it is empty
+	Executable link(const std::vector<Unit> &units, uint64_t base = BASE_ADDRESS,
+		const std::string &entry = "_start");
+}
+
+#endif
@@ -1,9 +1,51 @@
+
 #include <stdexcept>
 #include <iostream>
 #include <vector>
+#include <unistd.h>
 
 #include "lex.hpp"
 #include "parse.hpp"
+#include "optimize.hpp"
+#include "firstpass.hpp"
+#include "analyze.hpp"
+#include "secondpass.hpp"
+#include "dwarf.hpp"
+#include "elf.hpp"
+#include "cache.hpp"
+#include "context.hpp"
+#include "linker.hpp"
+#include "profile.hpp"
+#include "bench.hpp"
+
+// cached objects are evicted oldest first past this, unless JASM_CACHE_SIZE says otherwise
+const uint64_t DEFAULT_CACHE_SIZE = 256 << 20;
+
+// lex, parse and firstpass of one source, with the reports the options ask for
+void front_end(context::AssemblerContext &ctx, uint32_t file) {
+	if (!context::assemble(ctx, file))
+		throw std::runtime_error(ctx.diagnostics.back());
+	if (ctx.options.optimize) {
+		std::cerr << ctx.files[file] << ": peephole rewrote " << ctx.peephole.rewritten << " instructions, saved "
+			<< ctx.peephole.bytes_saved << " bytes\n";
+	}
+	if (!ctx.options.profile.empty()) {
+		std::cerr << ctx.files[file] << ": profile put " << ctx.reordered.hot << " hot blocks first, moved "
+			<< ctx.reordered.cold << " cold blocks to .cold sections (" << ctx.reordered.unmatched << " samples unmatched)\n";
+	}
+	if (ctx.options.analyze)
+		analyze::report(std::cout, analyze::analyze(ctx.program, ctx.options.model));
+}
+
+secondpass::Output encode(context::AssemblerContext &ctx, uint32_t file) {
+	try {
+		return secondpass::secondpass(ctx.program, ctx.layout, ctx.symtab, ctx.options.debug, ctx.options.threads);
+	}
+	catch (const lex::AssembleError &err) {
+		context::report(ctx, file, err);
+		throw std::runtime_error(ctx.diagnostics.back());
+	}
+}
 
 int main(int argc, char *argv[]) {
 	if (argc == 1)
@@ -11,8 +53,115 @@ int main(int argc, char *argv[]) {
 	// https://stackoverflow.com/a/50520093/15246561
 	std::vector<std::string> arg_list(argv + 1, argv + argc);
 
-	std::vector<std::vector<lex::Lexeme>> tokens = lex::lex(arg_list[0]);
-	std::vector<parse::Statement> stmts = parse::parse(tokens);
+	context::AssemblerContext ctx;
+	context::Options &options = ctx.options;
+	options.model = analyze::DEFAULT_MODEL;
+	bool use_cache = true, exe = false;
+	// jasm bench file times a function of file instead of writing anything
+	bool bench = arg_list[0] == "bench";
+	uint64_t iters = bench::DEFAULT_ITERS;
+	std::string output_name, func;
+	for (size_t i = bench; i < arg_list.size(); i++) {
+		const std::string &arg = arg_list[i];
+		if (arg == "-O")
+			options.optimize = true;
+		else if (arg == "-g")
+			options.debug = true;
+		else if (arg == "--no-cache")
+			use_cache = false;
+		else if (arg == "-o") {
+			if (i + 1 == arg_list.size())
+				throw std::runtime_error("-o needs a file name");
+			output_name = arg_list[++i];
+		}
+		else if (arg == "--analyze")
+			options.analyze = true;
+		else if (arg == "--profile") {
+			if (i + 1 == arg_list.size())
+				throw std::runtime_error("--profile needs a file name");
+			options.profile = profile::read_samples(arg_list[++i]);
+		}
+		else if (arg == "--iters" || arg == "--func") {
+			if (i + 1 == arg_list.size())
+				throw std::runtime_error(arg + " needs a value");
+			if (arg == "--iters")
+				iters = std::stoull(arg_list[++i]);
+			else
+				func = arg_list[++i];
+		}
+		else if (arg == "--exe")
+			exe = true;
+		else if (arg.rfind("--mcpu=", 0) == 0)
+			options.model = arg.substr(7);
+		else if (arg.rfind("--threads=", 0) == 0)
+			options.threads = std::stoul(arg.substr(10));
+		else if (arg[0] == '-')
+			throw std::runtime_error("unknown option " + arg);
+		else
+			ctx.files.emplace_back(arg);
+	}
+	if (ctx.files.empty())
+		throw std::runtime_error("pass a file through command line args");
+	if (ctx.files.size() > 1 && !exe)
+		throw std::runtime_error("only --exe takes more than one file");
+
+	if (bench) {
+		if (exe || options.debug || !output_name.empty())
+			throw std::runtime_error("bench doesn't write a file, -o, -g and --exe don't work with it");
+		front_end(ctx, 0);
+		linker::Unit unit = { ctx.files[0], ctx.layout.sections, ctx.symtab, encode(ctx, 0) };
+		bench::report(std::cout, bench::run(unit, func, iters));
+		return 0;
+	}
+
+	// every source is assembled in process and linked straight into the executable
+	if (exe) {
+		if (output_name.empty())
+			throw std::runtime_error("--exe needs -o");
+		if (options.debug)
+			throw std::runtime_error("-g doesn't work with --exe");
+		std::vector<linker::Unit> units;
+		for (uint32_t i = 0; i < ctx.files.size(); i++) {
+			front_end(ctx, i);
+			units.emplace_back(linker::Unit { ctx.files[i], ctx.layout.sections, ctx.symtab, encode(ctx, i) });
+		}
+		elf::write_executable(output_name, linker::link(units));
+		return 0;
+	}
+	const std::string &file_name = ctx.files[0];
+
+	// only the object is cached, so anything that prints a report runs in full
+	char cwd[4096];
+	std::string cache_dir = cache::directory();
+	uint64_t key;
+	use_cache = use_cache && !output_name.empty() && !options.analyze && !options.optimize && options.profile.empty();
+	if (use_cache) {
+		// the line table names the working directory
+		std::string key_options = options.debug ? std::string("-g ") + (getcwd(cwd, sizeof(cwd)) ? cwd : ".") : "";
+		use_cache = cache::input_key(file_name, key_options, key);
+		if (use_cache && cache::fetch(cache_dir, key, output_name))
+			return 0;
+	}
+
+	front_end(ctx, 0);
+	const firstpass::Layout &layout = ctx.layout;
+
+	if (!output_name.empty()) {
+		secondpass::Output out = encode(ctx, 0);
+		std::vector<dwarf::DebugSection> debug_sections;
+		if (options.debug) {
+			std::vector<std::string> section_names;
+			for (const firstpass::Section &section : layout.sections)
+				section_names.emplace_back(section.name);
+			debug_sections = dwarf::build(out.lines, section_names, ctx.files, getcwd(cwd, sizeof(cwd)) ? cwd : ".");
+		}
+		elf::write_object(output_name, layout, ctx.symtab, out, debug_sections);
+		if (use_cache) {
+			const char *size = getenv("JASM_CACHE_SIZE");
+			cache::store(cache_dir, key, output_name, cache::included_files(ctx.program),
+				size ? strtoull(size, nullptr, 10) : DEFAULT_CACHE_SIZE);
+		}
+	}
 
 	// for (const parse::Statement &stmt : stmts) {
 	// 	if (stmt.type != parse::STMTYPE_INSN)
@@ -27,4 +176,3 @@ int main(int argc, char *argv[]) {
 
 	return 0;
 }
-
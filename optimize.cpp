@@ -0,0 +1,106 @@
+#include <cstdint>
+#include <vector>
+#include <variant>
+
+#include "optimize.hpp"
+#include "encode.hpp"
+#include "parse.hpp"
+#include "lex.hpp"
+#include "insns.hpp"
+
+// true if the flags set by statement i can never be read
+// only follows the straight line code after it, anything else counts as a read
+bool flags_dead(const std::vector<parse::Statement> &stmts, size_t i) {
+	for (size_t j = i + 1; j < stmts.size(); j++) {
+		// falling through a label doesn't matter, only where we go next does
+		if (stmts[j].type == parse::STMTYPE_LBL || stmts[j].type == parse::STMTYPE_ASSIGN)
+			continue;
+		if (stmts[j].type != parse::STMTYPE_INSN)
+			return false;
+		insns::FlagUse use = insns::spec(std::get<parse::Instruction>(stmts[j].val).type).flags;
+		if (use == insns::FLAGS_KILL)
+			return true;
+		if (use == insns::FLAGS_USE)
+			return false;
+	}
+	return false;
+}
+
+inline bool is_reg(const parse::Operand &op, lex::RegisterType type) {
+	return op.type == parse::OPTYPE_REG && op.reg.type == type;
+}
+inline bool is_imm(const parse::Operand &op) {
+	return op.type == parse::OPTYPE_IMM;
+}
+inline uint64_t imm_val(const parse::Operand &op) {
+	return op.val;
+}
+// lex::GPRegs64 and lex::GPRegs32 are in the same order
+inline parse::Operand to_reg32(const parse::Operand &op) {
+	lex::GPRegs64 reg = std::get<lex::GPRegs64>(op.reg.reg);
+	return parse::reg_operand(lex::Register { lex::REGTYPE_GPR32, static_cast<lex::GPRegs32>(reg) });
+}
+inline bool same_reg(const parse::Operand &a, const parse::Operand &b) {
+	if (a.type != parse::OPTYPE_REG || b.type != parse::OPTYPE_REG)
+		return false;
+	lex::Register ra = a.reg, rb = b.reg;
+	return ra.type == rb.type && ra.reg == rb.reg;
+}
+
+// returns the rewritten instruction, or the original one if nothing applies
+parse::Instruction rewrite(const std::vector<parse::Statement> &stmts, size_t i) {
+	parse::Instruction insn = std::get<parse::Instruction>(stmts[i].val);
+	if (insn.operands.size() != 2 || insn.lock)
+		return insn;
+	parse::Operand dst = insn.operands[0], src = insn.operands[1];
+	bool dst64 = is_reg(dst, lex::REGTYPE_GPR64);
+	bool dst_wide = dst64 || is_reg(dst, lex::REGTYPE_GPR32) || is_reg(dst, lex::REGTYPE_GPR16);
+
+	// mov reg, 0 -> xor reg, reg (xor r32 also clears the upper half of r64)
+	if (insn.type == lex::MOV && dst_wide && is_imm(src) && imm_val(src) == 0 && flags_dead(stmts, i)) {
+		parse::Operand reg = dst64 ? to_reg32(dst) : dst;
+		return parse::Instruction { lex::XOR, { reg, reg } };
+	}
+	// mov r64, imm -> mov r32, imm32 (writing r32 zero extends)
+	if (insn.type == lex::MOV && dst64 && is_imm(src) && imm_val(src) <= UINT32_MAX)
+		return parse::Instruction { lex::MOV, { to_reg32(dst), src } };
+
+	// xor r64, r64 and sub r64, r64 -> r32 versions, both zero the register
+	// and set flags the same way
+	if ((insn.type == lex::XOR || insn.type == lex::SUB) && dst64 && same_reg(dst, src))
+		return parse::Instruction { insn.type, { to_reg32(dst), to_reg32(dst) } };
+	// and r64, imm -> and r32, imm when the upper half gets cleared anyway
+	if (insn.type == lex::AND && dst64 && is_imm(src) && imm_val(src) <= INT32_MAX)
+		return parse::Instruction { lex::AND, { to_reg32(dst), src } };
+
+	// add reg, 128 -> sub reg, -128 so the immediate fits in a sign extended imm8
+	// carry and overflow come out differently, so flags must be dead
+	if ((insn.type == lex::ADD || insn.type == lex::SUB) && dst_wide && is_imm(src) &&
+			imm_val(src) == 128 && flags_dead(stmts, i)) {
+		parse::Operand neg = parse::imm_operand((uint64_t) -128);
+		return parse::Instruction { insn.type == lex::ADD ? lex::SUB : lex::ADD, { dst, neg } };
+	}
+
+	return insn;
+}
+
+optimize::Report optimize::peephole(parse::Program &program) {
+	std::vector<parse::Statement> &stmts = program.stmts;
+	optimize::Report report = { 0, 0 };
+	for (size_t i = 0; i < stmts.size(); i++) {
+		if (stmts[i].type != parse::STMTYPE_INSN)
+			continue;
+		parse::Instruction &insn = std::get<parse::Instruction>(stmts[i].val);
+		parse::Instruction shorter = rewrite(stmts, i);
+
+		// only keep rewrites that actually save bytes (eg. r8-r15 still need REX)
+		size_t before = encode::encode(insn, stmts[i].line_num).size();
+		size_t after = encode::encode(shorter, stmts[i].line_num).size();
+		if (after >= before)
+			continue;
+		insn = shorter;
+		report.rewritten++;
+		report.bytes_saved += before - after;
+	}
+	return report;
+}
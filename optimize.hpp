@@ -0,0 +1,20 @@
+#ifndef OPTIMIZE_HPP
+#define OPTIMIZE_HPP
+
+#include <cstddef>
+#include <vector>
+
+#include "parse.hpp"
+
+namespace optimize {
+	struct Report {
+		size_t rewritten;
+		size_t bytes_saved;
+	};
+
+	// rewrite instructions into equivalent ones with shorter encodings
+	// runs on statements straight out of parse::parse (immediates already squashed)
+	Report peephole(parse::Program &program);
+}
+
+#endif
@@ -1,28 +1,30 @@
+#include <algorithm>
 #include <cmath>
 #include <cstddef>
 #include <cstdint>
 #include <optional>
 #include <vector>
 #include <string>
-#include <set>
 #include <cassert>
 #include <iostream>
+#include <sys/stat.h>
 
 #include "parse.hpp"
 #include "lex.hpp"
-
-const uint32_t INSN_OPERANDS[] = {
-	2, 2, 1, 1,
-	2, 2, 1, 1, 2, 2,
-	2, 2, 2, 1, 2, 2,
-	1, 1, 1, 1, 1, 1, 1,
-	1, 1, 1, 1,
-	2, 1, 0, 0,
+#include "insns.hpp"
+#include "context.hpp"
+
+// operand form of each lex::RegisterType, control and segment registers can't be operands
+const uint16_t REG_FORMS[] = {
+	insns::FORM_R8, insns::FORM_R16, insns::FORM_R32, insns::FORM_R64,
+	0, 0,
+	insns::FORM_XMM, insns::FORM_YMM,
 };
 const parse::DirOperandType DIR_OPERAND_TYPE[] = {
 	parse::DIROPTYPE_IMM, parse::DIROPTYPE_IMM, parse::DIROPTYPE_IMM, parse::DIROPTYPE_IMM,
 	parse::DIROPTYPE_IMM, parse::DIROPTYPE_IMM, parse::DIROPTYPE_IMM, parse::DIROPTYPE_IMM,
 	parse::DIROPTYPE_SYM, parse::DIROPTYPE_SYM, parse::DIROPTYPE_SYM,
+	parse::DIROPTYPE_BIN, parse::DIROPTYPE_IMM, parse::DIROPTYPE_IMM,
 };
 
 inline lex::Immediate64 val_to_imm64(uint64_t val) {
@@ -32,10 +34,39 @@ inline lex::Immediate64 val_to_imm64(uint64_t val) {
 	else if (val <= UINT32_MAX) size = 32;
 	return lex::Immediate64 { size, val };
 }
+// immediates match every size they fit in, signed or unsigned, and unresolved
+// ones any size, either can be a branch target
+inline uint16_t operand_form(const parse::Operand &operand) {
+	switch (operand.type) {
+		case parse::OPTYPE_REG:
+			return REG_FORMS[operand.reg.type];
+		case parse::OPTYPE_SIB: case parse::OPTYPE_UNRES_SIB:
+			return insns::FORM_M;
+		case parse::OPTYPE_IMM: {
+			uint64_t val = operand.val;
+			uint16_t form = insns::FORM_IMM64 | insns::FORM_REL;
+			// only negative values get the signed range
+			bool negative = (int64_t) val < 0;
+			if (val <= UINT32_MAX || (negative && (int64_t) val >= INT32_MIN))
+				form |= insns::FORM_IMM32;
+			if (val <= UINT8_MAX || (negative && (int64_t) val >= INT8_MIN))
+				form |= insns::FORM_IMM8;
+			return form;
+		}
+		default:
+			return insns::FORM_ANY_IMM | insns::FORM_REL;
+	}
+}
+
 inline bool is_valid_scale(lex::Immediate64 imm) {
 	return imm.val == 1 || imm.val == 2 || imm.val == 4 || imm.val == 8;
 }
 
+// displacements are sign extended from 32 bits
+inline bool fits_disp32(lex::Immediate64 imm) {
+	return (int64_t) imm.val >= INT32_MIN && (int64_t) imm.val <= INT32_MAX;
+}
+
 inline bool is_arithmetic(lex::LexemeType token) {
 	return token == lex::LEXTYPE_ADD_SIGN || token == lex::LEXTYPE_MINUS_SIGN ||
 			token == lex::LEXTYPE_ASTERISK || token == lex::LEXTYPE_SLASH;
@@ -92,18 +123,19 @@ bool parse::check_unres_sib(const std::vector<lex::Lexeme> &tokens) {
 	return is_resolved;
 }
 
+inline bool is_mul_div(lex::LexemeType token) {
+	return token == lex::LEXTYPE_ASTERISK || token == lex::LEXTYPE_SLASH;
+}
+
 // TODO: add support for parentheses
 void parse::squash_immediates(std::vector<lex::Lexeme> &tokens, size_t start, size_t end) {
-	std::vector<bool> nosquash(end - start + 1);
-
 	// first combine multiplications and divisions
-	// mark "unsquashable" (operation with reg or sym)
 	for (size_t i = start; i <= end; i++) {
 		bool is_mul = tokens[i].type == lex::LEXTYPE_ASTERISK;
 		bool is_div = tokens[i].type == lex::LEXTYPE_SLASH;
 		if (is_mul || is_div) {
 			assert(i != 0 && i != end);
-			lex::Lexeme left = tokens[i - 1], right = tokens[i + 1];
+			const lex::Lexeme &left = tokens[i - 1], &right = tokens[i + 1];
 			if (left.type == lex::LEXTYPE_IMM && right.type == lex::LEXTYPE_IMM) {
 				uint64_t o1 = std::get<lex::Immediate64>(left.data).val;
 				uint64_t o2 = std::get<lex::Immediate64>(right.data).val;
@@ -112,53 +144,54 @@ void parse::squash_immediates(std::vector<lex::Lexeme> &tokens, size_t start, si
 				if (is_div) result = o1 / o2;
 				tokens[i + 1].data.emplace<lex::Immediate64>(val_to_imm64(result));
 				tokens.erase(std::next(tokens.begin(), i - 1), std::next(tokens.begin(), i + 1));
-				nosquash.erase(std::next(nosquash.begin(), i - 1), std::next(nosquash.begin(), i + 1));
 				i -= 2, end -= 2;
 				continue;
 			}
-			nosquash[i - 1] = true, nosquash[i] = true, nosquash[i + 1] = true;
 		}	
 	}
 
+	// then add up the immediates that aren't next to what's left of those (an
+	// operation with a reg or sym), moving the other tokens down in place
 	uint64_t total = 0;
-	// store in decreasing order to make deleting elements easier
-	std::set<size_t, std::greater<size_t>> squashed_tokens;
+	bool squashed = false;
+	size_t out = start;
+	lex::LexemeType prev = lex::LEXTYPE_ADD_SIGN;
 	for (size_t i = start; i <= end; i++) {
-		if (nosquash[i] || tokens[i].type != lex::LEXTYPE_IMM)
+		lex::LexemeType type = tokens[i].type;
+		bool nosquash = (i > start && is_mul_div(prev)) || (i < end && is_mul_div(tokens[i + 1].type));
+		if (type == lex::LEXTYPE_IMM && !nosquash) {
+			bool is_add = i == start || prev == lex::LEXTYPE_ADD_SIGN;
+			bool is_sub = i != start && prev == lex::LEXTYPE_MINUS_SIGN;
+			if (!is_add && !is_sub)
+				lex::assemble_error(tokens[i].line_num, "invalid calculation");
+			if (is_add)
+				total += std::get<lex::Immediate64>(tokens[i].data).val;
+			if (is_sub)
+				total -= std::get<lex::Immediate64>(tokens[i].data).val;
+			// the sign in front of it goes too
+			if (i != start)
+				out--;
+			squashed = true;
+			prev = type;
 			continue;
-
-		bool is_add, is_sub;
-		if (i == start)
-			is_add = true, is_sub = false;
-		else {
-			lex::LexemeType prev = tokens[i - 1].type;
-			is_add = prev == lex::LEXTYPE_ADD_SIGN;
-			is_sub = prev == lex::LEXTYPE_MINUS_SIGN;
 		}
-
-		if (!is_add && !is_sub)
-			lex::assemble_error(tokens[i].line_num, "invalid calculation");
-		if (is_add)
-			total += std::get<lex::Immediate64>(tokens[i].data).val;
-		if (is_sub)
-			total -= std::get<lex::Immediate64>(tokens[i].data).val;
-
-		if (i != start)
-			squashed_tokens.insert(i - 1);
-		squashed_tokens.insert(i);
+		prev = type;
+		if (out != i)
+			tokens[out] = std::move(tokens[i]);
+		out++;
 	}
 
-	if (squashed_tokens.empty())
+	if (!squashed)
 		return;
 
-	for (const size_t &index : squashed_tokens)
-		tokens.erase(tokens.begin() + index);
+	tokens.erase(std::next(tokens.begin(), out), std::next(tokens.begin(), end + 1));
 
 	tokens.insert(std::next(tokens.begin(), start), lex::Lexeme {
 		lex::LEXTYPE_IMM, tokens[0].line_num, val_to_imm64(total)
 	});
 
-	if (tokens.size() <= start + 1 || is_arithmetic(tokens[start + 1].type))
+	if (tokens.size() <= start + 1 || is_arithmetic(tokens[start + 1].type) ||
+			tokens[start + 1].type == lex::LEXTYPE_CLOSE_BRACKET)
 		return;
 
 	tokens.insert(std::next(tokens.begin(), start + 1), lex::Lexeme {
@@ -172,27 +205,36 @@ parse::ScaledIndexByte parse::parse_sib(const std::vector<lex::Lexeme> &tokens)
 	// base (GPR) + index (GPR) * scale (Imm{1,2,4,8}) + displacement (Imm32)
 	// operands must have no symbols (in parse::parse they become parse::Unresolved)
 	
-	std::vector<bool> processed(tokens.size());
+	// a valid one is far shorter than this
+	if (tokens.size() > 64)
+		lex::assemble_error(tokens[0].line_num, "invalid SIB expression");
+	uint64_t processed = 0;
+	auto process = [&](uint32_t i) {
+		processed |= (uint64_t) 7 << (i - 1);
+	};
+	auto is_processed = [&](uint32_t i) {
+		return (processed >> i) & 1;
+	};
 	for (uint32_t i = 1; i < tokens.size() - 1; i++) {
 		if (tokens[i].type == lex::LEXTYPE_ASTERISK) {
 			if (sib.index != std::nullopt || sib.scale != std::nullopt)
 				lex::assemble_error(tokens[i].line_num, "invalid SIB expression");
 
-			lex::Lexeme left = tokens[i - 1], right = tokens[i + 1];
-			processed[i - 1] = true, processed[i] = true, processed[i + 1] = true;
+			const lex::Lexeme &left = tokens[i - 1], &right = tokens[i + 1];
+			process(i);
 	
 			if (left.type == lex::LEXTYPE_REG && right.type == lex::LEXTYPE_IMM) {
 				if (!is_valid_scale(std::get<lex::Immediate64>(right.data)))
 					lex::assemble_error(left.line_num, "invalid SIB scale");
 				sib.index = std::get<lex::Register>(left.data);
-				sib.scale = std::get<lex::Immediate64>(right.data).val;
+				sib.scale = (uint8_t) std::get<lex::Immediate64>(right.data).val;
 				continue;
 			}
 			if (left.type == lex::LEXTYPE_IMM && right.type == lex::LEXTYPE_REG) {
 				if (!is_valid_scale(std::get<lex::Immediate64>(left.data)))
 					lex::assemble_error(left.line_num, "invalid SIB scale");
 				sib.index = std::get<lex::Register>(right.data);
-				sib.scale = std::get<lex::Immediate64>(left.data).val;
+				sib.scale = (uint8_t) std::get<lex::Immediate64>(left.data).val;
 				continue;
 			}
 
@@ -205,6 +247,16 @@ parse::ScaledIndexByte parse::parse_sib(const std::vector<lex::Lexeme> &tokens)
 		lex::assemble_error(tokens[i].line_num, "invalid SIB expression");
 	}
 
+	// a lone register or displacement, eg. [rbx] or [5000]
+	if (tokens.size() == 3 && tokens[1].type == lex::LEXTYPE_REG)
+		sib.base = std::get<lex::Register>(tokens[1].data);
+	if (tokens.size() == 3 && tokens[1].type == lex::LEXTYPE_IMM) {
+		lex::Immediate64 imm = std::get<lex::Immediate64>(tokens[1].data);
+		if (!fits_disp32(imm))
+			lex::assemble_error(tokens[1].line_num, "displacement larger than 32 bits");
+		sib.disp = imm.val;
+	}
+
 	// when adjacent to plus sign (+):
 	// first unprocessed register is the base
 	// first unprocessed immediate is the displacement
@@ -212,9 +264,9 @@ parse::ScaledIndexByte parse::parse_sib(const std::vector<lex::Lexeme> &tokens)
 	// anything else = error
 	for (uint32_t i = 1; i < tokens.size() - 1; i++) {
 		if (tokens[i].type == lex::LEXTYPE_ADD_SIGN) {
-			lex::Lexeme left = tokens[i - 1], right = tokens[i + 1];
+			const lex::Lexeme &left = tokens[i - 1], &right = tokens[i + 1];
 
-			if (left.type == lex::LEXTYPE_REG && !processed[i - 1]) {
+			if (left.type == lex::LEXTYPE_REG && !is_processed(i - 1)) {
 				if (sib.base == std::nullopt)
 					sib.base = std::get<lex::Register>(left.data);
 				else if (sib.index == std::nullopt)
@@ -222,7 +274,7 @@ parse::ScaledIndexByte parse::parse_sib(const std::vector<lex::Lexeme> &tokens)
 				else
 					lex::assemble_error(left.line_num, "invalid SIB expression");
 			}
-			if (right.type == lex::LEXTYPE_REG && !processed[i + 1]) {
+			if (right.type == lex::LEXTYPE_REG && !is_processed(i + 1)) {
 				if (sib.base == std::nullopt)
 					sib.base = std::get<lex::Register>(right.data);
 				else if (sib.index == std::nullopt)
@@ -230,24 +282,24 @@ parse::ScaledIndexByte parse::parse_sib(const std::vector<lex::Lexeme> &tokens)
 				else
 					lex::assemble_error(left.line_num, "invalid SIB expression");
 			}
-			if (left.type == lex::LEXTYPE_IMM && !processed[i - 1]) {
+			if (left.type == lex::LEXTYPE_IMM && !is_processed(i - 1)) {
 				assert(sib.disp == std::nullopt);
 				lex::Immediate64 imm = std::get<lex::Immediate64>(left.data);
-				if (imm.size <= 32)
+				if (fits_disp32(imm))
 					sib.disp = imm.val;
 				else
 					lex::assemble_error(left.line_num, "displacement larger than 32 bits");
 			}
-			if (right.type == lex::LEXTYPE_IMM && !processed[i + 1]) {
+			if (right.type == lex::LEXTYPE_IMM && !is_processed(i + 1)) {
 				assert(sib.disp == std::nullopt);
 				lex::Immediate64 imm = std::get<lex::Immediate64>(right.data);
-				if (imm.size <= 32)
+				if (fits_disp32(imm))
 					sib.disp = imm.val;
 				else
 					lex::assemble_error(left.line_num, "displacement larger than 32 bits");
 			}
 	
-			processed[i - 1] = true, processed[i] = true, processed[i + 1] = true;
+			process(i);
 
 			if ((left.type != lex::LEXTYPE_IMM && left.type != lex::LEXTYPE_REG) ||
 					(right.type != lex::LEXTYPE_IMM && right.type != lex::LEXTYPE_REG)) {
@@ -258,208 +310,391 @@ parse::ScaledIndexByte parse::parse_sib(const std::vector<lex::Lexeme> &tokens)
 	return sib;
 }
 
-std::vector<parse::Statement> parse::parse(const std::vector<std::vector<lex::Lexeme>> &tokens) {
-	std::vector<parse::Statement> stmts;
-	for (std::vector<lex::Lexeme> ltokens : tokens) {
-		assert(!ltokens.empty());
-		if (ltokens[0].type == lex::LEXTYPE_INSN) {
-			std::vector<std::vector<lex::Lexeme>> operands;
-			if (ltokens.size() >= 2)
-				operands.emplace_back(std::vector<lex::Lexeme>());
-			for (uint32_t i = 1; i < ltokens.size(); i++) {
-				if (ltokens[i].type == lex::LEXTYPE_COMMA) {
-					if (operands.back().empty())
-						lex::assemble_error(ltokens[i].line_num, "invalid use of commas");
-					operands.emplace_back(std::vector<lex::Lexeme>());
-					continue;
-				}
-				operands.back().emplace_back(ltokens[i]);
-			}
-			if (INSN_OPERANDS[std::get<lex::Instruction>(ltokens[0].data)] != operands.size())
-				lex::assemble_error(ltokens[0].line_num, "invalid number of operands");
-			
-			parse::Instruction insn = {
-				std::get<lex::Instruction>(ltokens[0].data),
-				std::vector<parse::Operand>(operands.size()),
-			};
+// split the tokens starting at start into comma separated operands
+void parse::split_operands(const std::vector<lex::Lexeme> &tokens, size_t start, std::vector<parse::TokenRange> &ranges) {
+	ranges.clear();
+	if (tokens.size() > start)
+		ranges.emplace_back(parse::TokenRange { start, start });
+	for (size_t i = start; i < tokens.size(); i++) {
+		if (tokens[i].type == lex::LEXTYPE_COMMA) {
+			if (ranges.back().begin == i)
+				lex::assemble_error(tokens[i].line_num, "invalid use of commas");
+			ranges.emplace_back(parse::TokenRange { i + 1, i + 1 });
+			continue;
+		}
+		ranges.back().end = i + 1;
+	}
+	if (!ranges.empty() && ranges.back().begin == ranges.back().end)
+		lex::assemble_error(tokens[0].line_num, "invalid use of commas");
+}
+
+// one operand of db/dw/dd/dq/resb/resw/resd/resq or the count of times, the tokens
+// from begin to end, into out. ops is a buffer for squashing them, a lone token is
+// read where it is
+void parse_imm_dir_operand(const lex::Lexeme *begin, const lex::Lexeme *end, std::vector<lex::Lexeme> &ops,
+		lex::Directive dirtype, parse::DirOperand &out) {
+	const lex::Lexeme *single = begin;
+	if (end - begin != 1) {
+		ops.assign(begin, end);
+		parse::squash_immediates(ops, 0, ops.size() - 1);
+		single = ops.size() == 1 ? &ops[0] : nullptr;
+	}
+	if (single) {
+		if (dirtype == lex::DB && single->type == lex::LEXTYPE_STR_LIT) {
+			out.type = parse::DIROPTYPE_STR_LIT;
+			lex::reuse<std::string>(out.val) = std::get<std::string>(single->data);
+			return;
+		}
+		if (single->type == lex::LEXTYPE_IMM) {
+			out.type = parse::DIROPTYPE_IMM;
+			out.val = std::get<lex::Immediate64>(single->data).val;
+			return;
+		}
+		// a lone symbol or $ is resolved along with the other expressions
+		if (single->type != lex::LEXTYPE_SYMBOL && single->type != lex::LEXTYPE_DOLLAR)
+			lex::assemble_error(single->line_num, "invalid directive operand");
+		out.type = parse::DIROPTYPE_UNRES_IMM;
+		lex::reuse<parse::Unresolved>(out.val).assign(single, single + 1);
+		return;
+	}
+	// this should catch any illegal expressions
+	parse::check_unres_imm(ops);
+	out.type = parse::DIROPTYPE_UNRES_IMM;
+	lex::reuse<parse::Unresolved>(out.val) = ops;
+}
+
+// incbin "file"[, offset[, length]]
+// offset and length must be known now so the size of the blob is fixed.
+// ops is a buffer for squashing them
+void parse_incbin(const std::vector<lex::Lexeme> &tokens, const std::vector<parse::TokenRange> &operands,
+		uint32_t line_num, std::vector<lex::Lexeme> &ops, parse::DirOperand &out) {
+	if (operands.size() > 3)
+		lex::assemble_error(line_num, "too many operands for incbin");
+	const lex::Lexeme &name = tokens[operands[0].begin];
+	if (operands[0].end - operands[0].begin != 1 || name.type != lex::LEXTYPE_STR_LIT)
+		lex::assemble_error(line_num, "incbin file name must be a string literal");
+
+	uint64_t args[2] = { 0, UINT64_MAX };
+	for (size_t i = 1; i < operands.size(); i++) {
+		ops.assign(tokens.begin() + operands[i].begin, tokens.begin() + operands[i].end);
+		parse::squash_immediates(ops, 0, ops.size() - 1);
+		if (ops.size() != 1 || ops[0].type != lex::LEXTYPE_IMM)
+			lex::assemble_error(line_num, "incbin offset and length must be constant");
+		args[i - 1] = std::get<lex::Immediate64>(ops[0].data).val;
+	}
+
+	const std::string &file_name = std::get<std::string>(name.data);
+	struct stat st;
+	if (stat(file_name.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+		lex::assemble_error(line_num, "cannot open incbin file " + file_name);
+
+	uint64_t file_size = st.st_size;
+	if (args[0] > file_size)
+		lex::assemble_error(line_num, "incbin offset past end of file");
+	if (args[1] == UINT64_MAX)
+		args[1] = file_size - args[0];
+	else if (args[1] > file_size - args[0])
+		lex::assemble_error(line_num, "incbin length past end of file");
+
+	out.type = parse::DIROPTYPE_BIN;
+	parse::IncludedBinary &bin = lex::reuse<parse::IncludedBinary>(out.val);
+	bin.file_name = file_name;
+	bin.offset = args[0];
+	bin.length = args[1];
+}
 
-			for (uint32_t i = 0; i < operands.size(); i++) {
-				std::vector<lex::Lexeme> ops = operands[i];
-				assert(!ops.empty());
+// the slot of name in the index, or the empty one it would go in
+inline uint32_t &name_slot(std::vector<uint32_t> &index, const parse::Pool<std::string> &names, const std::string &name) {
+	size_t mask = index.size() - 1;
+	for (size_t i = std::hash<std::string>()(name) & mask;; i = (i + 1) & mask) {
+		if (index[i] == 0 || names[index[i] - 1] == name)
+			return index[i];
+	}
+}
+
+uint32_t parse::add_name(parse::Program &program, const std::string &name) {
+	std::vector<uint32_t> &index = program.name_index;
+	// kept at most half full, growing puts every name in again
+	if (2 * (program.names.size() + 1) > index.size()) {
+		index.assign(std::max<size_t>(2 * index.size(), 64), 0);
+		for (uint32_t i = 0; i < program.names.size(); i++)
+			name_slot(index, program.names, program.names[i]) = i + 1;
+	}
+	uint32_t &slot = name_slot(index, program.names, name);
+	if (slot == 0) {
+		program.names.emplace_back(name);
+		slot = program.names.size();
+	}
+	return slot - 1;
+}
+
+void parse::clear(parse::Program &program) {
+	program.stmts.clear();
+	program.names.clear();
+	std::fill(program.name_index.begin(), program.name_index.end(), 0);
+	program.exprs.clear();
+	program.directives.clear();
+	program.assignments.clear();
+	program.repeats.clear();
+}
+
+// anything but an instruction goes in the program's list for its type,
+// this is the statement for the element last added to it
+template <typename T>
+inline parse::Statement last_of(const parse::Pool<T> &list, parse::StatementType type, unsigned line_num) {
+	return parse::Statement { type, (uint32_t) (list.size() - 1), line_num };
+}
+// the next directive of the program, with no operands yet
+inline parse::Directive &add_directive(parse::Program &program, lex::Directive type) {
+	parse::Directive &dir = program.directives.next();
+	dir.type = type;
+	dir.operands.clear();
+	return dir;
+}
 
+// registers of an unresolved memory operand, with every symbol standing in as 0.
+// rewrites tokens
+parse::ScaledIndexByte sib_registers(parse::Unresolved &tokens) {
+	for (lex::Lexeme &token : tokens) {
+		if (token.type == lex::LEXTYPE_SYMBOL)
+			token = lex::Lexeme { lex::LEXTYPE_IMM, token.line_num, lex::Immediate64 { 32, 0 } };
+	}
+	parse::squash_immediates(tokens, 1, tokens.size() - 2);
+	return parse::parse_sib(tokens);
+}
+
+parse::Statement parse::parse_statement(context::AssemblerContext &ctx, const std::vector<lex::Lexeme> &tokens, size_t start) {
+	assert(tokens.size() > start);
+	parse::Program &program = ctx.program;
+	const lex::Lexeme *ltokens = tokens.data() + start;
+	size_t size = tokens.size() - start;
+	// the hardware only allows lock on read-modify-write instructions writing to memory
+	if (ltokens[0].type == lex::LEXTYPE_LOCK) {
+		if (size < 2 || ltokens[1].type != lex::LEXTYPE_INSN)
+			lex::assemble_error(ltokens[0].line_num, "lock must be followed by an instruction");
+		parse::Statement stmt = parse::parse_statement(ctx, tokens, start + 1);
+		parse::Instruction &insn = std::get<parse::Instruction>(stmt.val);
+		if (!insns::spec(insn.type).lockable)
+			lex::assemble_error(ltokens[0].line_num, "instruction cannot be locked");
+		if (operand_form(insn.operands[0]) != insns::FORM_M)
+			lex::assemble_error(ltokens[0].line_num, "lock needs a memory destination");
+		insn.lock = true;
+		return stmt;
+	}
+
+	std::vector<parse::TokenRange> &operands = ctx.operand_ranges;
+	if (ltokens[0].type == lex::LEXTYPE_INSN) {
+		parse::split_operands(tokens, start + 1, operands);
+		const insns::Spec &spec = insns::spec(std::get<lex::Instruction>(ltokens[0].data));
+		if (spec.operands != operands.size())
+			lex::assemble_error(ltokens[0].line_num, "invalid number of operands");
+		
+		parse::Instruction insn = { std::get<lex::Instruction>(ltokens[0].data), {} };
+		insn.operands.count = operands.size();
+
+		for (uint32_t i = 0; i < operands.size(); i++) {
+			// squashing rewrites the tokens, so each operand is copied to a buffer that is
+			// kept. a lone token has nothing to squash and is read where it is, which also
+			// keeps symbols from taking the place of the strings in the buffer
+			std::vector<lex::Lexeme> &ops = ctx.operand;
+			const lex::Lexeme *single = nullptr;
+			if (operands[i].end - operands[i].begin == 1)
+				single = &tokens[operands[i].begin];
+			else {
+				ops.assign(tokens.begin() + operands[i].begin, tokens.begin() + operands[i].end);
 				if (ops.front().type == lex::LEXTYPE_OPEN_BRACKET &&
 						ops.back().type == lex::LEXTYPE_CLOSE_BRACKET) {
 					parse::squash_immediates(ops, 1, ops.size() - 2);
 				}
 				else
 					parse::squash_immediates(ops, 0, ops.size() - 1);
+				if (ops.size() == 1)
+					single = &ops[0];
+			}
 
-				if (ops.size() == 1) {
-					if (ops[0].type == lex::LEXTYPE_REG)
-						insn.operands[i] = { parse::OPTYPE_REG, std::get<lex::Register>(ops[0].data) };
-					else if (ops[0].type == lex::LEXTYPE_IMM)
-						insn.operands[i] = { parse::OPTYPE_IMM, std::get<lex::Immediate64>(ops[0].data) };
-					else if (ops[0].type == lex::LEXTYPE_SYMBOL)
-						insn.operands[i] = { parse::OPTYPE_SYM, std::get<std::string>(ops[0].data) };
-					else
-						lex::assemble_error(ops[0].line_num, "invalid operand");
-					continue;
-				}
+			if (single) {
+				if (single->type == lex::LEXTYPE_REG)
+					insn.operands[i] = parse::reg_operand(std::get<lex::Register>(single->data));
+				else if (single->type == lex::LEXTYPE_IMM)
+					insn.operands[i] = parse::imm_operand(std::get<lex::Immediate64>(single->data).val);
+				else if (single->type == lex::LEXTYPE_SYMBOL)
+					insn.operands[i] = { parse::OPTYPE_SYM, {}, {}, 0, parse::add_name(program, std::get<std::string>(single->data)) };
+				else
+					lex::assemble_error(single->line_num, "invalid operand");
+				continue;
+			}
 
-				// SIB, possibly unresolved
-				if (ops.front().type == lex::LEXTYPE_OPEN_BRACKET &&
-						ops.back().type == lex::LEXTYPE_CLOSE_BRACKET) {
-					// checking of the current operand eventually works out to a valid SIB expression
-					// right now is too hard, so we'll just shove it in as an unresolved and check if
-					// it's valid after resolving the symbols after the first assembler pass
-					if (parse::check_unres_sib(ops))
-						insn.operands[i] = { parse::OPTYPE_SIB, parse::parse_sib(ops) };
-					else
-						insn.operands[i] = { parse::OPTYPE_UNRES_SIB, ops };
-					continue;
+			// SIB, possibly unresolved
+			if (ops.front().type == lex::LEXTYPE_OPEN_BRACKET &&
+					ops.back().type == lex::LEXTYPE_CLOSE_BRACKET) {
+				// checking of the current operand eventually works out to a valid SIB expression
+				// right now is too hard, so we'll just shove it in as an unresolved and check if
+				// it's valid after resolving the symbols after the first assembler pass
+				if (parse::check_unres_sib(ops))
+					insn.operands[i] = parse::mem_operand(parse::parse_sib(ops));
+				else {
+					uint64_t expr = program.exprs.size();
+					program.exprs.emplace_back(ops);
+					insn.operands[i] = parse::mem_operand(sib_registers(ops));
+					insn.operands[i].type = parse::OPTYPE_UNRES_SIB;
+					insn.operands[i].val = expr;
 				}
-
-				// unresolved immediate
-				parse::check_unres_imm(ops);
-				insn.operands[i] = { parse::OPTYPE_UNRES_IMM, ops };
+				continue;
 			}
 
-			stmts.emplace_back(parse::Statement { parse::STMTYPE_INSN, insn });
-			continue;
+			// unresolved immediate
+			parse::check_unres_imm(ops);
+			insn.operands[i] = { parse::OPTYPE_UNRES_IMM, {}, {}, 0, program.exprs.size() };
+			program.exprs.emplace_back(ops);
 		}
 
-		if (ltokens[0].type == lex::LEXTYPE_SYMBOL) {
-			if (ltokens.size() < 2)
-				lex::assemble_error(ltokens[0].line_num, "label must be followed by colon");
-			if (ltokens.size() == 2 && ltokens[1].type == lex::LEXTYPE_COLON) {
-				stmts.emplace_back(parse::Statement {
-					parse::STMTYPE_LBL,
-					std::get<std::string>(ltokens[0].data)
-				});
+		for (uint32_t i = 0; i < operands.size(); i++) {
+			uint16_t form = operand_form(insn.operands[i]);
+			if (form & spec.forms[i])
 				continue;
-			}
-			if (ltokens[1].type == lex::LEXTYPE_EQU) {
-				if (ltokens.size() < 3)
-					lex::assemble_error(ltokens[0].line_num, "not enough operands for EQU");
-				
-				parse::squash_immediates(ltokens, 2, ltokens.size() - 1);
-				
-				if (ltokens.size() == 3) {
-					if (ltokens[2].type == lex::LEXTYPE_IMM) {
-						stmts.emplace_back(parse::Statement {
-							parse::STMTYPE_ASSIGN,
-							parse::Assignment {
-								std::get<std::string>(ltokens[0].data),
-								true, std::get<lex::Immediate64>(ltokens[2].data).val
-							}
-						});
-					}
-					else if (ltokens[2].type == lex::LEXTYPE_STR_LIT) {
-						std::string lit = std::get<std::string>(ltokens[2].data);
-						if (lit.size() > 8)
-							lex::assemble_error(ltokens[0].line_num, "string literal too large to fit in quadword");
-						// x86 is little endian -- least significant byte is first
-						// in a string, the first character is the least significnat
-						uint64_t val = 0;
-						for (size_t i = 0; i < lit.size(); i++)
-							val |= lit[i] << (i * 8);
-						stmts.emplace_back(parse::Statement {
-							parse::STMTYPE_ASSIGN,
-							parse::Assignment {
-								std::get<std::string>(ltokens[0].data),
-								true, val
-							}
-						});
-					}
-					else
-						lex::assemble_error(ltokens[0].line_num, "cannot assign operand");
-					continue;
-				}
+			if ((form & insns::FORM_ANY_IMM) && (spec.forms[i] & insns::FORM_ANY_IMM))
+				lex::assemble_error(ltokens[0].line_num, "immediate out of range");
+			lex::assemble_error(ltokens[0].line_num, "invalid combination of operands");
+		}
 
-				parse::check_unres_imm(ltokens, 2, ltokens.size() - 1);
-				stmts.emplace_back(parse::Statement {
-					parse::STMTYPE_ASSIGN,
-					parse::Assignment {
-						std::get<std::string>(ltokens[0].data),
-						false, std::vector<lex::Lexeme>(std::next(ltokens.begin(), 2), ltokens.end())
-					}
-				});
-				continue;
+		return parse::Statement { parse::STMTYPE_INSN, insn, ltokens[0].line_num };
+	}
+
+	if (ltokens[0].type == lex::LEXTYPE_SYMBOL) {
+		if (size < 2)
+			lex::assemble_error(ltokens[0].line_num, "label must be followed by colon");
+		if (size == 2 && ltokens[1].type == lex::LEXTYPE_COLON) {
+			return parse::Statement {
+				parse::STMTYPE_LBL,
+				parse::add_name(program, std::get<std::string>(ltokens[0].data)),
+				ltokens[0].line_num
+			};
+		}
+		if (ltokens[1].type == lex::LEXTYPE_EQU) {
+			if (size < 3)
+				lex::assemble_error(ltokens[0].line_num, "not enough operands for EQU");
+			
+			std::vector<lex::Lexeme> &expr = ctx.operand;
+			expr.assign(ltokens + 2, ltokens + size);
+			parse::squash_immediates(expr, 0, expr.size() - 1);
+			parse::Assignment &equ = program.assignments.next();
+			equ.symbol = std::get<std::string>(ltokens[0].data);
+			
+			if (expr.size() == 1) {
+				if (expr[0].type == lex::LEXTYPE_IMM) {
+					equ.is_resolved = true;
+					equ.val = std::get<lex::Immediate64>(expr[0].data).val;
+					return last_of(program.assignments, parse::STMTYPE_ASSIGN, ltokens[0].line_num);
+				}
+				if (expr[0].type == lex::LEXTYPE_STR_LIT) {
+					const std::string &lit = std::get<std::string>(expr[0].data);
+					if (lit.size() > 8)
+						lex::assemble_error(ltokens[0].line_num, "string literal too large to fit in quadword");
+					// x86 is little endian -- least significant byte is first
+					// in a string, the first character is the least significnat
+					uint64_t val = 0;
+					for (size_t i = 0; i < lit.size(); i++)
+						val |= lit[i] << (i * 8);
+					equ.is_resolved = true;
+					equ.val = val;
+					return last_of(program.assignments, parse::STMTYPE_ASSIGN, ltokens[0].line_num);
+				}
+				lex::assemble_error(ltokens[0].line_num, "cannot assign operand");
 			}
-			lex::assemble_error(ltokens[0].line_num, "invalid use of symbols");
+
+			parse::check_unres_imm(expr);
+			equ.is_resolved = false;
+			lex::reuse<std::vector<lex::Lexeme>>(equ.val) = expr;
+			return last_of(program.assignments, parse::STMTYPE_ASSIGN, ltokens[0].line_num);
 		}
+		lex::assemble_error(ltokens[0].line_num, "invalid use of symbols");
+	}
 
-		if (ltokens[0].type == lex::LEXTYPE_DIRECTIVE) {
-			if (ltokens.size() == 1)
-				lex::assemble_error(ltokens[0].line_num, "not enough operands for directive");
-
-			lex::Directive dirtype = std::get<lex::Directive>(ltokens[0].data);
-			parse::DirOperandType optype = DIR_OPERAND_TYPE[dirtype];
-			if (optype == parse::DIROPTYPE_SYM) {
-				if (ltokens.size() != 2 || ltokens[1].type != lex::LEXTYPE_SYMBOL)
-					lex::assemble_error(ltokens[0].line_num, "invalid directive operand");
-				stmts.emplace_back(parse::Statement {
-					parse::STMTYPE_DIR,
-					parse::Directive {
-						dirtype,
-						parse::DirOperand {
-							parse::DIROPTYPE_SYM,
-							std::get<std::string>(ltokens[1].data)
-						}
-					}
-				});
-				continue;
+	if (ltokens[0].type == lex::LEXTYPE_DIRECTIVE) {
+		if (size == 1)
+			lex::assemble_error(ltokens[0].line_num, "not enough operands for directive");
+
+		lex::Directive dirtype = std::get<lex::Directive>(ltokens[0].data);
+
+		// times count statement
+		// count is everything up to the instruction or directive being repeated
+		if (dirtype == lex::TIMES) {
+			size_t body_start;
+			for (body_start = 1; body_start < size; body_start++) {
+				if (ltokens[body_start].type == lex::LEXTYPE_INSN ||
+						ltokens[body_start].type == lex::LEXTYPE_LOCK ||
+						ltokens[body_start].type == lex::LEXTYPE_DIRECTIVE)
+					break;
 			}
+			if (body_start == 1 || body_start == size)
+				lex::assemble_error(ltokens[0].line_num, "times must be followed by a count and a statement");
 
-			assert(optype == parse::DIROPTYPE_IMM);
-
-			// number directive operand
-			parse::squash_immediates(ltokens, 1, ltokens.size() - 1);
-			if (ltokens.size() == 2) {
-				if (dirtype == lex::DB && ltokens[1].type == lex::LEXTYPE_STR_LIT) {
-					stmts.emplace_back(parse::Statement {
-						parse::STMTYPE_DIR,
-						parse::Directive {
-							dirtype,
-							parse::DirOperand {
-								parse::DIROPTYPE_STR_LIT,
-								std::get<std::string>(ltokens[1].data)
-							}
-						}
-					});
-					continue;
-				}
-				if (ltokens[1].type != lex::LEXTYPE_IMM)
-					lex::assemble_error(ltokens[0].line_num, "invalid directive operand");
-				stmts.emplace_back(parse::Statement {
-					parse::STMTYPE_DIR,
-					parse::Directive {
-						dirtype,
-						parse::DirOperand {
-							parse::DIROPTYPE_IMM,
-							std::get<lex::Immediate64>(ltokens[1].data).val
-						}
-					}
-				});
-				continue;
-			}
+			parse::Statement body = parse::parse_statement(ctx, tokens, start + body_start);
+			if (body.type == parse::STMTYPE_DIR && parse::directive(program, body).type > lex::RESQ)
+				lex::assemble_error(ltokens[0].line_num, "times can only repeat instructions and data");
 
-			// this should catch any illegal expressions
-			parse::check_unres_imm(ltokens);
-			stmts.emplace_back(parse::Statement {
-				parse::STMTYPE_DIR,
-				parse::Directive {
-					dirtype,
-					parse::DirOperand {
-						parse::DIROPTYPE_UNRES_IMM,
-						std::vector<lex::Lexeme>(std::next(ltokens.begin()), ltokens.end())
-					}
-				}
-			});
+			parse::Repeat &repeat = program.repeats.next();
+			parse_imm_dir_operand(ltokens + 1, ltokens + body_start, ctx.operand, lex::TIMES, repeat.count);
+			repeat.body = body;
+			return last_of(program.repeats, parse::STMTYPE_TIMES, ltokens[0].line_num);
 		}
 
-		lex::assemble_error(ltokens[0].line_num, "line must start with instruction, directive or label");
+		parse::split_operands(tokens, start + 1, operands);
+		parse::DirOperandType optype = DIR_OPERAND_TYPE[dirtype];
+		if (optype == parse::DIROPTYPE_SYM) {
+			if (size != 2 || ltokens[1].type != lex::LEXTYPE_SYMBOL)
+				lex::assemble_error(ltokens[0].line_num, "invalid directive operand");
+			parse::DirOperand &op = add_directive(program, dirtype).operands.next();
+			op.type = parse::DIROPTYPE_SYM;
+			lex::reuse<std::string>(op.val) = std::get<std::string>(ltokens[1].data);
+			return last_of(program.directives, parse::STMTYPE_DIR, ltokens[0].line_num);
+		}
+		if (optype == parse::DIROPTYPE_BIN) {
+			parse_incbin(tokens, operands, ltokens[0].line_num, ctx.operand, add_directive(program, dirtype).operands.next());
+			return last_of(program.directives, parse::STMTYPE_DIR, ltokens[0].line_num);
+		}
+
+		assert(optype == parse::DIROPTYPE_IMM);
+
+		// align boundary[, fill byte], boundary must be known now to lay out the section
+		if (dirtype == lex::ALIGN) {
+			if (operands.size() > 2)
+				lex::assemble_error(ltokens[0].line_num, "too many operands for align");
+			parse::Directive &dir = add_directive(program, dirtype);
+			for (const parse::TokenRange &ops : operands) {
+				parse_imm_dir_operand(tokens.data() + ops.begin, tokens.data() + ops.end, ctx.operand, dirtype, dir.operands.next());
+				if (dir.operands.back().type != parse::DIROPTYPE_IMM)
+					lex::assemble_error(ltokens[0].line_num, "align operands must be constant");
+			}
+			uint64_t boundary = std::get<uint64_t>(dir.operands[0].val);
+			if (boundary == 0 || (boundary & (boundary - 1)) != 0)
+				lex::assemble_error(ltokens[0].line_num, "align boundary must be a power of 2");
+			if (dir.operands.size() == 2 && std::get<uint64_t>(dir.operands[1].val) > UINT8_MAX)
+				lex::assemble_error(ltokens[0].line_num, "align fill must be a byte");
+			return last_of(program.directives, parse::STMTYPE_DIR, ltokens[0].line_num);
+		}
+
+		// number directive operands, only db/dw/dd/dq accept a list
+		if (operands.size() > 1 && dirtype > lex::DQ)
+			lex::assemble_error(ltokens[0].line_num, "too many operands for directive");
+
+		parse::Directive &dir = add_directive(program, dirtype);
+		for (const parse::TokenRange &ops : operands) {
+			parse_imm_dir_operand(tokens.data() + ops.begin, tokens.data() + ops.end, ctx.operand, dirtype, dir.operands.next());
+		}
+		return last_of(program.directives, parse::STMTYPE_DIR, ltokens[0].line_num);
 	}
-	return stmts;
+
+	lex::assemble_error(ltokens[0].line_num, "line must start with instruction, directive or label");
 }
 
+void parse::parse(context::AssemblerContext &ctx, uint32_t file) {
+	parse::Program &program = ctx.program;
+	program.stmts.reserve(program.stmts.size() + ctx.lines);
+	for (size_t line = 0; line < ctx.lines; line++) {
+		program.stmts.emplace_back(parse::parse_statement(ctx, ctx.tokens[line], 0));
+		program.stmts.back().file = file;
+		if (program.stmts.back().type == parse::STMTYPE_TIMES)
+			program.repeats.back().body.file = file;
+	}
+}
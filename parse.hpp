@@ -2,11 +2,17 @@
 #define PARSE_HPP
 
 #include "lex.hpp"
+#include <cstddef>
 #include <cstdint>
+#include <initializer_list>
 #include <optional>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 namespace parse {
-	enum OperandType {
+	enum OperandType : uint8_t {
 		OPTYPE_SIB,
 		OPTYPE_REG,
 		OPTYPE_IMM,
@@ -16,19 +22,109 @@ namespace parse {
 	};
 	struct ScaledIndexByte {
 		std::optional<lex::Register> base, index;
-		std::optional<uint32_t> disp, scale; 
+		std::optional<uint32_t> disp;
+		std::optional<uint8_t> scale;
 	};
 	// symbols that are not yet resolved are represented as a vector
 	typedef std::vector<lex::Lexeme> Unresolved;
+	// parts of a memory operand that are there, the scale goes in the bits above
+	enum MemoryParts : uint8_t {
+		MEM_BASE = 1,
+		MEM_INDEX = 2,
+		MEM_DISP = 4,
+	};
+	// 16 bytes, which fields are used depends on the type
 	struct Operand {
 		OperandType type;
-		std::variant<ScaledIndexByte, lex::Register, lex::Immediate64, std::string, Unresolved> val;
+		// OPTYPE_REG: the register, memory operands: the base
+		lex::Register reg;
+		// memory operands: the index
+		lex::Register index;
+		// memory operands: MemoryParts and the scale (0 if there is none)
+		uint8_t mem;
+		// OPTYPE_IMM: the immediate, OPTYPE_SIB: the displacement,
+		// OPTYPE_SYM: index into Program::names, OPTYPE_UNRES_*: index into Program::exprs
+		uint64_t val;
+	};
+	inline Operand reg_operand(lex::Register reg) {
+		return Operand { OPTYPE_REG, reg, {}, 0, 0 };
+	}
+	inline Operand imm_operand(uint64_t val) {
+		return Operand { OPTYPE_IMM, {}, {}, 0, val };
+	}
+	inline Operand mem_operand(const ScaledIndexByte &sib) {
+		Operand op = { OPTYPE_SIB, sib.base.value_or(lex::Register {}), sib.index.value_or(lex::Register {}),
+			(uint8_t) (sib.scale.value_or(0) << 3), sib.disp.value_or(0) };
+		op.mem |= (sib.base.has_value() ? MEM_BASE : 0) | (sib.index.has_value() ? MEM_INDEX : 0) |
+			(sib.disp.has_value() ? MEM_DISP : 0);
+		return op;
+	}
+	// an OPTYPE_UNRES_SIB only has its registers, the displacement is whatever the symbols add up to
+	inline ScaledIndexByte memory(const Operand &op) {
+		ScaledIndexByte sib;
+		if (op.mem & MEM_BASE)
+			sib.base = op.reg;
+		if (op.mem & MEM_INDEX)
+			sib.index = op.index;
+		if (op.mem & MEM_DISP)
+			sib.disp = op.type == OPTYPE_SIB ? (uint32_t) op.val : 0;
+		if (op.mem >> 3)
+			sib.scale = op.mem >> 3;
+		return sib;
+	}
+	// up to 3 operands stored inline, so instructions never allocate
+	struct Operands {
+		Operand ops[3];
+		uint8_t count = 0;
+
+		Operands() = default;
+		Operands(std::initializer_list<Operand> list) {
+			for (const Operand &op : list)
+				ops[count++] = op;
+		}
+		size_t size() const { return count; }
+		Operand &operator[](size_t i) { return ops[i]; }
+		const Operand &operator[](size_t i) const { return ops[i]; }
+		const Operand &back() const { return ops[count - 1]; }
+		const Operand *begin() const { return ops; }
+		const Operand *end() const { return ops + count; }
 	};
 	struct Instruction {
 		lex::Instruction type;
-		// either of size 0, 1 or 2
-		// vector might be overkill but whatever
-		std::vector<Operand> operands;
+		Operands operands;
+		// lock prefix, only on read-modify-write instructions with a memory destination
+		bool lock = false;
+	};
+
+	// a list whose elements outlive clear, so that filling it again after a
+	// reset writes into the strings and vectors of the last run's elements
+	// instead of allocating new ones. reads like a vector
+	template <typename T>
+	class Pool {
+		std::vector<T> items;
+		size_t used = 0;
+	public:
+		Pool() = default;
+		Pool(std::initializer_list<T> list) : items(list), used(list.size()) {}
+		size_t size() const { return used; }
+		bool empty() const { return used == 0; }
+		T &operator[](size_t i) { return items[i]; }
+		const T &operator[](size_t i) const { return items[i]; }
+		T &back() { return items[used - 1]; }
+		const T &back() const { return items[used - 1]; }
+		T *begin() { return items.data(); }
+		T *end() { return items.data() + used; }
+		const T *begin() const { return items.data(); }
+		const T *end() const { return items.data() + used; }
+		void clear() { used = 0; }
+		// the next element as the last run left it, every field has to be set
+		T &next() {
+			if (used == items.size())
+				items.emplace_back();
+			return items[used++];
+		}
+		template <typename U>
+		void emplace_back(U &&val) { next() = std::forward<U>(val); }
 	};
 
 	enum DirOperandType {
@@ -36,15 +132,23 @@ namespace parse {
 		DIROPTYPE_IMM,
 		DIROPTYPE_UNRES_IMM,
 		DIROPTYPE_STR_LIT,
+		DIROPTYPE_BIN,
+	};
+	// for INCBIN: the file is only checked while parsing, its contents
+	// are never tokenized and get copied straight into the section
+	struct IncludedBinary {
+		std::string file_name;
+		uint64_t offset, length;
 	};
 	struct DirOperand {
 		DirOperandType type;
-		std::variant<uint64_t, std::string, Unresolved> val;
+		std::variant<uint64_t, std::string, Unresolved, IncludedBinary> val;
 	};
 	struct Directive {
 		lex::Directive type;
-		// supported directives all only have 1 operand
-		DirOperand operand; 		
+		// data directives (db, dw, dd, dq) take a comma separated list
+		// every other directive has exactly 1 operand
+		Pool<DirOperand> operands;
 	};
 	
 	// for EQU
@@ -59,10 +163,63 @@ namespace parse {
 		STMTYPE_DIR,
 		STMTYPE_ASSIGN,
 		STMTYPE_LBL,
+		STMTYPE_TIMES,
 	};
 	struct Statement {
 		StatementType type;
-		std::variant<Instruction, Directive, Assignment, std::string> val;
+		// instructions are kept inline, anything else is an index into the program's
+		// list for its type: directives, assignments, names (labels) or repeats
+		std::variant<Instruction, uint32_t> val;
+		unsigned line_num;
+		// index into the list of source files, for the debug line table
+		uint32_t file = 0;
+	};
+	static_assert(std::is_trivially_copyable_v<Statement>, "statements are copied around as plain bytes");
+
+	// for TIMES: the repeated statement is stored once along with the count
+	struct Repeat {
+		DirOperand count;
+		Statement body;
+	};
+
+	// statements in one contiguous array, and the strings and token lists they refer to
+	struct Program {
+		std::vector<Statement> stmts;
+		// labels and symbol operands, each name once
+		Pool<std::string> names;
+		// open addressing on the hash of a name, index into names + 1 or 0 if empty
+		std::vector<uint32_t> name_index;
+		Pool<Unresolved> exprs;
+		Pool<Directive> directives;
+		Pool<Assignment> assignments;
+		Pool<Repeat> repeats;
+	};
+	uint32_t add_name(Program &program, const std::string &name);
+	// empties program, keeping the memory of everything in it
+	void clear(Program &program);
+
+	inline const Directive &directive(const Program &program, const Statement &stmt) {
+		return program.directives[std::get<uint32_t>(stmt.val)];
+	}
+	inline const Assignment &assignment(const Program &program, const Statement &stmt) {
+		return program.assignments[std::get<uint32_t>(stmt.val)];
+	}
+	inline const std::string &label(const Program &program, const Statement &stmt) {
+		return program.names[std::get<uint32_t>(stmt.val)];
+	}
+	inline const Repeat &repeat(const Program &program, const Statement &stmt) {
+		return program.repeats[std::get<uint32_t>(stmt.val)];
+	}
+	inline const std::string &symbol(const Program &program, const Operand &op) {
+		return program.names[op.val];
+	}
+	inline const Unresolved &expression(const Program &program, const Operand &op) {
+		return program.exprs[op.val];
+	}
+
+	// [begin, end) of one comma separated operand among a line's tokens
+	struct TokenRange {
+		size_t begin, end;
 	};
 
 	void check_unres_imm(const std::vector<lex::Lexeme> &tokens);
@@ -70,7 +227,13 @@ namespace parse {
 	bool check_unres_sib(const std::vector<lex::Lexeme> &tokens);
 	void squash_immediates(std::vector<lex::Lexeme> &tokens, size_t start, size_t end);
 	ScaledIndexByte parse_sib(const std::vector<lex::Lexeme> &tokens);	
-	std::vector<Statement> parse(const std::vector<std::vector<lex::Lexeme>> &tokens);
+	// clears ranges and fills it with the operands of tokens from start on
+	void split_operands(const std::vector<lex::Lexeme> &tokens, size_t start, std::vector<TokenRange> &ranges);
+	// the statement made of tokens from start on, added to ctx.program. operands go
+	// through buffers of ctx, so instructions don't allocate once those have grown
+	Statement parse_statement(context::AssemblerContext &ctx, const std::vector<lex::Lexeme> &tokens, size_t start);
+	// appends the statements of the lines ctx.tokens holds to ctx.program
+	void parse(context::AssemblerContext &ctx, uint32_t file);
 }
 
 #endif
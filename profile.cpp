@@ -0,0 +1,187 @@
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "lex.hpp"
+#include "parse.hpp"
+#include "firstpass.hpp"
+#include "profile.hpp"
+
+std::vector<profile::Sample> profile::read_samples(const std::string &file_name) {
+	std::ifstream file(file_name);
+	if (!file)
+		throw std::runtime_error("cannot open profile " + file_name);
+	std::vector<profile::Sample> samples;
+	std::string line;
+	for (unsigned line_num = 1; std::getline(file, line); line_num++) {
+		std::stringstream fields(line.substr(0, line.find('#')));
+		std::string where, count, extra;
+		if (!(fields >> where))
+			continue;
+		auto error = [&]() {
+			return std::runtime_error(file_name + ":" + std::to_string(line_num) + ": expected a label or address and a count");
+		};
+		if (!(fields >> count) || (fields >> extra))
+			throw error();
+		auto number = [&](const std::string &str) {
+			uint64_t val;
+			if (lex::parse_number(str.data(), str.size(), val) != lex::NUM_OK)
+				throw error();
+			return val;
+		};
+		profile::Sample sample = { "", 0, number(count) };
+		size_t plus = where.find('+');
+		// labels never start with a digit
+		if (where[0] >= '0' && where[0] <= '9')
+			sample.offset = number(where);
+		else {
+			if (plus != std::string::npos)
+				sample.offset = number(where.substr(plus + 1));
+			// the lexer lowercases every symbol
+			for (size_t i = 0; i < std::min(plus, where.size()); i++)
+				sample.label += std::tolower(where[i]);
+		}
+		samples.emplace_back(sample);
+	}
+	return samples;
+}
+
+inline bool is_section(const parse::Program &program, const parse::Statement &stmt) {
+	return stmt.type == parse::STMTYPE_DIR && parse::directive(program, stmt).type == lex::SECTION;
+}
+
+// labels and the statements up to the next one, with every following block
+// they fall through into
+struct Chain {
+	std::vector<uint32_t> stmts;
+	uint64_t heat;
+	size_t blocks;
+};
+
+profile::Report profile::reorder(parse::Program &program, const firstpass::Layout &layout,
+		const std::vector<firstpass::Symbol> &symtab, const std::vector<profile::Sample> &samples) {
+	profile::Report report = { 0, 0, 0 };
+	const std::vector<parse::Statement> &stmts = program.stmts;
+	size_t n = stmts.size(), n_sections = layout.sections.size();
+
+	// statements that belong to each code section, in order
+	std::vector<std::vector<uint32_t>> members(n_sections);
+	for (size_t i = 0; i < n; i++) {
+		uint32_t section = layout.section[i];
+		if (section != UINT32_MAX && layout.sections[section].segment == firstpass::Code && !is_section(program, stmts[i]))
+			members[section].push_back(i);
+	}
+
+	// samples go to the statement they land in
+	std::unordered_map<std::string, const firstpass::Symbol *> labels;
+	for (const firstpass::Symbol &sym : symtab)
+		labels[sym.symbol] = &sym;
+	uint32_t text = UINT32_MAX;
+	for (size_t i = 0; i < n_sections; i++) {
+		if (layout.sections[i].name == ".text")
+			text = i;
+	}
+	std::vector<uint64_t> heat(n);
+	std::vector<bool> sampled(n_sections);
+	for (const profile::Sample &sample : samples) {
+		uint32_t section = text;
+		uint64_t offset = sample.offset;
+		if (!sample.label.empty()) {
+			auto label = labels.find(sample.label);
+			section = label == labels.end() ? UINT32_MAX : label->second->section;
+			offset += label == labels.end() ? 0 : label->second->offset;
+		}
+		if (section == UINT32_MAX || members[section].empty() || offset >= layout.sections[section].size) {
+			report.unmatched++;
+			continue;
+		}
+		// the last statement that starts at or before offset
+		const std::vector<uint32_t> &list = members[section];
+		auto at = std::upper_bound(list.begin(), list.end(), offset, [&](uint64_t val, uint32_t i) {
+			return val < layout.offset[i];
+		});
+		heat[at == list.begin() ? list.front() : *std::prev(at)] += sample.count;
+		sampled[section] = true;
+	}
+
+	// chains of the sampled sections: the first one stays at the start of the
+	// section, then the hot ones hottest first, the cold ones go to <section>.cold
+	std::vector<std::vector<Chain>> hot(n_sections), cold(n_sections);
+	for (size_t section = 0; section < n_sections; section++) {
+		if (!sampled[section])
+			continue;
+		std::vector<Chain> chains = { Chain { {}, 0, 0 } };
+		bool transfer = false;
+		for (uint32_t i : members[section]) {
+			const parse::Statement &stmt = stmts[i];
+			if (stmt.type == parse::STMTYPE_LBL) {
+				if (transfer)
+					chains.emplace_back(Chain { {}, 0, 0 });
+				chains.back().blocks++;
+			}
+			// statements before the section's first label are a block of their own
+			else if (chains.back().blocks == 0)
+				chains.back().blocks++;
+			chains.back().stmts.push_back(i);
+			chains.back().heat += heat[i];
+			// only a jmp or ret at the very end of a block doesn't fall through
+			if (layout.size[i] > 0) {
+				lex::Instruction type = stmt.type == parse::STMTYPE_INSN ?
+					std::get<parse::Instruction>(stmt.val).type : lex::INSN_COUNT;
+				transfer = type == lex::JMP || type == lex::RET;
+			}
+		}
+		hot[section].emplace_back(chains[0]);
+		for (size_t c = 1; c < chains.size(); c++)
+			(chains[c].heat > 0 ? hot : cold)[section].emplace_back(chains[c]);
+		std::stable_sort(hot[section].begin() + 1, hot[section].end(), [](const Chain &a, const Chain &b) {
+			return a.heat > b.heat;
+		});
+		for (const Chain &chain : hot[section])
+			report.hot += chain.blocks;
+		for (const Chain &chain : cold[section])
+			report.cold += chain.blocks;
+	}
+
+	// each reordered section goes where it was first used, the cold parts at the end
+	std::vector<parse::Statement> out;
+	out.reserve(n + 2 * n_sections);
+	auto switch_section = [&](const std::string &name, const parse::Statement &at) {
+		program.directives.emplace_back(parse::Directive {
+			lex::SECTION, { parse::DirOperand { parse::DIROPTYPE_SYM, name } }
+		});
+		out.emplace_back(parse::Statement { parse::STMTYPE_DIR, (uint32_t) (program.directives.size() - 1), at.line_num, at.file });
+	};
+	std::vector<bool> emitted(n_sections);
+	for (size_t i = 0; i < n; i++) {
+		uint32_t section = layout.section[i];
+		if (section == UINT32_MAX || !sampled[section]) {
+			out.push_back(stmts[i]);
+			continue;
+		}
+		if (emitted[section])
+			continue;
+		emitted[section] = true;
+		switch_section(layout.sections[section].name, stmts[i]);
+		for (const Chain &chain : hot[section]) {
+			for (uint32_t j : chain.stmts)
+				out.push_back(stmts[j]);
+		}
+	}
+	for (size_t section = 0; section < n_sections; section++) {
+		if (cold[section].empty())
+			continue;
+		switch_section(layout.sections[section].name + ".cold", stmts[cold[section][0].stmts[0]]);
+		for (const Chain &chain : cold[section]) {
+			for (uint32_t j : chain.stmts)
+				out.push_back(stmts[j]);
+		}
+	}
+	program.stmts = out;
+	return report;
+}
@@ -0,0 +1,36 @@
+#ifndef PROFILE_HPP
+#define PROFILE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "parse.hpp"
+#include "firstpass.hpp"
+
+namespace profile {
+	// count samples at label + offset, or with an empty label at an offset into .text
+	struct Sample {
+		std::string label;
+		uint64_t offset, count;
+	};
+	// one sample per line as "label count", "label+offset count" (the sym+off that
+	// perf script prints) or "address count", # starts a comment
+	std::vector<Sample> read_samples(const std::string &file_name);
+
+	struct Report {
+		size_t hot, cold;
+		// samples that name a label this file doesn't have
+		size_t unmatched;
+	};
+
+	// splits every code section that has samples into blocks at its labels. blocks
+	// that fall through into the next one stay together, the hottest of these chains
+	// go first and the ones without samples move to <section>.cold. layout and
+	// symtab are from the firstpass of program as it was, it has to run again after
+	Report reorder(parse::Program &program, const firstpass::Layout &layout,
+		const std::vector<firstpass::Symbol> &symtab, const std::vector<Sample> &samples);
+}
+
+#endif
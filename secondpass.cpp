@@ -0,0 +1,454 @@
+#include <algorithm>
+#include <cstdint>
+#include <exception>
+#include <string>
+#include <unordered_map>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include <variant>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "lex.hpp"
+#include "parse.hpp"
+#include "encode.hpp"
+#include "firstpass.hpp"
+#include "secondpass.hpp"
+
+// statements per thread, below this starting threads costs more than it saves
+const size_t MIN_CHUNK = 4096;
+
+// an incbin file, mapped once for every statement that copies out of it
+struct MappedFile {
+	const uint8_t *data = nullptr;
+	size_t size = 0;
+	MappedFile() = default;
+	MappedFile(const MappedFile &) = delete;
+	~MappedFile() {
+		if (data)
+			munmap((void *) data, size);
+	}
+};
+
+// everything a symbol can refer to
+struct Symbols {
+	const parse::Program &program;
+	const std::vector<parse::Statement> &stmts;
+	const firstpass::Layout &layout;
+	std::unordered_map<std::string, secondpass::Value> labels;
+	std::unordered_map<std::string, uint32_t> externs;
+	// statement of each equ, and the values of the ones evaluated so far
+	std::unordered_map<std::string, size_t> equs;
+	std::unordered_map<std::string, secondpass::Value> equ_values;
+	// equs currently being evaluated, to catch ones defined in terms of themselves
+	std::unordered_set<std::string> resolving;
+	std::unordered_map<std::string, MappedFile> binaries;
+};
+
+inline secondpass::Value absolute(uint64_t val) {
+	return secondpass::Value { secondpass::ABSOLUTE, 0, val };
+}
+
+// position of statement i, what $ stands for
+inline secondpass::Value position(const firstpass::Layout &layout, size_t i) {
+	if (layout.section[i] == UINT32_MAX)
+		return absolute(0);
+	return secondpass::Value { secondpass::SECTION, layout.section[i], layout.offset[i] };
+}
+
+// at most one side of a sum can be relocatable, and a difference of two
+// values in the same section is a constant
+secondpass::Value add(const secondpass::Value &a, const secondpass::Value &b, bool subtract, uint32_t line_num) {
+	if (b.base == secondpass::ABSOLUTE)
+		return secondpass::Value { a.base, a.index, subtract ? a.val - b.val : a.val + b.val };
+	if (subtract) {
+		if (a.base != b.base || a.index != b.index)
+			lex::assemble_error(line_num, "invalid use of symbols");
+		return absolute(a.val - b.val);
+	}
+	if (a.base != secondpass::ABSOLUTE)
+		lex::assemble_error(line_num, "invalid use of symbols");
+	return secondpass::Value { b.base, b.index, a.val + b.val };
+}
+
+secondpass::Value evaluate(Symbols &symbols, const std::vector<lex::Lexeme> &tokens, size_t start, size_t end,
+	const secondpass::Value &here, uint32_t line_num);
+
+// only reads symbols once every equ has been evaluated, so threads can share them
+secondpass::Value lookup(Symbols &symbols, const std::string &name, uint32_t line_num) {
+	auto label = symbols.labels.find(name);
+	if (label != symbols.labels.end())
+		return label->second;
+	auto ext = symbols.externs.find(name);
+	if (ext != symbols.externs.end())
+		return secondpass::Value { secondpass::EXTERN, ext->second, 0 };
+	auto equ = symbols.equ_values.find(name);
+	if (equ != symbols.equ_values.end())
+		return equ->second;
+	auto stmt = symbols.equs.find(name);
+	if (stmt == symbols.equs.end())
+		lex::assemble_error(line_num, "undefined symbol " + name);
+
+	size_t i = stmt->second;
+	const parse::Assignment &assign = parse::assignment(symbols.program, symbols.stmts[i]);
+	if (assign.is_resolved)
+		return symbols.equ_values[name] = absolute(std::get<uint64_t>(assign.val));
+	if (symbols.resolving.count(name))
+		lex::assemble_error(symbols.stmts[i].line_num, "symbol " + name + " depends on itself");
+	symbols.resolving.insert(name);
+	const std::vector<lex::Lexeme> &tokens = std::get<std::vector<lex::Lexeme>>(assign.val);
+	secondpass::Value val = evaluate(symbols, tokens, 0, tokens.size() - 1, position(symbols.layout, i),
+		symbols.stmts[i].line_num);
+	symbols.resolving.erase(name);
+	return symbols.equ_values[name] = val;
+}
+
+// sum of products, a product with a register in it is part of the address and
+// not the displacement, so it's skipped
+secondpass::Value evaluate(Symbols &symbols, const std::vector<lex::Lexeme> &tokens, size_t start, size_t end,
+		const secondpass::Value &here, uint32_t line_num) {
+	auto factor = [&](const lex::Lexeme &token, bool &has_reg) {
+		switch (token.type) {
+			case lex::LEXTYPE_IMM: return absolute(std::get<lex::Immediate64>(token.data).val);
+			case lex::LEXTYPE_SYMBOL: return lookup(symbols, std::get<std::string>(token.data), line_num);
+			case lex::LEXTYPE_DOLLAR: return here;
+			case lex::LEXTYPE_REG: has_reg = true; return absolute(0);
+			default: lex::assemble_error(line_num, "invalid operand");
+		}
+	};
+
+	secondpass::Value total = absolute(0);
+	bool subtract = false;
+	for (size_t i = start; i <= end; i++) {
+		bool has_reg = false;
+		secondpass::Value term = factor(tokens[i], has_reg);
+		while (i + 2 <= end && (tokens[i + 1].type == lex::LEXTYPE_ASTERISK || tokens[i + 1].type == lex::LEXTYPE_SLASH)) {
+			secondpass::Value rhs = factor(tokens[i + 2], has_reg);
+			if (!has_reg && (term.base != secondpass::ABSOLUTE || rhs.base != secondpass::ABSOLUTE))
+				lex::assemble_error(line_num, "invalid use of symbols");
+			if (tokens[i + 1].type == lex::LEXTYPE_SLASH && rhs.val == 0 && !has_reg)
+				lex::assemble_error(line_num, "division by zero");
+			if (!has_reg)
+				term.val = tokens[i + 1].type == lex::LEXTYPE_ASTERISK ? term.val * rhs.val : term.val / rhs.val;
+			i += 2;
+		}
+		if (!has_reg)
+			total = add(total, term, subtract, line_num);
+		if (i + 1 <= end)
+			subtract = tokens[++i].type == lex::LEXTYPE_MINUS_SIGN;
+	}
+	return total;
+}
+
+secondpass::Value operand_value(Symbols &symbols, const parse::Operand &op, const secondpass::Value &here, uint32_t line_num) {
+	switch (op.type) {
+		case parse::OPTYPE_SYM:
+			return lookup(symbols, parse::symbol(symbols.program, op), line_num);
+		case parse::OPTYPE_IMM:
+			return absolute(op.val);
+		case parse::OPTYPE_UNRES_IMM: {
+			const parse::Unresolved &tokens = parse::expression(symbols.program, op);
+			return evaluate(symbols, tokens, 0, tokens.size() - 1, here, line_num);
+		}
+		case parse::OPTYPE_UNRES_SIB: {
+			// without the brackets
+			const parse::Unresolved &tokens = parse::expression(symbols.program, op);
+			return evaluate(symbols, tokens, 1, tokens.size() - 2, here, line_num);
+		}
+		default:
+			lex::assemble_error(line_num, "invalid operand");
+	}
+}
+
+inline void put(std::vector<uint8_t> &out, uint64_t offset, uint64_t val, uint32_t size) {
+	for (uint32_t i = 0; i < size; i++)
+		out[offset + i] = (val >> (i * 8)) & 0xff;
+}
+
+// val fits in size bytes, signed or unsigned unless it's going to be sign extended
+inline bool fits(uint64_t val, uint32_t size, bool is_signed) {
+	if (size >= 8)
+		return true;
+	int64_t sval = (int64_t) val, limit = (int64_t) 1 << (size * 8 - 1);
+	if (sval >= -limit && sval < limit)
+		return true;
+	return !is_signed && val < ((uint64_t) 1 << (size * 8));
+}
+
+inline secondpass::RelocType reloc_type(uint32_t size, bool is_signed) {
+	switch (size) {
+		case 1: return secondpass::RELOC_8;
+		case 2: return secondpass::RELOC_16;
+		case 4: return is_signed ? secondpass::RELOC_32S : secondpass::RELOC_32;
+		default: return secondpass::RELOC_64;
+	}
+}
+
+// statements in a range of the list, each one writes its own bytes of the shared
+// section contents, relocations are joined in order once every chunk is done
+struct Chunk {
+	std::vector<std::vector<uint8_t>> &contents;
+	std::vector<std::vector<secondpass::Relocation>> relocs;
+	// line table rows of each code section, only with debug lines
+	std::vector<std::vector<dwarf::Row>> rows;
+	std::exception_ptr error;
+};
+
+// a value of size bytes at offset into section, either written out or left as a relocation
+void store(Chunk &chunk, uint32_t section, uint64_t offset, const secondpass::Value &val,
+		uint32_t size, bool is_signed, uint32_t line_num) {
+	if (val.base != secondpass::ABSOLUTE) {
+		chunk.relocs[section].emplace_back(secondpass::Relocation { offset, reloc_type(size, is_signed), val });
+		return;
+	}
+	if (!fits(val.val, size, is_signed))
+		lex::assemble_error(line_num, "value out of range");
+	put(chunk.contents[section], offset, val.val, size);
+}
+
+void encode_insn(Symbols &symbols, Chunk &chunk, const parse::Instruction &insn, uint32_t line_num,
+		uint32_t section, uint64_t offset, bool short_branch) {
+	secondpass::Value here = { secondpass::SECTION, section, offset };
+	std::vector<uint8_t> &contents = chunk.contents[section];
+	if (short_branch) {
+		// firstpass already checked the target is a label in range
+		int64_t rel = lookup(symbols, parse::symbol(symbols.program, insn.operands[0]), line_num).val - (offset + 2);
+		encode::Bytes bytes = encode::encode_short_branch(insn.type, rel);
+		std::copy(bytes.begin(), bytes.end(), contents.begin() + offset);
+		return;
+	}
+
+	std::vector<encode::Fixup> fixups;
+	encode::Bytes bytes = encode::encode(insn, line_num, &fixups);
+	std::copy(bytes.begin(), bytes.end(), contents.begin() + offset);
+	uint64_t end = offset + bytes.size();
+	for (const encode::Fixup &fixup : fixups) {
+		secondpass::Value val = operand_value(symbols, insn.operands[fixup.operand], here, line_num);
+		if (!fixup.pc_relative) {
+			store(chunk, section, offset + fixup.offset, val, fixup.size, fixup.is_signed, line_num);
+			continue;
+		}
+		if (val.base == secondpass::ABSOLUTE)
+			lex::assemble_error(line_num, "branch target must be a symbol");
+		if (val.base == secondpass::SECTION && val.index == section) {
+			int64_t rel = val.val - end;
+			if (rel < INT32_MIN || rel > INT32_MAX)
+				lex::assemble_error(line_num, "branch target out of range");
+			put(contents, offset + fixup.offset, rel, 4);
+			continue;
+		}
+		// relative to the field, the instruction ends after it
+		val.val -= end - (offset + fixup.offset);
+		chunk.relocs[section].emplace_back(secondpass::Relocation {
+			offset + fixup.offset,
+			val.base == secondpass::EXTERN ? secondpass::RELOC_PLT32 : secondpass::RELOC_PC32,
+			val
+		});
+	}
+}
+
+void emit_data(Symbols &symbols, Chunk &chunk, const parse::Directive &dir, uint32_t line_num,
+		uint32_t section, uint64_t offset) {
+	secondpass::Value here = { secondpass::SECTION, section, offset };
+	uint32_t unit = firstpass::data_unit(dir.type);
+	for (const parse::DirOperand &operand : dir.operands) {
+		if (operand.type == parse::DIROPTYPE_STR_LIT) {
+			const std::string &str = std::get<std::string>(operand.val);
+			std::copy(str.begin(), str.end(), chunk.contents[section].begin() + offset);
+			offset += str.size();
+			continue;
+		}
+		secondpass::Value val = absolute(0);
+		if (operand.type == parse::DIROPTYPE_IMM)
+			val = absolute(std::get<uint64_t>(operand.val));
+		else {
+			const parse::Unresolved &tokens = std::get<parse::Unresolved>(operand.val);
+			val = evaluate(symbols, tokens, 0, tokens.size() - 1, here, line_num);
+		}
+		store(chunk, section, offset, val, unit, false, line_num);
+		offset += unit;
+	}
+}
+
+void emit(Symbols &symbols, Chunk &chunk, const parse::Statement &stmt, uint32_t section,
+		uint64_t offset, uint64_t size, bool short_branch, bool code) {
+	std::vector<uint8_t> &contents = chunk.contents[section];
+	if (stmt.type == parse::STMTYPE_INSN) {
+		encode_insn(symbols, chunk, std::get<parse::Instruction>(stmt.val), stmt.line_num, section, offset, short_branch);
+		return;
+	}
+	if (stmt.type == parse::STMTYPE_TIMES) {
+		const parse::Repeat &repeat = parse::repeat(symbols.program, stmt);
+		uint64_t count = std::get<uint64_t>(repeat.count.val);
+		if (count == 0)
+			return;
+		// $ moves along with every copy
+		uint64_t unit = size / count;
+		for (uint64_t i = 0; i < count; i++)
+			emit(symbols, chunk, repeat.body, section, offset + i * unit, unit, false, code);
+		return;
+	}
+	if (stmt.type != parse::STMTYPE_DIR)
+		return;
+
+	const parse::Directive &dir = parse::directive(symbols.program, stmt);
+	switch (dir.type) {
+		case lex::DB: case lex::DW: case lex::DD: case lex::DQ:
+			emit_data(symbols, chunk, dir, stmt.line_num, section, offset);
+			break;
+		case lex::INCBIN: {
+			const parse::IncludedBinary &bin = std::get<parse::IncludedBinary>(dir.operands[0].val);
+			const MappedFile &file = symbols.binaries.at(bin.file_name);
+			std::copy_n(file.data + bin.offset, bin.length, contents.begin() + offset);
+			break;
+		}
+		case lex::ALIGN: {
+			// code is padded with nops unless a fill byte is given
+			if (dir.operands.size() == 1 && code) {
+				std::vector<uint8_t> nops;
+				encode::nop_padding(nops, size);
+				std::copy(nops.begin(), nops.end(), contents.begin() + offset);
+			}
+			else if (dir.operands.size() == 2)
+				std::fill_n(contents.begin() + offset, size, std::get<uint64_t>(dir.operands[1].val));
+			break;
+		}
+		// resb, resw, resd, resq are already zero
+		default:
+			break;
+	}
+}
+
+void map_binary(Symbols &symbols, const parse::IncludedBinary &bin, uint32_t line_num) {
+	if (!symbols.binaries.count(bin.file_name)) {
+		MappedFile &file = symbols.binaries[bin.file_name];
+		int fd = open(bin.file_name.c_str(), O_RDONLY);
+		struct stat info;
+		if (fd < 0 || fstat(fd, &info)) {
+			if (fd >= 0)
+				close(fd);
+			lex::assemble_error(line_num, "cannot read incbin file " + bin.file_name);
+		}
+		file.size = info.st_size;
+		void *data = file.size ? mmap(nullptr, file.size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+		close(fd);
+		if (data == MAP_FAILED)
+			lex::assemble_error(line_num, "cannot read incbin file " + bin.file_name);
+		file.data = (const uint8_t *) data;
+	}
+	const MappedFile &file = symbols.binaries.at(bin.file_name);
+	// the file can have changed since parse checked it
+	if (bin.offset > file.size || bin.length > file.size - bin.offset)
+		lex::assemble_error(line_num, "incbin file " + bin.file_name + " is shorter than offset + length");
+}
+
+secondpass::Output secondpass::secondpass(const parse::Program &program, const firstpass::Layout &layout,
+		const std::vector<firstpass::Symbol> &symtab, bool debug_lines, unsigned threads) {
+	const std::vector<parse::Statement> &stmts = program.stmts;
+	secondpass::Output out;
+	Symbols symbols = { program, stmts, layout, {}, {}, {}, {}, {}, {} };
+	for (const firstpass::Symbol &sym : symtab)
+		symbols.labels[sym.symbol] = secondpass::Value { secondpass::SECTION, sym.section, sym.offset };
+
+	for (size_t i = 0; i < stmts.size(); i++) {
+		if (stmts[i].type == parse::STMTYPE_ASSIGN) {
+			const std::string &name = parse::assignment(program, stmts[i]).symbol;
+			if (symbols.labels.count(name) || symbols.equs.count(name))
+				lex::assemble_error(stmts[i].line_num, "symbol " + name + " redefined");
+			symbols.equs[name] = i;
+		}
+		if (stmts[i].type != parse::STMTYPE_DIR)
+			continue;
+		const parse::Directive &dir = parse::directive(program, stmts[i]);
+		if (dir.type != lex::GLOBAL && dir.type != lex::EXTERN)
+			continue;
+		const std::string &name = std::get<std::string>(dir.operands[0].val);
+		if (dir.type == lex::GLOBAL && !symbols.labels.count(name))
+			lex::assemble_error(stmts[i].line_num, "global symbol " + name + " is not defined");
+		if (dir.type == lex::EXTERN && (symbols.labels.count(name) || symbols.equs.count(name)))
+			lex::assemble_error(stmts[i].line_num, "symbol " + name + " redefined");
+		if (dir.type == lex::GLOBAL && std::find(out.globals.begin(), out.globals.end(), name) == out.globals.end())
+			out.globals.emplace_back(name);
+		if (dir.type == lex::EXTERN && !symbols.externs.count(name)) {
+			symbols.externs[name] = out.externs.size();
+			out.externs.emplace_back(name);
+		}
+	}
+
+	// every equ in order, after this the symbols are only read
+	for (size_t i = 0; i < stmts.size(); i++) {
+		if (stmts[i].type == parse::STMTYPE_ASSIGN)
+			lookup(symbols, parse::assignment(program, stmts[i]).symbol, stmts[i].line_num);
+	}
+
+	// incbin files are mapped up front, the chunks only copy out of them
+	for (const parse::Statement &stmt : stmts) {
+		if (stmt.type == parse::STMTYPE_DIR && parse::directive(program, stmt).type == lex::INCBIN)
+			map_binary(symbols, std::get<parse::IncludedBinary>(parse::directive(program, stmt).operands[0].val), stmt.line_num);
+	}
+
+	size_t n_sections = layout.sections.size();
+	out.contents.resize(n_sections);
+	out.relocs.resize(n_sections);
+	for (size_t i = 0; i < n_sections; i++)
+		out.contents[i].resize(layout.sections[i].size);
+
+	// the layout fixed where every statement goes, so ranges of statements can be
+	// encoded straight into place independently of each other
+	size_t n = stmts.size();
+	if (threads == 0)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	size_t n_chunks = std::max<size_t>(1, std::min<size_t>(threads, n / MIN_CHUNK));
+	std::vector<Chunk> chunks;
+	for (size_t c = 0; c < n_chunks; c++)
+		chunks.emplace_back(Chunk { out.contents, std::vector<std::vector<secondpass::Relocation>>(n_sections),
+			std::vector<std::vector<dwarf::Row>>(debug_lines ? n_sections : 0), nullptr });
+	auto run = [&](size_t c) {
+		try {
+			for (size_t i = n * c / n_chunks; i < n * (c + 1) / n_chunks; i++) {
+				uint32_t section = layout.section[i];
+				if (section == UINT32_MAX)
+					continue;
+				bool code = layout.sections[section].segment == firstpass::Code;
+				emit(symbols, chunks[c], stmts[i], section, layout.offset[i], layout.size[i], layout.short_branch[i], code);
+				if (debug_lines && code && layout.size[i] > 0)
+					chunks[c].rows[section].emplace_back(dwarf::Row { layout.offset[i], stmts[i].file, stmts[i].line_num });
+			}
+		}
+		catch (...) {
+			chunks[c].error = std::current_exception();
+		}
+	};
+	std::vector<std::thread> workers;
+	for (size_t c = 1; c < n_chunks; c++)
+		workers.emplace_back(run, c);
+	run(0);
+	for (std::thread &worker : workers)
+		worker.join();
+
+	// the first error in the file is the first error of the earliest chunk that has one
+	for (const Chunk &chunk : chunks) {
+		if (chunk.error)
+			std::rethrow_exception(chunk.error);
+	}
+	for (const Chunk &chunk : chunks) {
+		for (size_t i = 0; i < n_sections; i++)
+			out.relocs[i].insert(out.relocs[i].end(), chunk.relocs[i].begin(), chunk.relocs[i].end());
+	}
+	// rows are deltas from the previous one, so each chunk's rows are added after
+	// those of the chunk before it
+	if (debug_lines) {
+		for (size_t i = 0; i < n_sections; i++) {
+			out.lines.emplace_back(dwarf::LineSequence { (uint32_t) i, {}, 0, 0, 0, 0 });
+			for (const Chunk &chunk : chunks) {
+				for (const dwarf::Row &row : chunk.rows[i])
+					dwarf::add_row(out.lines[i], row.address, row.file, row.line);
+			}
+			dwarf::end_sequence(out.lines[i], layout.sections[i].size);
+		}
+	}
+	return out;
+}
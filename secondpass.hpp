@@ -0,0 +1,57 @@
+#ifndef SECONDPASS_HPP
+#define SECONDPASS_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "parse.hpp"
+#include "firstpass.hpp"
+#include "dwarf.hpp"
+
+namespace secondpass {
+	enum Base {
+		ABSOLUTE,
+		// offset into one of our sections
+		SECTION,
+		// offset from an extern symbol
+		EXTERN,
+	};
+	struct Value {
+		Base base;
+		// section or extern number
+		uint32_t index;
+		uint64_t val;
+	};
+
+	enum RelocType {
+		RELOC_8, RELOC_16, RELOC_32, RELOC_32S, RELOC_64,
+		RELOC_PC32, RELOC_PLT32,
+	};
+	// target.val is the addend
+	struct Relocation {
+		uint64_t offset;
+		RelocType type;
+		Value target;
+	};
+
+	struct Output {
+		// indexed like the sections of the layout
+		std::vector<std::vector<uint8_t>> contents;
+		std::vector<std::vector<Relocation>> relocs;
+		std::vector<std::string> externs;
+		// names of labels declared global
+		std::vector<std::string> globals;
+		// one per section with rows for the code ones, only filled in with debug_lines
+		std::vector<dwarf::LineSequence> lines;
+	};
+
+	// resolves symbols and writes every statement where the layout put it,
+	// references to other sections and extern symbols are left as relocations.
+	// ranges of statements are encoded on up to threads threads (0 for one per
+	// core), the output doesn't depend on how many
+	Output secondpass(const parse::Program &program, const firstpass::Layout &layout,
+		const std::vector<firstpass::Symbol> &symtab, bool debug_lines, unsigned threads);
+}
+
+#endif
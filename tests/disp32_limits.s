@@ -0,0 +1,4 @@
+section .text
+	mov rax, [rax+0x7fffffff]
+	mov rax, [rax+-0x80000000]
+	mov rax, [0x7fffffff]
@@ -0,0 +1,3 @@
+; expect: displacement larger than 32 bits
+section .text
+	mov rax, [rax+0x100000000]
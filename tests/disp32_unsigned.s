@@ -0,0 +1,4 @@
+; expect: displacement larger than 32 bits
+; sign extended, so 0x80000000 would turn into -0x80000000
+section .text
+	mov rax, [rbx+rcx*4+0x80000000]
@@ -0,0 +1,23 @@
+#!/bin/sh
+# assembles every tests/*.s. a file with an "; expect: <message>" line has to
+# fail with that message, any other file has to assemble
+cd "$(dirname "$0")/.."
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+failed=0
+for file in tests/*.s; do
+	expect=$(sed -n 's/^; expect: //p' "$file")
+	# errors end jasm with an uncaught exception, running it in an inner shell
+	# catches the "Aborted" that gets reported along with the message
+	errors=$(sh -c './jasm --no-cache "$1" -o "$2/test.o"' sh "$file" "$out" 2>&1)
+	status=$?
+	if [ -n "$expect" ] && { [ $status -eq 0 ] || ! printf '%s' "$errors" | grep -qF "$expect"; }; then
+		echo "$file: expected error '$expect', got: $errors"
+		failed=1
+	elif [ -z "$expect" ] && [ $status -ne 0 ]; then
+		echo "$file: $errors"
+		failed=1
+	fi
+done
+[ $failed -eq 0 ] && echo "all tests passed"
+exit $failed